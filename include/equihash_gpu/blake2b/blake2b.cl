@@ -318,6 +318,101 @@ void blake2b_init(private blake2b_state * state)
   state->buflen = 0;
 }
 
+// Leaf hashing from a precomputed midstate, mirrors Blake2bMidstate on the host
+// Every block but the last is compressed by the host, the last one only misses the index
+typedef struct
+{
+  uint64_t hash_state[8];
+  uint64_t block[16];
+  uint64_t length;
+  uint32_t index_offset;
+  uint32_t digest_length;
+} blake2b_midstate;
+
+// Hashes the final block with the index placed at its offset
+// The compression is written out with the message schedule as literals so the
+// whole block and work vector stay in registers
+void blake2b_leaf_hash(global const blake2b_midstate * midstate, uint32_t index, private uint64_t * out)
+{
+  private uint64_t m[16];
+  private uint64_t v0, v1, v2, v3, v4, v5, v6, v7, v8, v9, v10, v11, v12, v13, v14, v15;
+  const uint32_t word = midstate->index_offset / 8;
+  const uint32_t shift = (midstate->index_offset % 8) * 8;
+  const uint64_t low = (uint64_t)index << shift;
+  const uint64_t high = shift > 32 ? (uint64_t)index >> (64 - shift) : 0;
+  private uint8_t i;
+
+  // Selects instead of indexing by word, so the block is not spilled to memory
+  #pragma unroll 16
+  for(i=0;i<16;++i)
+  {
+    m[i] = midstate->block[i] | (i == word ? low : 0) | (i == word + 1 ? high : 0);
+  }
+
+  v0 = midstate->hash_state[0];
+  v1 = midstate->hash_state[1];
+  v2 = midstate->hash_state[2];
+  v3 = midstate->hash_state[3];
+  v4 = midstate->hash_state[4];
+  v5 = midstate->hash_state[5];
+  v6 = midstate->hash_state[6];
+  v7 = midstate->hash_state[7];
+  v8 =  0x6A09E667F3BCC908;
+  v9 =  0xBB67AE8584CAA73B;
+  v10 = 0x3C6EF372FE94F82B;
+  v11 = 0xA54FF53A5F1D36F1;
+  v12 = 0x510E527FADE682D1 ^ midstate->length;
+  v13 = 0x9B05688C2B3E6C1F;
+  v14 = ~0x1F83D9ABFB41BD6B;
+  v15 = 0x5BE0CD19137E2179;
+
+#define LEAF_MIX(a, b, c, d, x, y) { \
+    a = a + b + x;                   \
+    d = ROTR64(d ^ a, 32);           \
+    c = c + d;                       \
+    b = ROTR64(b ^ c, 24);           \
+    a = a + b + y;                   \
+    d = ROTR64(d ^ a, 16);           \
+    c = c + d;                       \
+    b = ROTR64(b ^ c, 63);           \
+  }
+
+#define LEAF_ROUND(s0, s1, s2, s3, s4, s5, s6, s7, s8, s9, s10, s11, s12, s13, s14, s15) \
+  LEAF_MIX(v0, v4, v8,  v12, m[s0],  m[s1]);  \
+  LEAF_MIX(v1, v5, v9,  v13, m[s2],  m[s3]);  \
+  LEAF_MIX(v2, v6, v10, v14, m[s4],  m[s5]);  \
+  LEAF_MIX(v3, v7, v11, v15, m[s6],  m[s7]);  \
+  LEAF_MIX(v0, v5, v10, v15, m[s8],  m[s9]);  \
+  LEAF_MIX(v1, v6, v11, v12, m[s10], m[s11]); \
+  LEAF_MIX(v2, v7, v8,  v13, m[s12], m[s13]); \
+  LEAF_MIX(v3, v4, v9,  v14, m[s14], m[s15]);
+
+  LEAF_ROUND( 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15);
+  LEAF_ROUND(14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3);
+  LEAF_ROUND(11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4);
+  LEAF_ROUND( 7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8);
+  LEAF_ROUND( 9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13);
+  LEAF_ROUND( 2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9);
+  LEAF_ROUND(12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11);
+  LEAF_ROUND(13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10);
+  LEAF_ROUND( 6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5);
+  LEAF_ROUND(10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0);
+  LEAF_ROUND( 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15);
+  LEAF_ROUND(14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3);
+
+#undef LEAF_MIX
+#undef LEAF_ROUND
+
+  out[0] = midstate->hash_state[0] ^ v0 ^ v8;
+  out[1] = midstate->hash_state[1] ^ v1 ^ v9;
+  out[2] = midstate->hash_state[2] ^ v2 ^ v10;
+  out[3] = midstate->hash_state[3] ^ v3 ^ v11;
+  out[4] = midstate->hash_state[4] ^ v4 ^ v12;
+  out[5] = midstate->hash_state[5] ^ v5 ^ v13;
+  out[6] = midstate->hash_state[6] ^ v6 ^ v14;
+  out[7] = midstate->hash_state[7] ^ v7 ^ v15;
+}
+
 // GPU Hash impl of blake2b, receives as input:
 // in_message - The message to hash
 // out_hash - The buffer to store the resulting hash
@@ -341,4 +436,31 @@ kernel void blake2b_gpu_hash(global const uint8_t * in_message,
 
   // Finalize the hash and write it out
   blake2b_finalize_hash(&state, out_hash, out_hash_size);
-}
\ No newline at end of file
+}
+
+// Leaf hashing the generic way, continues a copy of the full state with the index
+// Each work item hashes the leaf of its global index, kept for benchmarking against the midstate path
+kernel void blake2b_gpu_leaf_hash_generic(global const blake2b_state * initial_state,
+                                          global uint8_t * out_hash,
+                                          const uint32_t out_hash_size)
+{
+  private blake2b_state state = *initial_state;
+  private uint64_t digest[8];
+  private uint32_t index = get_global_id(0);
+
+  blake2b_update_priv(&state, (private uint8_t*)&index, sizeof(index));
+  blake2b_finalize_hash_priv(&state, (private uint8_t*)digest, out_hash_size);
+  blake2b_copy_glob2(out_hash + index*out_hash_size, (private uint8_t*)digest, out_hash_size);
+}
+
+// Leaf hashing from the midstate, same output as blake2b_gpu_leaf_hash_generic
+kernel void blake2b_gpu_leaf_hash(global const blake2b_midstate * midstate,
+                                  global uint8_t * out_hash,
+                                  const uint32_t out_hash_size)
+{
+  private uint64_t digest[8];
+  private uint32_t index = get_global_id(0);
+
+  blake2b_leaf_hash(midstate, index, digest);
+  blake2b_copy_glob2(out_hash + index*out_hash_size, (private uint8_t*)digest, out_hash_size);
+}
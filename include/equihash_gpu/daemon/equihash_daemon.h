@@ -0,0 +1,61 @@
+/**
+ * @file equihash_daemon.h
+ * @author ofir iluz (iluzofir@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2018-12-18
+ *
+ * @copyright Copyright (c) 2018
+ *
+ */
+
+#ifndef EQUIHASHGPU_EQUIHASH_DAEMON_H_
+#define EQUIHASHGPU_EQUIHASH_DAEMON_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include "equihash_gpu/daemon/equihash_protocol.h"
+#include "equihash_gpu/equihash/equihash_solver.h"
+
+namespace Equihash
+{
+    // Creates the solver of an (N, K) the first time a job asks for it
+    typedef std::function<IEquihashSolver*(uint32_t N, uint32_t K, uint32_t seed[SEED_SIZE])> SolverFactory;
+
+    // Keeps the solvers, and with them the devices, buffers and built programs, alive between jobs
+    // Jobs come in over a unix domain socket, a connection runs a single job at a time
+    // and a new job preempts the running one
+    class EquihashDaemon
+    {
+    private:
+        std::string socket_path_;
+        SolverFactory factory_;
+        int listen_fd_;
+        std::atomic<bool> running_;
+        std::map<std::pair<uint32_t, uint32_t>, std::unique_ptr<IEquihashSolver>> solvers_;
+
+    private:
+        IEquihashSolver * get_solver(DaemonJob & job);
+        void serve_connection(int fd);
+
+    public:
+        EquihashDaemon(const std::string & socket_path, SolverFactory factory);
+        virtual ~EquihashDaemon();
+
+        // Sets up the solver of (N, K) before any job asks for it
+        bool warm_up(uint32_t N, uint32_t K);
+
+        // Accepts connections until stop is called, false if the socket could not be opened
+        bool run();
+        // Safe to call from a signal handler, run returns within a poll interval
+        void stop();
+    };
+}
+
+#endif
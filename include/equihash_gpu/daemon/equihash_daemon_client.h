@@ -0,0 +1,46 @@
+/**
+ * @file equihash_daemon_client.h
+ * @author ofir iluz (iluzofir@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2018-12-18
+ *
+ * @copyright Copyright (c) 2018
+ *
+ */
+
+#ifndef EQUIHASHGPU_EQUIHASH_DAEMON_CLIENT_H_
+#define EQUIHASHGPU_EQUIHASH_DAEMON_CLIENT_H_
+
+#include <string>
+#include "equihash_gpu/daemon/equihash_protocol.h"
+#include "equihash_gpu/equihash/equihash_solver.h"
+
+namespace Equihash
+{
+    class EquihashDaemonClient
+    {
+    private:
+        int fd_;
+        std::string error_;
+
+    public:
+        EquihashDaemonClient();
+        virtual ~EquihashDaemonClient();
+
+        bool connect(const std::string & socket_path);
+        void disconnect();
+
+        // A job submitted while another is running preempts it, the old job still ends with its result
+        bool submit_job(const DaemonJob & job);
+        bool cancel();
+
+        // Hands every solution of the job to the callback until its result comes in
+        // False if the daemon refused the job or the connection broke, see get_error
+        bool wait_job(const SolutionCallback & callback, DaemonJobResult & result);
+
+        const std::string & get_error() const;
+    };
+}
+
+#endif
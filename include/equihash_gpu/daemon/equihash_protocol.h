@@ -0,0 +1,76 @@
+/**
+ * @file equihash_protocol.h
+ * @author ofir iluz (iluzofir@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2018-12-18
+ *
+ * @copyright Copyright (c) 2018
+ *
+ */
+
+#ifndef EQUIHASHGPU_EQUIHASH_PROTOCOL_H_
+#define EQUIHASHGPU_EQUIHASH_PROTOCOL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "equihash_gpu/equihash/equihash_util.h"
+
+// Every frame is a little endian uint32 payload length, a uint8 type and the payload
+#define FRAME_HEADER_SIZE 5
+#define MAX_FRAME_PAYLOAD (1 << 20)
+
+namespace Equihash
+{
+    enum DaemonFrameType
+    {
+        FRAME_JOB = 1,      // Client -> daemon, DaemonJob, a header job appends its header and nonce
+        FRAME_CANCEL = 2,   // Client -> daemon, empty, cancels the running job
+        FRAME_SOLUTION = 3, // Daemon -> client, uint32 nonce followed by the minimal solution
+        FRAME_DONE = 4,     // Daemon -> client, DaemonJobResult, the last frame of a job
+        FRAME_ERROR = 5     // Daemon -> client, text, the job was not started
+    };
+
+    struct DaemonJob
+    {
+        uint32_t N, K;
+        uint32_t seed[SEED_SIZE];
+        uint32_t first_nonce;
+        uint32_t amount;
+        bool stop_on_first;
+        // A job with a header hashes it and the nonce instead of the seed
+        std::vector<uint8_t> header;
+        uint8_t nonce[EQUIHASH_NONCE_SIZE];
+    };
+
+    struct DaemonJobResult
+    {
+        uint32_t solved_nonces;
+        uint32_t solutions;
+        bool cancelled;
+    };
+
+    class EquihashProtocol
+    {
+    public:
+        // Both block until the whole frame went through, false on a closed or broken socket
+        static bool write_frame(int fd, uint8_t type, const std::vector<uint8_t> & payload);
+        static bool read_frame(int fd, uint8_t & type, std::vector<uint8_t> & payload);
+
+        static std::vector<uint8_t> encode_job(const DaemonJob & job);
+        static bool decode_job(const std::vector<uint8_t> & payload, DaemonJob & job);
+
+        static std::vector<uint8_t> encode_result(const DaemonJobResult & result);
+        static bool decode_result(const std::vector<uint8_t> & payload, DaemonJobResult & result);
+
+        static std::vector<uint8_t> encode_solution(uint32_t nonce, const std::vector<uint8_t> & solution);
+        static bool decode_solution(const std::vector<uint8_t> & payload, uint32_t & nonce, std::vector<uint8_t> & solution);
+
+        static std::vector<uint8_t> encode_error(const std::string & error);
+        static std::string decode_error(const std::vector<uint8_t> & payload);
+    };
+}
+
+#endif
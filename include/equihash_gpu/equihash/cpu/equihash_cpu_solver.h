@@ -0,0 +1,88 @@
+/**
+ * @file equihash_cpu_solver.h
+ * @author ofir iluz (iluzofir@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2018-11-24
+ *
+ * @copyright Copyright (c) 2018
+ *
+ */
+
+#ifndef EQUIHASHGPU_EQUIHASH_CPU_SOLVER_H_
+#define EQUIHASHGPU_EQUIHASH_CPU_SOLVER_H_
+
+#include <stdint.h>
+#include <iostream>
+#include <vector>
+#include "equihash_gpu/equihash/equihash_solver.h"
+#include "equihash_gpu/equihash/equihash_util.h"
+#include "equihash_gpu/equihash/equihash_verifier.h"
+#include "equihash_gpu/util/ThreadPool.h"
+
+#define CPU_BUCKET_BITS 12
+#define MAX_COLLISION_GROUP_SIZE 16
+
+namespace Equihash
+{
+    class EquihashCPUSolver : public IEquihashSolver
+    {
+    private:
+        // A single level of the wagner tree, each row holds the hash bytes that are left
+        // and the two rows of the previous level that were combined into it
+        struct CollisionTable
+        {
+            uint32_t width;
+            uint32_t rows;
+            std::vector<uint8_t> hashes;
+            std::vector<uint32_t> parents;
+        };
+
+        // Rows of a table sorted by their bucket, key is the current collision block
+        struct BucketEntry
+        {
+            uint32_t key;
+            uint32_t row;
+        };
+
+        EquihashContext equihash_context_;
+        ThreadPool thread_pool_;
+        EquihashInput equihash_input_;
+        std::vector<CollisionTable> tables_;
+        std::vector<BucketEntry> bucket_entries_;
+        std::vector<uint32_t> bucket_offsets_;
+        uint32_t bucket_bits_;
+
+    private:
+        void initialize_context();
+        void generate_leaves(size_t nonce);
+        void sort_into_buckets(const CollisionTable & table);
+        void collision_round(uint32_t round);
+        std::vector<std::pair<uint32_t, uint32_t>> final_round();
+        void collect_leaves(uint32_t level, uint32_t row, uint32_t * indices);
+        bool rebuild_indices(uint32_t left, uint32_t right, std::vector<uint32_t> & indices);
+        std::vector<Proof> collect_solutions(size_t nonce,
+                                             const std::vector<std::pair<uint32_t, uint32_t>> & candidates);
+
+    protected:
+        virtual size_t solve_range(size_t first_nonce, size_t amount, bool stop_on_first,
+                                   const SolutionCallback & callback, const std::atomic<bool> & cancel) override;
+
+    public:
+        // Zero threads means one per hardware core
+        EquihashCPUSolver(uint32_t N, uint32_t K, uint32_t seed[SEED_SIZE], size_t threads = 0);
+        virtual ~EquihashCPUSolver();
+
+        std::vector<Proof> solve_nonce(size_t nonce);
+        std::vector<Proof> solve_nonce(size_t nonce, const std::atomic<bool> & cancel);
+        // Takes the input of another solver of the same (N, K), so both solve the same nonces
+        void set_input(const EquihashInput & input);
+
+        virtual std::vector<Proof> find_proof() override;
+        virtual bool verify_proof(const Proof & proof) override;
+        virtual void set_seed(const uint32_t seed[SEED_SIZE]) override;
+        virtual bool set_header(const std::vector<uint8_t> & header, const uint8_t nonce[EQUIHASH_NONCE_SIZE]) override;
+    };
+}
+
+#endif
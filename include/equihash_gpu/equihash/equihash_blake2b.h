@@ -0,0 +1,79 @@
+/**
+ * @file equihash_blake2b.h
+ * @author ofir iluz (iluzofir@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2018-12-16
+ *
+ * @copyright Copyright (c) 2018
+ *
+ */
+
+#ifndef EQUIHASHGPU_EQUIHASH_BLAKE2B_H_
+#define EQUIHASHGPU_EQUIHASH_BLAKE2B_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <blake2.h>
+
+#define BLAKE2B_WORDS 16
+#define BLAKE2B_MAX_LANES 8
+#define LEAF_INDEX_SIZE sizeof(uint32_t)
+
+namespace Equihash
+{
+    // The state all of the leaf hashes of a nonce start from
+    // Every whole block of the prefix is already compressed, the final block only misses the index
+    // Note that the layout is mirrored by blake2b_midstate on the GPU
+    struct Blake2bMidstate
+    {
+        uint64_t hash_state[8];
+        uint64_t block[BLAKE2B_WORDS];
+        uint64_t length;         // Message length including the index, the counter of the final block
+        uint32_t index_offset;   // Byte offset of the little endian index in the final block
+        uint32_t digest_length;
+    };
+
+    // Implementations of the leaf hashing, the lanes are independent leaves of the same midstate
+    enum Blake2bImplementation
+    {
+        BLAKE2B_SCALAR = 0,
+        BLAKE2B_AVX2 = 1,   // 4 lanes
+        BLAKE2B_AVX512 = 2  // 8 lanes
+    };
+
+    static const char * const BLAKE2B_IMPLEMENTATION_NAMES[] = {"scalar", "avx2", "avx512"};
+
+    class EquihashBlake2b
+    {
+    public:
+        // Compresses a single block into the hash state, t is the amount of bytes hashed including it
+        static void compress(uint64_t hash_state[8], const uint64_t block[BLAKE2B_WORDS], uint64_t t, bool last);
+
+        // Compresses every whole block of the data, more has to follow it so none of them is the last one
+        // Returns the amount of bytes compressed, the rest is left to the caller
+        static size_t compress_blocks(uint64_t hash_state[8], uint64_t & length, const uint8_t * data, size_t size);
+
+        // Builds the midstate from a hash state, the amount of bytes it compressed and the bytes left after them
+        // Fails when the index would be split between two blocks
+        static bool create_midstate(const uint64_t hash_state[8], uint64_t length, const uint8_t * buffer, 
+                                    size_t buffer_length, size_t digest_length, Blake2bMidstate & midstate);
+        // Same from a libb2 state that holds everything but the index
+        static bool create_midstate(const blake2b_state & state, size_t digest_length, Blake2bMidstate & midstate);
+
+        // Hashes a single leaf, out has to hold digest_length bytes
+        static void hash_leaf(const Blake2bMidstate & midstate, uint32_t index, uint8_t * out);
+
+        // Hashes a leaf per index, as many at once as the implementation has lanes
+        // out has to hold count*digest_length bytes, the digests follow each other
+        static void hash_leaves(const Blake2bMidstate & midstate, const uint32_t * indices, size_t count, uint8_t * out);
+        static void hash_leaves(const Blake2bMidstate & midstate, const uint32_t * indices, size_t count, uint8_t * out,
+                                Blake2bImplementation implementation);
+
+        // The widest implementation the cpu supports, detected once
+        static Blake2bImplementation get_implementation();
+        static bool is_supported(Blake2bImplementation implementation);
+    };
+}
+
+#endif
@@ -13,18 +13,99 @@
 #define EQUIHASHGPU_EQUIHASH_SOLVER_H_
 
 #include "equihash_gpu/equihash/proof.h"
+#include "equihash_gpu/equihash/equihash_util.h"
+#include "equihash_gpu/util/BoundedQueue.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 
 namespace Equihash
 {
+    // Called from the solving thread with every solution, as soon as its nonce is done
+    typedef std::function<void(const Proof &)> SolutionCallback;
+
+    // Solutions of an asynchronous solve, closed once the solve is over
+    typedef BoundedQueue<Proof> ProofChannel;
+
+    // State of a solve running in the background
+    class SolveHandle
+    {
+        friend class IEquihashSolver;
+
+    private:
+        std::atomic<bool> cancelled_;
+        std::atomic<size_t> solved_nonces_;
+        std::atomic<size_t> solutions_;
+        std::mutex mutex_;
+        std::condition_variable done_cv_;
+        bool done_;
+        // Wakes up whatever the solving thread may be blocked on outside of the solver, set before it starts
+        std::function<void()> on_cancel_;
+
+    private:
+        void finish(size_t solved_nonces);
+
+    public:
+        SolveHandle();
+
+        // The solver stops within a single collision round, solutions of unfinished nonces are dropped
+        void cancel();
+        bool is_cancelled() const;
+        bool is_done();
+        void wait();
+
+        size_t get_solved_nonces() const;
+        size_t get_solutions() const;
+    };
+
     class IEquihashSolver
     {
+    private:
+        std::shared_ptr<SolveHandle> current_handle_;
+        std::thread current_thread_;
+        std::mutex async_mutex_;
+
+    private:
+        std::shared_ptr<SolveHandle> start_async(size_t first_nonce, size_t amount, SolutionCallback callback,
+                                                 bool stop_on_first, std::function<void()> on_finish,
+                                                 std::function<void()> on_cancel);
+
+    protected:
+        // Solves the nonces of the range one after the other and hands every solution to the callback
+        // Has to check cancel at least between collision rounds, returns the amount of nonces solved
+        virtual size_t solve_range(size_t first_nonce, size_t amount, bool stop_on_first,
+                                   const SolutionCallback & callback, const std::atomic<bool> & cancel) = 0;
+
+        // Cancels and joins the running solve, backends call it before their state goes away
+        void cancel_async();
+
     public:
         IEquihashSolver(){}
         virtual ~IEquihashSolver(){}
 
         virtual std::vector<Proof> find_proof() = 0;
         virtual bool verify_proof(const Proof & proof) = 0;
+
+        // Switches to another seed without rebuilding anything, a running solve is cancelled first
+        virtual void set_seed(const uint32_t seed[SEED_SIZE]) = 0;
+        // Switches to a block header and a 32 byte nonce, the nonces of a range are added to it
+        // Fails and keeps the current input if the header length does not leave room for the leaf index
+        virtual bool set_header(const std::vector<uint8_t> & header, const uint8_t nonce[EQUIHASH_NONCE_SIZE]) = 0;
+
+        // Solves the range in the background, a solve that is already running is cancelled first
+        // so new work waits for at most a single collision round
+        std::shared_ptr<SolveHandle> solve_async(size_t first_nonce, size_t amount,
+                                                 SolutionCallback callback, bool stop_on_first = false);
+
+        // Same, the solutions are pushed to the channel and it is closed when the solve ends
+        // A full channel holds the solver back until there is room again or it is closed
+        // Cancelling closes the channel, so a solve blocked on it still stops right away
+        std::shared_ptr<SolveHandle> solve_async(size_t first_nonce, size_t amount,
+                                                 std::shared_ptr<ProofChannel> channel, bool stop_on_first = false);
     };
 }
 
-#endif
\ No newline at end of file
+#endif
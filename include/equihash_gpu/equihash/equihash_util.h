@@ -0,0 +1,97 @@
+/**
+ * @file equihash_util.h
+ * @author ofir iluz (iluzofir@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2018-12-02
+ *
+ * @copyright Copyright (c) 2018
+ *
+ */
+
+#ifndef EQUIHASHGPU_EQUIHASH_UTIL_H_
+#define EQUIHASHGPU_EQUIHASH_UTIL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <blake2.h>
+#include "equihash_gpu/equihash/equihash_blake2b.h"
+
+#define SEED_SIZE 4 // 4x32bit
+#define MAX_NONCE 0xFFFFF
+#define EQUIHASH_NONCE_SIZE 32
+#define ZCASH_HEADER_SIZE 140
+
+namespace Equihash
+{
+    // Parameters derived from N and K, shared by all of the solver backends
+    // Note that the layout is mirrored on the GPU, keep the seed last
+    struct EquihashContext
+    {
+        uint32_t N, K;
+        uint32_t collision_bits_length;
+        uint32_t collision_bytes_length;
+        uint32_t hash_length;
+        uint32_t indices_per_hash_output;
+        uint32_t hash_output;
+        uint32_t full_width;
+        uint32_t init_size;
+        uint32_t solution_size;
+
+        uint32_t seed[SEED_SIZE]; // Later for nonce and index
+    };
+
+    // Everything the leaves are hashed from but the nonce counter and the index
+    // The whole blocks of the header are compressed once per input, a nonce only adds its bytes to the rest
+    struct EquihashInput
+    {
+        uint64_t header_hash_state[8];
+        uint64_t header_compressed_length;
+        uint8_t header_tail[BLAKE2B_BLOCKBYTES];    // The header bytes past its last whole block
+        uint32_t header_tail_length;
+        uint8_t nonce_base[EQUIHASH_NONCE_SIZE]; // The counter is added to it as a little endian number
+        uint32_t nonce_size;
+        uint32_t digest_length;
+    };
+
+    class EquihashUtils
+    {
+    public:
+        // Derives the sizes of the algorithm from the N and K of the context
+        static void initialize_context(EquihashContext & context);
+        static void print_context(const EquihashContext & context);
+
+        // The seed words followed by a 4 byte nonce, the input the solvers were always benchmarked with
+        static bool initialize_input(uint32_t N, uint32_t K, const uint32_t seed[SEED_SIZE], EquihashInput & input);
+        // A block header followed by a 32 byte nonce, like the 140 byte zcash header
+        // Fails if the leaf index of such an input would be split between two blocks
+        static bool initialize_input(uint32_t N, uint32_t K, const uint8_t * header, size_t header_size,
+                                     const uint8_t nonce[EQUIHASH_NONCE_SIZE], EquihashInput & input);
+        // The nonce bytes that get hashed for a nonce counter, out has to hold nonce_size bytes
+        static void get_nonce_bytes(const EquihashInput & input, size_t nonce, uint8_t * out);
+
+        // The personalized state of the header and nonce that each leaf continues from
+        // Fails if the index does not fit in the final block of the prefix
+        static bool initialize_midstate(const EquihashInput & input, size_t nonce, Blake2bMidstate & midstate);
+
+        // Splits the input into bit_len sized big endian blocks, each padded to whole bytes
+        static void expand_array(const uint8_t * in, size_t in_len,
+                                 uint8_t * out, size_t out_len,
+                                 size_t bit_len, size_t byte_pad = 0);
+
+        // Reverse of expand_array, packs the bit_len sized blocks tightly
+        static void compress_array(const uint8_t * in, size_t in_len,
+                                   uint8_t * out, size_t out_len,
+                                   size_t bit_len, size_t byte_pad = 0);
+
+        static void index_to_array(uint32_t index, uint8_t * array);
+        static uint32_t array_to_index(const uint8_t * array);
+
+        // Converts between the leaf indices of a solution and its minimal (compressed) form
+        static std::vector<uint8_t> indices_to_solution(const EquihashContext & context,
+                                                        const std::vector<uint32_t> & indices);
+    };
+}
+
+#endif
@@ -0,0 +1,64 @@
+/**
+ * @file equihash_verifier.h
+ * @author ofir iluz (iluzofir@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2018-12-04
+ *
+ * @copyright Copyright (c) 2018
+ *
+ */
+
+#ifndef EQUIHASHGPU_EQUIHASH_VERIFIER_H_
+#define EQUIHASHGPU_EQUIHASH_VERIFIER_H_
+
+#include <stdint.h>
+#include <vector>
+#include <memory>
+#include "equihash_gpu/equihash/proof.h"
+#include "equihash_gpu/equihash/equihash_util.h"
+#include "equihash_gpu/util/ThreadPool.h"
+
+namespace Equihash
+{
+    struct VerificationStats
+    {
+        size_t proofs;
+        size_t verified;
+        double elapsed_seconds;
+        double proofs_per_second;
+    };
+
+    class EquihashVerifier
+    {
+    private:
+        EquihashContext equihash_context_;
+        EquihashInput equihash_input_;
+        size_t threads_;
+        std::unique_ptr<ThreadPool> thread_pool_;
+
+    private:
+        bool decode_indices(const Proof & proof, std::vector<uint32_t> & indices) const;
+        bool check_indices(const std::vector<uint32_t> & indices) const;
+        bool generate_leaves(const Proof & proof, const std::vector<uint32_t> & indices, std::vector<uint8_t> & rows) const;
+        bool check_tree(std::vector<uint8_t> & rows) const;
+        // Pairs up the subtrees of a level, backtracking when a block is shared by more than two of them
+        bool order_level(uint32_t level, std::vector<uint32_t> & indices, std::vector<uint8_t> & rows) const;
+
+    public:
+        // The context only needs N, K and the seed, the rest is derived here
+        // Zero threads means one per hardware core, the pool is created on the first batch
+        EquihashVerifier(const EquihashContext & context, size_t threads = 0);
+        // Proofs of a header and nonce input instead of the seed of the context
+        EquihashVerifier(const EquihashContext & context, const EquihashInput & input, size_t threads = 0);
+        virtual ~EquihashVerifier();
+
+        bool verify(const Proof & proof) const;
+        // Puts the leaves of a proof back in tree order, whatever order they came in
+        // Fails if they do not pair up into a tree, the proof is left as it was
+        bool order_proof(Proof & proof) const;
+        std::vector<bool> verify_batch(const std::vector<Proof> & proofs, VerificationStats * stats = nullptr);
+    };
+}
+
+#endif
@@ -1,10 +1,17 @@
 #pragma OPENCL EXTENSION cl_khr_byte_addressable_store : enable
 #pragma OPENCL EXTENSION cl_nv_pragma_unroll
 
-#include "/home/ofir/Desktop/Equihash/equihash_gpu/include/equihash_gpu/blake2b/blake2b.cl"
+// blake2b.cl is placed before this source when the program is built
 
 #define SEED_SIZE 4
-#define MAX_BUCKET_AMOUNT 5
+#define STORAGE_INDICES 0
+#define STORAGE_TREE 1
+#define STORAGE_PACKED 2
+#define PACKED_WORD_BITS 32
+#define MAX_TREE_CANDIDATES 1024
+#define LOCAL_WORK_GROUP_SIZE 64
+#define LOCAL_BUCKET_CAPACITY 16
+#define ROW_ALIGNMENT 16
 #define ENDIAN_SWAP(n) ((rotate(n & 0x00FF00FF, 24U)|(rotate(n, 8U) & 0x00FF00FF)))
 typedef struct 
 {
@@ -18,57 +25,25 @@ typedef struct
     uint32_t init_size;
     uint32_t solution_size;
 
-    uint32_t seed[SEED_SIZE+1]; // Later for nonce and index
+    uint32_t seed[SEED_SIZE]; // Later for nonce and index
 
-} equihash_context;
+    // Rows are bucketed on the top bucket_bits of the collision block
+    uint32_t bucket_bits;
+    uint32_t bucket_capacity;
 
-void compress_array(global uint8_t * in, 
-                  const uint32_t size_in, 
-                  global uint8_t * out, 
-                  const uint32_t size_out,
-                  const uint32_t bit_len,
-                  const uint32_t byte_pad)
-{
-
-    // TODO
-    // Make sure that the bit len is at least 8 bits
-    // And make sure 32 bytes can hold it
-
-
-    // Calculate the actual width to produce, padded to bytes
-    private const uint32_t in_width = (bit_len + 7) / 8 + byte_pad;
-
-    // Calculate the bits mask, to use to take the blocks
-    private const uint32_t bit_len_mask = ((uint32_t)1 << bit_len) - 1;
-
-    // Start accumilating bits until we reached collision bits amount
-    // Once reached, add it to the blocks masked to big endian 
-    uint32_t acc_bits = 0;
-    uint32_t acc_value = 0;
-    uint32_t j = 0;
-    uint32_t i;
-    uint32_t x;
- 
-    for(i=0;i<size_in;i++)
-    {
-        if(acc_bits < 8)
-        {
-            acc_value = acc_value << bit_len;
-            for (x = byte_pad; x < in_width; x++) {
-				acc_value = acc_value | (
-					(
-					    // Apply bit_len_mask across byte boundaries
-					    in[j + x] & ((bit_len_mask >> (8 * (in_width - x - 1))) & 0xFF)
-					) << (8 * (in_width - x - 1))); // Big-endian
-			}
-			j += in_width;
-			acc_bits += bit_len;
-        }
+    // Either full index lists on every row, or only parent pointers in per round tables
+    uint32_t storage_mode;
+    uint32_t row_width;
+    uint32_t table_capacity;
+} equihash_context;
 
-		acc_bits -= 8;
-		out[i] = (acc_value >> acc_bits) & 0xFF;
-    }    
-}
+// The sizes are read from the context, unless the program was built for a single (N, K)
+// in which case the host passes all of them as EQUIHASH_<field> constants
+#ifdef EQUIHASH_SPECIALIZED
+    #define CONTEXT(field) EQUIHASH_##field
+#else
+    #define CONTEXT(field) (context->field)
+#endif
 
 void expand_array(private uint8_t * in, 
                   const uint32_t size_in, 
@@ -124,112 +99,299 @@ void expand_array(private uint8_t * in,
     }
 }
 
-uint8_t has_collision(global uint8_t * a, global uint8_t * b, uint32_t bytes)
+uint32_t aligned_hash_width(const uint32_t hash_length)
 {
-    private uint32_t i;
-    for(i=0;i<bytes;i++,a++,b++)
+    // Byte rows keep the hash in place, padded with zeros to whole uint4 words, the indices follow it
+    return (hash_length + ROW_ALIGNMENT - 1) & ~(ROW_ALIGNMENT - 1);
+}
+
+uint8_t has_collision(global uint8_t * a, global uint8_t * b, uint32_t from, const uint32_t to)
+{
+    // Bytes up to the first aligned word, then whole words, then the bytes that are left
+    for(;from<to && (from % ROW_ALIGNMENT);from++)
     {
-        if ((*a) != (*b))
+        if(a[from] != b[from])
         {
             return 0;
-        }        
+        }
     }
-    
-    return 1;
-}
-
-uint8_t distinct_indices(global uint8_t * a, global uint8_t * b, const uint32_t len, const uint32_t len_indices)
-{
-    private uint32_t i,j;
-    a = a + len;
-    b = b + len;
-    for(i=0;i<len_indices;i+=sizeof(uint32_t))
+    for(;from+ROW_ALIGNMENT<=to;from+=ROW_ALIGNMENT)
     {
-        for(j=0;j<len_indices;j+=sizeof(uint32_t))
+        if(!all(*(global uint4 *)(a + from) == *(global uint4 *)(b + from)))
         {
-            if(has_collision(a + i, b + j, sizeof(uint32_t)))
-            {
-                return 0;
-            }
+            return 0;
+        }
+    }
+    for(;from<to;from++)
+    {
+        if(a[from] != b[from])
+        {
+            return 0;
         }
     }
 
     return 1;
 }
 
-uint8_t indices_before(global uint8_t * a, global uint8_t * b, uint32_t len_indices)
+uint8_t distinct_indices(global uint32_t * a, global uint32_t * b, const uint32_t indices_amount)
 {
-    for (;len_indices--;a++,b++) 
+    // The index lists of the rows are kept sorted, a single merge finds any index they share
+    private uint32_t i = 0, j = 0;
+    while(i < indices_amount && j < indices_amount)
     {
-        if ((*a) < (*b))
+        if(a[i] == b[j])
+        {
+            return 0;
+        }
+        if(a[i] < b[j])
+        {
+            i++;
+        }
+        else
         {
-            return 1;
+            j++;
         }
     }
-    return 0;
+
+    return 1;
 }
 
-void copy_indices(global uint8_t * dest, global uint8_t * src, const uint32_t len_indices)
+void copy_indices(global uint32_t * dest, global uint32_t * src, const uint32_t indices_amount)
 {
     private uint32_t i;
-    for(i=0;i<len_indices;i++)
+    for(i=0;i<indices_amount;i++)
     {
         dest[i] = src[i];
     }
 }
 
+void merge_indices(global uint32_t * dest, global uint32_t * a, global uint32_t * b, const uint32_t indices_amount)
+{
+    // Both lists are sorted and distinct, the merged one stays sorted for the next round
+    private uint32_t i = 0, j = 0;
+    while(i < indices_amount && j < indices_amount)
+    {
+        *dest++ = (a[i] < b[j]) ? a[i++] : b[j++];
+    }
+    copy_indices(dest, a + i, indices_amount - i);
+    copy_indices(dest + indices_amount - i, b + j, indices_amount - j);
+}
+
+void combine_hashes(global uint8_t * dest,
+                    global uint8_t * a,
+                    global uint8_t * b,
+                    const uint32_t from,
+                    const uint32_t hash_width)
+{
+    // Whole words are XORed in place, the words before from only hold blocks that were collided on already
+    private uint32_t w;
+    for(w=from/ROW_ALIGNMENT;w<hash_width/ROW_ALIGNMENT;w++)
+    {
+        ((global uint4 *)dest)[w] = ((global uint4 *)a)[w] ^ ((global uint4 *)b)[w];
+    }
+}
+
 void combine_rows(global uint8_t * dest, 
                   global uint8_t * a, 
                   global uint8_t * b, 
-                  const uint32_t len, 
-                  const uint32_t len_indices, 
-                  const uint32_t trim)
+                  const uint32_t from, 
+                  const uint32_t hash_width, 
+                  const uint32_t indices_amount)
+{
+    combine_hashes(dest, a, b, from, hash_width);
+    merge_indices((global uint32_t *)(dest + hash_width), (global uint32_t *)(a + hash_width),
+                  (global uint32_t *)(b + hash_width), indices_amount);
+}
+
+void store_solution_indices(global uint32_t * first_indices,
+                            global uint32_t * second_indices,
+                            const uint32_t indices_amount,
+                            const uint32_t bits_len,
+                            global uint8_t * solution,
+                            const uint32_t solution_len)
 {
-    for (size_t i = trim; i < len; i++)
+    // Each index is packed to bits_len + 1 bits, the second list continues right after the first
+    private const uint32_t bit_len = bits_len + 1;
+    private const uint32_t bit_len_mask = ((uint32_t)1 << bit_len) - 1;
+    private uint32_t index;
+    uint32_t acc_bits = 0;
+    uint32_t acc_value = 0;
+    uint32_t j = 0;
+    uint32_t i;
+
+    for(i=0;i<solution_len;i++)
     {
-        dest[i-trim] = (a[i] ^ b[i]);
+        if(acc_bits < 8)
+        {
+            index = (j < indices_amount) ? first_indices[j] : second_indices[j - indices_amount];
+            acc_value = (acc_value << bit_len) | (index & bit_len_mask);
+            j++;
+            acc_bits += bit_len;
+        }
+
+        acc_bits -= 8;
+        solution[i] = (acc_value >> acc_bits) & 0xFF;
     }
-    
-    if(indices_before(a+len, b+len, len_indices))
+}
+
+uint32_t collision_key(global uint8_t * row, const uint32_t collision_bytes)
+{
+    // The collision block is big endian and masked to the collision bits
+    private uint32_t i;
+    private uint32_t key = 0;
+    for(i=0;i<collision_bytes;i++)
     {
-        copy_indices(dest + len - trim, a + len, len_indices);
-        copy_indices(dest + len - trim + len_indices, b + len, len_indices);
+        key = (key << 8) | row[i];
     }
-    else
+
+    return key;
+}
+
+uint8_t shares_parent(global uint32_t * a, global uint32_t * b)
+{
+    // Rows built from a common row would end up with duplicate indices
+    return a[0] == b[0] || a[0] == b[1] || a[1] == b[0] || a[1] == b[1];
+}
+
+void sift_down(global uint32_t * indices, uint32_t root, const uint32_t end)
+{
+    private uint32_t child, value;
+    while((child = 2*root + 1) < end)
+    {
+        if(child + 1 < end && indices[child] < indices[child + 1])
+        {
+            child++;
+        }
+        if(indices[root] >= indices[child])
+        {
+            return;
+        }
+        value = indices[root];
+        indices[root] = indices[child];
+        indices[child] = value;
+        root = child;
+    }
+}
+
+void sort_indices(global uint32_t * indices, const uint32_t indices_amount)
+{
+    // Heap sort, a work item has no room for anything recursive
+    private uint32_t x, value;
+    for(x=indices_amount/2;x-->0;)
+    {
+        sift_down(indices, x, indices_amount);
+    }
+    for(x=indices_amount;x-->1;)
     {
-        copy_indices(dest + len - trim, b + len, len_indices);
-        copy_indices(dest + len - trim + len_indices, a + len, len_indices);
+        value = indices[0];
+        indices[0] = indices[x];
+        indices[x] = value;
+        sift_down(indices, 0, x);
     }
 }
 
-void big_endian_index_to_array(uint32_t i, global uint8_t * array)
-{   
-    // private uint32_t le_i = ENDIAN_SWAP(i);
-    private uint32_t j;
-    for(j=0;j<sizeof(i);j++)
+uint8_t rebuild_tree_indices(global uint32_t * tree,
+                             const uint32_t table_capacity,
+                             const uint32_t last_level,
+                             const uint32_t first_row,
+                             const uint32_t second_row,
+                             global uint32_t * indices,
+                             global uint32_t * sorted,
+                             const uint32_t indices_amount)
+{
+    private uint32_t count = 2;
+    private uint32_t size, x, y, r;
+    private int level;
+
+    // Walk back from the last level, every row is replaced by its two parents in place
+    indices[0] = first_row;
+    indices[1] = second_row;
+    for(level=last_level;level>=0;level--)
+    {
+        global uint32_t * parents = tree + ((size_t)level*table_capacity*2);
+        for(x=count;x-->0;)
+        {
+            r = indices[x];
+            indices[2*x] = parents[2*r];
+            indices[2*x+1] = parents[2*r+1];
+        }
+        count *= 2;
+    }
+
+    // Order the subtrees bottom up, the left one has to start with the smaller index
+    for(size=1;size<indices_amount;size<<=1)
+    {
+        for(x=0;x<indices_amount;x+=2*size)
+        {
+            if(indices[x] == indices[x+size])
+            {
+                return 0;
+            }
+            if(indices[x] > indices[x+size])
+            {
+                for(y=0;y<size;y++)
+                {
+                    r = indices[x+y];
+                    indices[x+y] = indices[x+size+y];
+                    indices[x+size+y] = r;
+                }
+            }
+        }
+    }
+
+    // A sorted copy has any duplicate right next to it
+    for(x=0;x<indices_amount;x++)
     {
-        array[j] = (i << (8*j));
+        sorted[x] = indices[x];
+    }
+    sort_indices(sorted, indices_amount);
+    for(x=1;x<indices_amount;x++)
+    {
+        if(sorted[x-1] == sorted[x])
+        {
+            return 0;
+        }
     }
+
+    return 1;
 }
 
-void store_solution_indices(global uint8_t * hash, 
-                            const uint32_t len, 
-                            const uint32_t indices_len, 
-                            const uint32_t bits_len, 
-                            global uint8_t * row, 
-                            const uint32_t max_len)
+uint32_t packed_words(const uint32_t bits)
 {
-    uint32_t min_len = (bits_len + 1) * indices_len / (8 * sizeof(uint32_t));
-    uint32_t padding = sizeof(uint32_t) - ((bits_len + 1 ) + 7 ) / 8;
+    return (bits + PACKED_WORD_BITS - 1) / PACKED_WORD_BITS;
+}
 
-    compress_array(hash + len, indices_len, row, min_len, bits_len + 1, padding);
+void store_packed_row(private uint8_t * in,
+                      const uint32_t size_in,
+                      global uint32_t * table,
+                      const uint32_t table_capacity,
+                      const uint32_t row)
+{
+    // The hash bits are kept as they are, big endian words, one column per word
+    private uint32_t w, x;
+    private uint32_t value;
+    for(w=0;w<packed_words(size_in*8);w++)
+    {
+        value = 0;
+        for(x=w*sizeof(uint32_t);x<(w+1)*sizeof(uint32_t);x++)
+        {
+            value = (value << 8) | ((x < size_in) ? in[x] : 0);
+        }
+        table[w*table_capacity + row] = value;
+    }
 }
 
-uint8_t is_zero(global uint8_t * a, uint32_t len)
+uint8_t has_packed_collision(global uint32_t * table,
+                             const uint32_t table_capacity,
+                             const uint32_t a,
+                             const uint32_t b,
+                             const uint32_t words)
 {
-    for(;len--;a++)
+    // The bits after the remaining hash are always zero, so whole words can be compared
+    private uint32_t w;
+    for(w=0;w<words;w++)
     {
-        if(a[len] != 0)
+        if(table[w*table_capacity + a] != table[w*table_capacity + b])
         {
             return 0;
         }
@@ -238,141 +400,691 @@ uint8_t is_zero(global uint8_t * a, uint32_t len)
     return 1;
 }
 
-kernel void equihash_initialize_hash(global equihash_context * context,
-                                     global uint8_t * hash_table,
-                                     global blake2b_state * initial_digest_state)
+void combine_packed_rows(global uint32_t * dest,
+                         const uint32_t dest_row,
+                         global uint32_t * table,
+                         const uint32_t table_capacity,
+                         const uint32_t a,
+                         const uint32_t b,
+                         const uint32_t words_in,
+                         const uint32_t words_out,
+                         const uint32_t bits_len)
+{
+    // XOR the rows and shift the collided digit out, the next digit ends up at the top of the first word
+    private uint32_t w;
+    private uint32_t current = table[a] ^ table[b];
+    private uint32_t next;
+    for(w=0;w<words_out;w++)
+    {
+        next = (w + 1 < words_in) ? 
+            (table[(w+1)*table_capacity + a] ^ table[(w+1)*table_capacity + b]) : 0;
+        dest[w*table_capacity + dest_row] = (current << bits_len) | (next >> (PACKED_WORD_BITS - bits_len));
+        current = next;
+    }
+}
+
+void add_to_bucket(global uint32_t * bucket_sizes,
+                   global uint32_t * buckets,
+                   global uint32_t * dropped_rows,
+                   const uint32_t bucket_capacity,
+                   const uint32_t bucket,
+                   const uint32_t row_index)
+{
+    private uint32_t slot;
+
+    // Rows that do not fit in the bucket are dropped, and counted so the host can tell
+    slot = atomic_inc(bucket_sizes + bucket);
+    if(slot < bucket_capacity)
+    {
+        buckets[(size_t)bucket*bucket_capacity + slot] = row_index;
+    }
+    else
+    {
+        atomic_inc(dropped_rows);
+    }
+}
+
+uint32_t leaf_bucket(private uint8_t * leaf, const uint32_t bucket_bits)
 {
-    // The index to be used is the global work index
-    private uint8_t digest[HASH_BLOCK_SIZE];
-    private uint32_t index = get_global_id(0);
+    // The first collision block leads the leaf, so its top bits are the top bits of the leaf
+    return ((uint32_t)leaf[0] << 24 | (uint32_t)leaf[1] << 16 | (uint32_t)leaf[2] << 8 | leaf[3]) 
+           >> (PACKED_WORD_BITS - bucket_bits);
+}
+
+void hash_leaves(global equihash_context * context,
+                 global uint8_t * hash_table,
+                 global blake2b_midstate * initial_digest_state,
+                 global uint32_t * bucket_sizes,
+                 global uint32_t * buckets,
+                 global uint32_t * dropped_rows,
+                 const uint32_t index)
+{
+    private uint64_t digest[8];
+    private uint8_t * digest_bytes = (private uint8_t*)digest;
     // private uint32_t le_i = ENDIAN_SWAP(index);
     private uint8_t i, j, k;
     private uint8_t amount_to_add;
     private uint32_t array_index;
-    private blake2b_state digest_state = *initial_digest_state;
+    private uint32_t hash_width = aligned_hash_width(CONTEXT(hash_length));
+    private uint32_t x;
     global uint8_t * start_row;
     global uint8_t * current_row;
 
-    // Create the digest based on the initial digest
-    blake2b_update_priv(&digest_state, (private uint8_t*)&index, sizeof(index));
-    blake2b_finalize_hash_priv(&digest_state, (private uint64_t*)digest, context->hash_output);
+    // Create the digest based on the initial digest, only the final block is left to compress
+    blake2b_leaf_hash(initial_digest_state, index, digest);
     
     // Get the pointer to the first row in this set of rows
     start_row = hash_table + 
-                (context->full_width*index)*context->indices_per_hash_output;
+                ((size_t)CONTEXT(row_width)*index)*CONTEXT(indices_per_hash_output);
 
     // Go over each part of the hash and add it to the table in the fitting rows
     // The amount is limited to the table size
-    amount_to_add = min(context->indices_per_hash_output, 
-                    context->init_size - index*context->indices_per_hash_output);
+    amount_to_add = min(CONTEXT(indices_per_hash_output), 
+                    CONTEXT(init_size) - index*CONTEXT(indices_per_hash_output));
     // #pragma unroll
     for(i=0;i<amount_to_add;i++)
     {
+        // Leaves can go to the buckets of the first round right away, it saves that round a pass on the table
+        if(bucket_sizes)
+        {
+            add_to_bucket(bucket_sizes, buckets, dropped_rows, CONTEXT(bucket_capacity),
+                          leaf_bucket(digest_bytes + (i*CONTEXT(N)/8), CONTEXT(bucket_bits)),
+                          index*CONTEXT(indices_per_hash_output) + i);
+        }
+
+        if(CONTEXT(storage_mode) == STORAGE_PACKED)
+        {
+            store_packed_row(digest_bytes + (i*CONTEXT(N)/8), CONTEXT(N)/8, (global uint32_t *)hash_table,
+                             CONTEXT(table_capacity), index*CONTEXT(indices_per_hash_output) + i);
+            continue;
+        }
+
         // Get the current row
-        current_row = start_row + context->full_width*i;
+        current_row = start_row + CONTEXT(row_width)*i;
         
         // Split the block and put it on the fitting row in the hash table
-        expand_array(digest + (i*context->N/8), context->N/8, 
+        expand_array(digest_bytes + (i*CONTEXT(N)/8), CONTEXT(N)/8, 
                      current_row, 
-                     context->hash_length, context->collision_bits_length, 0);
+                     CONTEXT(hash_length), CONTEXT(collision_bits_length), 0);
+        for(x=CONTEXT(hash_length);x<hash_width;x++)
+        {
+            current_row[x] = 0;
+        }
 
-        array_index = (index*context->indices_per_hash_output)+i;
+        // On tree storage the leaf row itself is the index
+        if(CONTEXT(storage_mode) == STORAGE_INDICES)
+        {
+            array_index = (index*CONTEXT(indices_per_hash_output))+i;
 
-        // Add the index to the row
-        big_endian_index_to_array(array_index,
-                                 current_row + context->hash_length);
+            // Add the index to the row
+            *(global uint32_t *)(current_row + hash_width) = array_index;
+        }
     } 
 }
 
-kernel void equihash_collision_detection_round(constant equihash_context * context,
-                                               global uint8_t * working_table,
-                                               global uint8_t * collision_table,
-                                               global uint32_t * collision_table_size,
-                                               const uint32_t working_table_size,
-                                               const uint8_t collision_round)
+kernel void equihash_initialize_hash(global equihash_context * context,
+                                     global uint8_t * hash_table,
+                                     global blake2b_midstate * initial_digest_state)
+{
+    // Every launch below strides by the global size, the host picks how much work an item takes
+    private uint32_t index;
+    for(index=get_global_id(0);index*CONTEXT(indices_per_hash_output)<CONTEXT(init_size);index+=get_global_size(0))
+    {
+        hash_leaves(context, hash_table, initial_digest_state, 
+                    (global uint32_t *)0, (global uint32_t *)0, (global uint32_t *)0, index);
+    }
+}
+
+kernel void equihash_initialize_hash_bucketed(global equihash_context * context,
+                                              global uint8_t * hash_table,
+                                              global blake2b_midstate * initial_digest_state,
+                                              global uint32_t * bucket_sizes,
+                                              global uint32_t * buckets,
+                                              global uint32_t * dropped_rows)
+{
+    // Same as the hash kernel, with the leaves bucketed for the first round as they are written
+    private uint32_t index;
+    for(index=get_global_id(0);index*CONTEXT(indices_per_hash_output)<CONTEXT(init_size);index+=get_global_size(0))
+    {
+        hash_leaves(context, hash_table, initial_digest_state, bucket_sizes, buckets, dropped_rows, index);
+    }
+}
+
+void bucket_row(constant equihash_context * context,
+                global uint8_t * working_table,
+                global uint32_t * bucket_sizes,
+                global uint32_t * buckets,
+                global uint32_t * dropped_rows,
+                const uint8_t collision_round,
+                const uint32_t row_index)
+{
+    private uint32_t bucket;
+
+    // Packed rows shift their collided block out, byte rows keep every block in place
+    if(CONTEXT(storage_mode) == STORAGE_PACKED)
+    {
+        bucket = ((global uint32_t *)working_table)[row_index] >> (PACKED_WORD_BITS - CONTEXT(bucket_bits));
+    }
+    else
+    {
+        bucket = collision_key(working_table + ((size_t)CONTEXT(row_width)*row_index) + 
+                               collision_round*CONTEXT(collision_bytes_length), CONTEXT(collision_bytes_length))
+                 >> (CONTEXT(collision_bits_length) - CONTEXT(bucket_bits));
+    }
+
+    add_to_bucket(bucket_sizes, buckets, dropped_rows, CONTEXT(bucket_capacity), bucket, row_index);
+}
+
+kernel void equihash_bucket_rows(constant equihash_context * context,
+                                 global uint8_t * working_table,
+                                 global uint32_t * bucket_sizes,
+                                 global uint32_t * buckets,
+                                 global uint32_t * round_rows,
+                                 global uint32_t * dropped_rows,
+                                 const uint8_t collision_round)
+{
+    // The rows are counted by the round that wrote them, the host never has to read the count in between
+    private uint32_t working_table_size = min(round_rows[collision_round], CONTEXT(table_capacity));
+    private uint32_t row_index;
+    for(row_index=get_global_id(0);row_index<working_table_size;row_index+=get_global_size(0))
+    {
+        bucket_row(context, working_table, bucket_sizes, buckets, dropped_rows, collision_round, row_index);
+    }
+}
+
+uint8_t is_distinct_collision(constant equihash_context * context,
+                              global uint8_t * working_table,
+                              const uint8_t collision_round,
+                              const uint32_t first_row,
+                              const uint32_t second_row)
+{
+    // Rows with parent pointers are checked through their parents by the callers
+    if(CONTEXT(storage_mode) != STORAGE_INDICES)
+    {
+        return 1;
+    }
+
+    private uint32_t hash_width = aligned_hash_width(CONTEXT(hash_length));
+    return distinct_indices((global uint32_t *)(working_table + ((size_t)CONTEXT(row_width)*first_row) + hash_width),
+                            (global uint32_t *)(working_table + ((size_t)CONTEXT(row_width)*second_row) + hash_width),
+                            1 << collision_round);
+}
+
+void store_collision(constant equihash_context * context,
+                     global uint8_t * working_table,
+                     global uint8_t * collision_table,
+                     global uint32_t * tree,
+                     const uint8_t collision_round,
+                     const uint32_t first_row,
+                     const uint32_t second_row,
+                     const uint32_t target_row_index)
 {
-    private uint32_t row_index = get_global_id(0);
-    // private uint32_t selec_row_index = get_global_id(1);
+    global uint32_t * parents = tree + ((size_t)collision_round*CONTEXT(table_capacity)*2);
+    global uint8_t * row = working_table + ((size_t)CONTEXT(row_width)*first_row);
+    global uint8_t * selected_row = working_table + ((size_t)CONTEXT(row_width)*second_row);
+    global uint8_t * target_row = collision_table + ((size_t)CONTEXT(row_width)*target_row_index);
 
-    // if(row_index >= selec_row_index)
-    // {
-    //     return;
-    // }
+    // The blocks up to this round are done with, the indices double every round
+    private uint32_t next_block = (collision_round + 1)*CONTEXT(collision_bytes_length);
+    private uint32_t hash_width = aligned_hash_width(CONTEXT(hash_length));
+    private uint32_t indices_amount = 1 << collision_round;
 
-    global uint8_t * row = working_table + (context->full_width*row_index);
+    // Packed words the rows take before and after this round
+    private uint32_t remaining_bits = (CONTEXT(K) + 1 - collision_round)*CONTEXT(collision_bits_length);
+    private uint32_t words_in = packed_words(remaining_bits);
+    private uint32_t words_out = packed_words(remaining_bits - CONTEXT(collision_bits_length));
+
+    if(CONTEXT(storage_mode) == STORAGE_INDICES)
+    {
+        // Combine the rows into the collision table
+        combine_rows(target_row, row, selected_row, next_block, hash_width, indices_amount);
+        return;
+    }
+
+    // Only the rest of the hash moves forward, the rows are remembered as the parents
+    if(CONTEXT(storage_mode) == STORAGE_PACKED)
+    {
+        combine_packed_rows((global uint32_t *)collision_table, target_row_index,
+                            (global uint32_t *)working_table, CONTEXT(table_capacity),
+                            first_row, second_row, words_in, words_out,
+                            CONTEXT(collision_bits_length));
+    }
+    else
+    {
+        combine_hashes(target_row, row, selected_row, next_block, hash_width);
+    }
+    parents[2*target_row_index] = first_row;
+    parents[2*target_row_index+1] = second_row;
+}
+
+void collide_bucket(constant equihash_context * context,
+                    global uint8_t * working_table,
+                    global uint8_t * collision_table,
+                    global uint32_t * collision_table_size,
+                    global uint32_t * bucket_sizes,
+                    global uint32_t * buckets,
+                    global uint32_t * tree,
+                    const uint8_t collision_round,
+                    const uint32_t bucket)
+{
+    global uint32_t * bucket_rows = buckets + ((size_t)bucket*CONTEXT(bucket_capacity));
+    global uint32_t * parents = tree + ((size_t)collision_round*CONTEXT(table_capacity)*2);
+    global uint8_t * row;
     global uint8_t * selected_row;
-    global uint8_t * target_row;
-    private bool t, t2;
     private uint32_t i, j;
+    private uint32_t bucket_size;
     private uint32_t target_row_index;
+    private uint32_t block = collision_round*CONTEXT(collision_bytes_length);
 
-    // Calculate the current hash length and indices length for this round
-    private uint32_t hash_len = context->hash_length - 
-                                (collision_round*context->collision_bytes_length);
-    
-    // Length in bytes
-    private uint32_t indices_len = (1 << collision_round)*sizeof(uint32_t);
-
-    // We go over the working row up until the end and find collision
-    for(i=row_index+1;i<working_table_size;i++)
+    // Only the rows of the same bucket can collide
+    bucket_size = min(bucket_sizes[bucket], CONTEXT(bucket_capacity));
+    for(i=0;i<bucket_size;i++)
     {
-        selected_row = working_table + (context->full_width*i);
-        if(has_collision(row, selected_row, context->collision_bytes_length) &&
-            distinct_indices(row, selected_row, hash_len, indices_len))
+        row = working_table + ((size_t)CONTEXT(row_width)*bucket_rows[i]);
+        for(j=i+1;j<bucket_size;j++)
         {
-            // Acquire the index 
-            target_row_index = atomic_inc(collision_table_size);
-            target_row = collision_table + (context->full_width*target_row_index);
+            selected_row = working_table + ((size_t)CONTEXT(row_width)*bucket_rows[j]);
+            if(CONTEXT(storage_mode) == STORAGE_PACKED)
+            {
+                // The digit sits at the top of the first word
+                if((((global uint32_t *)working_table)[bucket_rows[i]] ^ ((global uint32_t *)working_table)[bucket_rows[j]])
+                    >> (PACKED_WORD_BITS - CONTEXT(collision_bits_length)))
+                {
+                    continue;
+                }
+            }
+            else if(!has_collision(row, selected_row, block, block + CONTEXT(collision_bytes_length)))
+            {
+                continue;
+            }
+
+            // The leaves can not share anything, later rows are checked through their parents
+            if(CONTEXT(storage_mode) != STORAGE_INDICES && collision_round > 0 && 
+               shares_parent(parents - CONTEXT(table_capacity)*2 + 2*bucket_rows[i],
+                             parents - CONTEXT(table_capacity)*2 + 2*bucket_rows[j]))
+            {
+                continue;
+            }
+
+            if(!is_distinct_collision(context, working_table, collision_round, bucket_rows[i], bucket_rows[j]))
+            {
+                continue;
+            }
 
-            // Combine the rows into the collision table
-            combine_rows(target_row, row, selected_row, hash_len, indices_len, context->collision_bytes_length);
+            // The counter keeps going past the capacity, the host reads the overflow off it
+            target_row_index = atomic_inc(collision_table_size);
+            if(target_row_index < CONTEXT(table_capacity))
+            {
+                store_collision(context, working_table, collision_table, tree, collision_round,
+                                bucket_rows[i], bucket_rows[j], target_row_index);
+            }
         }
-    }    
+    }
 }   
 
-kernel void equihash_solutions_detection(global equihash_context * context, 
-                                         global uint8_t * working_table,
-                                         global uint8_t * collision_table,
-                                         global uint8_t * solutions_table,
-                                         global uint32_t * collision_table_size,
-                                         global uint32_t * solutions_table_size,
-                                         const uint32_t working_table_size)
+uint8_t shares_local_parent(local uint32_t * a, local uint32_t * b)
 {
-    
-    private uint32_t row_index = get_global_id(0);
-    global uint8_t * row = working_table + (context->full_width*row_index);
+    return a[0] == b[0] || a[0] == b[1] || a[1] == b[0] || a[1] == b[1];
+}
+
+void collide_tile(constant equihash_context * context,
+                  global uint8_t * working_table,
+                  global uint8_t * collision_table,
+                  global uint32_t * collision_table_size,
+                  global uint32_t * bucket_sizes,
+                  global uint32_t * buckets,
+                  global uint32_t * tree,
+                  const uint8_t collision_round,
+                  local uint32_t * tile_sizes,
+                  local uint32_t * tile_rows,
+                  local uint32_t * tile_keys,
+                  local uint32_t * tile_parents,
+                  local uint32_t * tile_offsets)
+{
+    global uint32_t * previous_parents = tree + ((size_t)(collision_round - 1)*CONTEXT(table_capacity)*2);
+    private uint32_t local_id = get_local_id(0);
+    private uint32_t first_bucket = get_group_id(0)*LOCAL_WORK_GROUP_SIZE;
+    private uint32_t tile_buckets = min((uint32_t)LOCAL_WORK_GROUP_SIZE, (uint32_t)(1 << CONTEXT(bucket_bits)) - first_bucket);
+    private uint32_t slot, row_index, base, size, i, j, step, value;
+    private uint32_t matched[LOCAL_BUCKET_CAPACITY];
+    private uint32_t matches = 0;
+
+    if(local_id < tile_buckets)
+    {
+        tile_sizes[local_id] = min(bucket_sizes[first_bucket + local_id], CONTEXT(bucket_capacity));
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Neighbouring work items load neighbouring slots of the tile, so the reads coalesce
+    // Every row is read once here, instead of once for every pair it is in
+    for(slot=local_id;slot<tile_buckets*CONTEXT(bucket_capacity);slot+=LOCAL_WORK_GROUP_SIZE)
+    {
+        if(slot % CONTEXT(bucket_capacity) >= tile_sizes[slot / CONTEXT(bucket_capacity)])
+        {
+            continue;
+        }
+
+        row_index = buckets[(size_t)first_bucket*CONTEXT(bucket_capacity) + slot];
+        tile_rows[slot] = row_index;
+        if(CONTEXT(storage_mode) == STORAGE_PACKED)
+        {
+            tile_keys[slot] = ((global uint32_t *)working_table)[row_index] >> (PACKED_WORD_BITS - CONTEXT(collision_bits_length));
+        }
+        else
+        {
+            tile_keys[slot] = collision_key(working_table + ((size_t)CONTEXT(row_width)*row_index) +
+                                            collision_round*CONTEXT(collision_bytes_length),
+                                            CONTEXT(collision_bytes_length));
+        }
+        if(CONTEXT(storage_mode) != STORAGE_INDICES && collision_round > 0)
+        {
+            tile_parents[2*slot] = previous_parents[2*row_index];
+            tile_parents[2*slot+1] = previous_parents[2*row_index+1];
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Each work item pairs a bucket of the tile, the pairs that make it are marked and counted
+    base = local_id*CONTEXT(bucket_capacity);
+    size = (local_id < tile_buckets) ? tile_sizes[local_id] : 0;
+    for(i=0;i<size;i++)
+    {
+        matched[i] = 0;
+        for(j=i+1;j<size;j++)
+        {
+            if(tile_keys[base+i] != tile_keys[base+j])
+            {
+                continue;
+            }
+            if(CONTEXT(storage_mode) != STORAGE_INDICES && collision_round > 0 &&
+               shares_local_parent(tile_parents + 2*(base+i), tile_parents + 2*(base+j)))
+            {
+                continue;
+            }
+            if(!is_distinct_collision(context, working_table, collision_round, tile_rows[base+i], tile_rows[base+j]))
+            {
+                continue;
+            }
+            matched[i] |= 1 << j;
+            matches++;
+        }
+    }
+
+    // Inclusive prefix sum of the counts over the work group
+    tile_offsets[local_id] = matches;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for(step=1;step<LOCAL_WORK_GROUP_SIZE;step<<=1)
+    {
+        value = (local_id >= step) ? tile_offsets[local_id - step] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        tile_offsets[local_id] += value;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    // A single reservation for the whole tile, the counter still goes past the capacity for the host
+    // The sizes were all read by now, the first one takes the start of the range
+    if(local_id == LOCAL_WORK_GROUP_SIZE - 1)
+    {
+        tile_sizes[0] = atomic_add(collision_table_size, tile_offsets[local_id]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // The rows of a tile land in bucket order, right after each other
+    row_index = tile_sizes[0] + tile_offsets[local_id] - matches;
+    for(i=0;i<size;i++)
+    {
+        for(j=i+1;j<size;j++)
+        {
+            if(!(matched[i] & (1 << j)))
+            {
+                continue;
+            }
+            if(row_index < CONTEXT(table_capacity))
+            {
+                store_collision(context, working_table, collision_table, tree, collision_round,
+                                tile_rows[base+i], tile_rows[base+j], row_index);
+            }
+            row_index++;
+        }
+    }
+}
+
+#ifdef EQUIHASH_SPECIALIZED
+// Every round below K-1 gets a case of its own, with the round sizes folded in
+#if EQUIHASH_K > 2
+    #define ROUND_CASE_1(CASE) CASE(1)
+#else
+    #define ROUND_CASE_1(CASE)
+#endif
+#if EQUIHASH_K > 3
+    #define ROUND_CASE_2(CASE) CASE(2)
+#else
+    #define ROUND_CASE_2(CASE)
+#endif
+#if EQUIHASH_K > 4
+    #define ROUND_CASE_3(CASE) CASE(3)
+#else
+    #define ROUND_CASE_3(CASE)
+#endif
+#if EQUIHASH_K > 5
+    #define ROUND_CASE_4(CASE) CASE(4)
+#else
+    #define ROUND_CASE_4(CASE)
+#endif
+#if EQUIHASH_K > 6
+    #define ROUND_CASE_5(CASE) CASE(5)
+#else
+    #define ROUND_CASE_5(CASE)
+#endif
+#if EQUIHASH_K > 7
+    #define ROUND_CASE_6(CASE) CASE(6)
+#else
+    #define ROUND_CASE_6(CASE)
+#endif
+#if EQUIHASH_K > 8
+    #define ROUND_CASE_7(CASE) CASE(7)
+#else
+    #define ROUND_CASE_7(CASE)
+#endif
+#if EQUIHASH_K > 9
+    #define ROUND_CASE_8(CASE) CASE(8)
+#else
+    #define ROUND_CASE_8(CASE)
+#endif
+#define SPECIALIZED_ROUND_CASES(CASE) CASE(0) ROUND_CASE_1(CASE) ROUND_CASE_2(CASE) ROUND_CASE_3(CASE) \
+    ROUND_CASE_4(CASE) ROUND_CASE_5(CASE) ROUND_CASE_6(CASE) ROUND_CASE_7(CASE) ROUND_CASE_8(CASE)
+#endif
+
+#define COLLISION_ROUND_CASE(r) \
+    case r: \
+        collide_bucket(context, working_table, collision_table, collision_table_size, \
+                       bucket_sizes, buckets, tree, r, bucket); \
+        break;
+
+kernel void equihash_collision_detection_round(constant equihash_context * context,
+                                               global uint8_t * working_table,
+                                               global uint8_t * collision_table,
+                                               global uint32_t * round_rows,
+                                               global uint32_t * bucket_sizes,
+                                               global uint32_t * buckets,
+                                               global uint32_t * tree,
+                                               const uint8_t collision_round)
+{
+    // Every round counts its rows apart, the first count is the leaves
+    global uint32_t * collision_table_size = round_rows + collision_round + 1;
+    private uint32_t bucket;
+
+    for(bucket=get_global_id(0);bucket<(1 << CONTEXT(bucket_bits));bucket+=get_global_size(0))
+    {
+#ifdef EQUIHASH_SPECIALIZED
+        switch(collision_round)
+        {
+            SPECIALIZED_ROUND_CASES(COLLISION_ROUND_CASE)
+            default:
+                collide_bucket(context, working_table, collision_table, collision_table_size,
+                               bucket_sizes, buckets, tree, collision_round, bucket);
+                break;
+        }
+#else
+        collide_bucket(context, working_table, collision_table, collision_table_size,
+                       bucket_sizes, buckets, tree, collision_round, bucket);
+#endif
+    }
+}
+
+#define TILED_ROUND_CASE(r) \
+    case r: \
+        collide_tile(context, working_table, collision_table, collision_table_size, \
+                     bucket_sizes, buckets, tree, r, tile_sizes, tile_rows, tile_keys, tile_parents, tile_offsets); \
+        break;
+
+kernel void equihash_collision_detection_round_tiled(constant equihash_context * context,
+                                                     global uint8_t * working_table,
+                                                     global uint8_t * collision_table,
+                                                     global uint32_t * round_rows,
+                                                     global uint32_t * bucket_sizes,
+                                                     global uint32_t * buckets,
+                                                     global uint32_t * tree,
+                                                     const uint8_t collision_round)
+{
+    // A work group takes a tile of LOCAL_WORK_GROUP_SIZE buckets, the host only picks this kernel
+    // when the bucket capacity fits LOCAL_BUCKET_CAPACITY
+    local uint32_t tile_sizes[LOCAL_WORK_GROUP_SIZE];
+    local uint32_t tile_rows[LOCAL_WORK_GROUP_SIZE*LOCAL_BUCKET_CAPACITY];
+    local uint32_t tile_keys[LOCAL_WORK_GROUP_SIZE*LOCAL_BUCKET_CAPACITY];
+    local uint32_t tile_parents[2*LOCAL_WORK_GROUP_SIZE*LOCAL_BUCKET_CAPACITY];
+    local uint32_t tile_offsets[LOCAL_WORK_GROUP_SIZE];
+    global uint32_t * collision_table_size = round_rows + collision_round + 1;
+
+#ifdef EQUIHASH_SPECIALIZED
+    switch(collision_round)
+    {
+        SPECIALIZED_ROUND_CASES(TILED_ROUND_CASE)
+        default:
+            collide_tile(context, working_table, collision_table, collision_table_size,
+                         bucket_sizes, buckets, tree, collision_round,
+                         tile_sizes, tile_rows, tile_keys, tile_parents, tile_offsets);
+            break;
+    }
+#else
+    collide_tile(context, working_table, collision_table, collision_table_size,
+                 bucket_sizes, buckets, tree, collision_round,
+                 tile_sizes, tile_rows, tile_keys, tile_parents, tile_offsets);
+#endif
+}
+
+void find_bucket_solutions(constant equihash_context * context, 
+                           global uint8_t * working_table,
+                           global uint8_t * solutions_table,
+                           global uint32_t * solutions_table_size,
+                           global uint32_t * bucket_sizes,
+                           global uint32_t * buckets,
+                           const uint32_t solutions_table_capacity,
+                           global uint32_t * tree,
+                           global uint32_t * tree_candidates,
+                           const uint32_t bucket)
+{
+    global uint32_t * bucket_rows = buckets + ((size_t)bucket*CONTEXT(bucket_capacity));
+    global uint32_t * last_parents = tree + ((size_t)(CONTEXT(K)-2)*CONTEXT(table_capacity)*2);
+    global uint32_t * candidate;
+    global uint8_t * row;
     global uint8_t * selected_row;
-    global uint8_t * target_row;
     global uint8_t * solution;
-    private uint32_t i, solution_index;
-    private uint32_t target_row_index;
+    private uint32_t i, j, solution_index, candidate_index;
+    private uint32_t bucket_size;
 
-    private uint32_t hash_len = context->hash_length - 
-                                (context->K*context->collision_bytes_length);
-    private uint32_t indices_len = (1 << context->K) * sizeof(uint32_t); 
+    // The rows of the last round hold the last two blocks, both have to collide
+    // The padding is zero on every row, so the compare runs to the end of the aligned hash
+    private uint32_t last_blocks = (CONTEXT(K)-1)*CONTEXT(collision_bytes_length);
+    private uint32_t hash_width = aligned_hash_width(CONTEXT(hash_length));
+    private uint32_t indices_amount = 1 << (CONTEXT(K)-1);
+    private uint32_t words = packed_words(2*CONTEXT(collision_bits_length));
 
-    for(i=row_index+1;i<working_table_size;i++)
+    bucket_size = min(bucket_sizes[bucket], CONTEXT(bucket_capacity));
+    for(i=0;i<bucket_size;i++)
     {
-        selected_row = working_table + (context->full_width*i);
-        if(has_collision(row, selected_row, hash_len))
+        row = working_table + ((size_t)CONTEXT(row_width)*bucket_rows[i]);
+        for(j=i+1;j<bucket_size;j++)
         {
-            // Acquire the index 
-            target_row_index = atomic_inc(collision_table_size);
-            target_row = collision_table + context->full_width*target_row_index;
+            selected_row = working_table + ((size_t)CONTEXT(row_width)*bucket_rows[j]);
+            if(CONTEXT(storage_mode) == STORAGE_PACKED)
+            {
+                if(!has_packed_collision((global uint32_t *)working_table, CONTEXT(table_capacity),
+                                         bucket_rows[i], bucket_rows[j], words))
+                {
+                    continue;
+                }
+            }
+            else if(!has_collision(row, selected_row, last_blocks, hash_width))
+            {
+                continue;
+            }
 
-            combine_rows(target_row, row, selected_row, hash_len, indices_len, 0);
+            if(CONTEXT(storage_mode) != STORAGE_INDICES)
+            {
+                if(shares_parent(last_parents + 2*bucket_rows[i], last_parents + 2*bucket_rows[j]))
+                {
+                    continue;
+                }
 
-            if(is_zero(target_row, hash_len) 
-               && 
-              distinct_indices(row, selected_row, hash_len, indices_len))
+                // Walk back through the tables into a scratch slot, the counter is kept after the solutions one
+                candidate_index = atomic_inc(solutions_table_size + 1);
+                if(candidate_index >= MAX_TREE_CANDIDATES)
+                {
+                    continue;
+                }
+                // The slot holds the indices and a sorted copy of them
+                candidate = tree_candidates + ((size_t)candidate_index << (CONTEXT(K)+1));
+                if(!rebuild_tree_indices(tree, CONTEXT(table_capacity), CONTEXT(K)-2,
+                                         bucket_rows[i], bucket_rows[j], candidate,
+                                         candidate + (1 << CONTEXT(K)), 1 << CONTEXT(K)))
+                {
+                    continue;
+                }
+
+                solution_index = atomic_inc(solutions_table_size);
+                if(solution_index >= solutions_table_capacity)
+                {
+                    continue;
+                }
+                solution = solutions_table + ((size_t)CONTEXT(solution_size)*solution_index);
+                store_solution_indices(candidate, candidate + indices_amount, indices_amount,
+                                       CONTEXT(collision_bits_length), solution, CONTEXT(solution_size));
+            }
+            else if(distinct_indices((global uint32_t *)(row + hash_width), (global uint32_t *)(selected_row + hash_width),
+                                     indices_amount))
             {
                 // Solution is found, acquire its index atomiclly
                 solution_index = atomic_inc(solutions_table_size);
-                solution = solutions_table + (sizeof(uint32_t)*(context->K+1))*solution_index;
+                if(solution_index >= solutions_table_capacity)
+                {
+                    continue;
+                }
+                solution = solutions_table + ((size_t)CONTEXT(solution_size)*solution_index);
 
-                // Store the uncompressed solution
-                store_solution_indices(target_row, hash_len, 2 * indices_len, context->collision_bits_length, solution, sizeof(uint32_t)*(context->K+1));
+                // The rows only know their leaves in sorted order, the host puts them back in tree order
+                store_solution_indices((global uint32_t *)(row + hash_width), (global uint32_t *)(selected_row + hash_width),
+                                       indices_amount,
+                                       CONTEXT(collision_bits_length), solution, CONTEXT(solution_size));
             }
         }
     }
-}
\ No newline at end of file
+}
+
+kernel void equihash_solutions_detection(constant equihash_context * context, 
+                                         global uint8_t * working_table,
+                                         global uint8_t * solutions_table,
+                                         global uint32_t * solutions_table_size,
+                                         global uint32_t * bucket_sizes,
+                                         global uint32_t * buckets,
+                                         const uint32_t solutions_table_capacity,
+                                         global uint32_t * tree,
+                                         global uint32_t * tree_candidates)
+{
+    private uint32_t bucket;
+    for(bucket=get_global_id(0);bucket<(1 << CONTEXT(bucket_bits));bucket+=get_global_size(0))
+    {
+        find_bucket_solutions(context, working_table, solutions_table, solutions_table_size, bucket_sizes, buckets,
+                              solutions_table_capacity, tree, tree_candidates, bucket);
+    }
+}
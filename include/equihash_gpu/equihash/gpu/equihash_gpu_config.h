@@ -22,24 +22,57 @@
 #include <vector>
 #include <iostream>
 #include "equihash_gpu/equihash/gpu/equihash_gpu_util.h"
+#include "equihash_gpu/equihash/gpu/equihash_gpu_tuning.h"
 
 namespace Equihash
 {
+    // Everything a single device works with, devices do not share contexts or buffers
+    struct EquihashGPUDevice
+    {
+        cl::Device device;
+        cl::Context context;
+        cl::CommandQueue queue;
+        // Second in order queue, lets the hashing of the next nonce run alongside the rounds
+        cl::CommandQueue hash_queue;
+        cl::Program program;
+        // Devices can be tuned to different bucket sizes, so each program is built with options of its own
+        std::string build_options;
+        // Whether the queues record the times of every command
+        bool profiling;
+    };
+
+    // Kernel arguments are per kernel object, so every device user creates its own
+    struct EquihashGPUKernels
+    {
+        cl::Kernel hash_kernel;
+        cl::Kernel bucketed_hash_kernel;
+        cl::Kernel bucket_kernel;
+        cl::Kernel collision_detection_round_kernel;
+        cl::Kernel tiled_collision_detection_round_kernel;
+        cl::Kernel solutions_kernel;
+    };
+
     class EquihashGPUConfig
     {
     private:
         // OpenCL information to be used
         bool is_configured_;
-        cl::Context gpu_context_;
-        std::vector<cl::Device> gpu_used_devices_;
-        std::vector<cl::CommandQueue> gpu_devices_queues_;
-        cl::Program compiled_gpu_program_;
-        cl::Kernel equihash_hash_kernel_;
-        cl::Kernel equihash_collision_detection_round_kernel_;
-        cl::Kernel equihash_solutions_kernel_;
+        bool profiling_;
+        std::vector<size_t> device_selection_;
+        std::vector<EquihashGPUDevice> gpu_devices_;
+        std::string build_options_;
+        std::string cache_directory_;
 
     private:
-        std::string read_source(const std::string & path);
+        std::string get_program_source();
+        std::string hash_key(const std::string & key);
+        std::string get_device_key(EquihashGPUDevice & gpu_device);
+        std::string get_cache_path(EquihashGPUDevice & gpu_device, const std::string & source);
+        std::string get_tuning_path(EquihashGPUDevice & gpu_device);
+        bool make_cache_directory();
+        bool load_program_binary(EquihashGPUDevice & gpu_device, const std::string & path);
+        void save_program_binary(EquihashGPUDevice & gpu_device, const std::string & path);
+        bool build_program(EquihashGPUDevice & gpu_device, const std::string & source);
 
     public:
         EquihashGPUConfig();
@@ -47,14 +80,24 @@ namespace Equihash
 
         void initialize_configuration();
         void clear_configuration();
+        // Built programs are cached per device, driver, source and build options
+        // An empty cache directory disables the cache
+        void set_build_options(const std::string & options);
+        void set_build_options(size_t device_index, const std::string & options);
+        void set_cache_directory(const std::string & directory);
+        // Queues record the queued, submit, start and end times of every kernel, on by default
+        // Takes effect on the next initialize_configuration
+        void set_profiling(bool profiling);
+        // Only the devices at these indices, counted over all platforms, are used, empty takes all
+        void set_device_selection(const std::vector<size_t> & device_indices);
         bool prepare_program();
-        cl::Context & get_context();
-        cl::Program & get_program();
-        cl::Kernel & get_equihash_hash_kernel();
-        cl::Kernel & get_equihash_collision_detection_round_kernel();
-        cl::Kernel & get_equihash_solutions_kernel();
-        std::vector<cl::Device> & get_devices();
-        std::vector<cl::CommandQueue> & get_device_queues();
+        bool prepare_program(size_t device_index);
+        // Tuning profiles are kept in the cache directory, a file per device and driver
+        // with a line per (N, K) and storage mode
+        bool load_tuning(size_t device_index, uint32_t N, uint32_t K, uint32_t storage, EquihashGPUTuning & tuning);
+        bool save_tuning(size_t device_index, uint32_t N, uint32_t K, uint32_t storage, const EquihashGPUTuning & tuning);
+        bool create_kernels(size_t device_index, EquihashGPUKernels & kernels);
+        std::vector<EquihashGPUDevice> & get_devices();
     };
 }
 
@@ -0,0 +1,80 @@
+/**
+ * @file equihash_gpu_metrics.h
+ * @author ofir iluz (iluzofir@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2018-12-19
+ *
+ * @copyright Copyright (c) 2018
+ *
+ */
+
+#ifndef EQUIHASHGPU_EQUIHASH_GPU_METRICS_H_
+#define EQUIHASHGPU_EQUIHASH_GPU_METRICS_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Nonces are counted by their amount of solutions, the last slot takes everything above
+#define SOLUTIONS_HISTOGRAM_SIZE 8
+
+namespace Equihash
+{
+    // Times of the launches of a single kernel, taken from the profiling info of their events
+    struct EquihashKernelMetrics
+    {
+        uint64_t launches;
+        uint64_t queued_ns;        // Queued until submitted to the device
+        uint64_t submitted_ns;     // Submitted until started
+        uint64_t execution_ns;     // Started until ended
+        uint64_t max_execution_ns;
+
+        EquihashKernelMetrics();
+        void add(uint64_t queued, uint64_t submitted, uint64_t started, uint64_t ended);
+    };
+
+    // Everything a single device went through since it was prepared
+    struct EquihashGPUMetrics
+    {
+        std::string device_name;
+        bool profiling;
+
+        uint64_t nonces;
+        uint64_t solutions;
+        uint64_t nonces_by_solutions[SOLUTIONS_HISTOGRAM_SIZE];
+
+        // Rows each collision round produced, summed over the nonces
+        std::vector<uint64_t> round_rows;
+        uint64_t bucket_dropped_rows;
+        uint64_t table_dropped_rows;
+        uint64_t dropped_solutions;
+
+        uint64_t bytes_to_device;
+        uint64_t bytes_from_device;
+        uint64_t buffers_size;
+
+        EquihashKernelMetrics hash;
+        // One bucketing per collision round and one for the solutions round
+        std::vector<EquihashKernelMetrics> bucket;
+        std::vector<EquihashKernelMetrics> rounds;
+        EquihashKernelMetrics solutions_kernel;
+
+        EquihashGPUMetrics();
+        void initialize(const std::string & name, uint32_t K, bool profiled);
+        void add_nonce(size_t nonce_solutions);
+    };
+
+    class EquihashGPUMetricsExporter
+    {
+    public:
+        // Prometheus text format, every device is a label on the same series
+        static std::string to_prometheus(const std::vector<EquihashGPUMetrics> & metrics);
+        // Written next to the path and renamed over it, so scrapers never see half a file
+        static bool write_prometheus(const std::string & path, const std::vector<EquihashGPUMetrics> & metrics);
+        // Average time of every stage per device, the slowest round stands out
+        static void print(const std::vector<EquihashGPUMetrics> & metrics);
+    };
+}
+
+#endif
@@ -16,71 +16,105 @@
 #include <iostream>
 #include <array>
 #include "equihash_gpu/equihash/equihash_solver.h"
+#include "equihash_gpu/equihash/equihash_util.h"
+#include "equihash_gpu/equihash/equihash_verifier.h"
 #include "equihash_gpu/equihash/gpu/equihash_gpu_config.h"
+#include "equihash_gpu/equihash/gpu/equihash_gpu_worker.h"
+#include "equihash_gpu/equihash/cpu/equihash_cpu_solver.h"
 #include <blake2.h>
 #include <algorithm>
+#include <memory>
+#include <thread>
+#include <mutex>
 
-#define SEED_SIZE 4 // 4x32bit
-#define MAX_BUCKET_AMOUNT 5
-#define LOCAL_WORK_GROUP_SIZE 64
-#define MAX_NONCE 0xFFFFF
-#define HASH_BLOCK_SIZE 128
+// A tuning candidate has to beat the best one by this much, anything closer is noise
+#define TUNING_MARGIN 1.02
+// Co-solving on every core but the ones that feed the devices, one per device
+#define CPU_THREADS_AUTO ((size_t)-1)
 
 namespace Equihash
 {
-    // Structure to be used on the GPU aswell
-    struct EquihashGPUContext
-    {
-        uint32_t N, K;
-        uint32_t collision_bits_length;
-        uint32_t collision_bytes_length;
-        uint32_t hash_length;
-        uint32_t indices_per_hash_output;
-        uint32_t hash_output;
-        uint32_t full_width;
-        uint32_t init_size;
-        uint32_t solution_size;
-
-        uint32_t seed[SEED_SIZE]; // Later for nonce and index
-    };
-
-    struct BlakeGPU
-    {
-        uint64_t hash_state[8];
-        uint8_t  buf[2*HASH_BLOCK_SIZE];
-        uint32_t buflen;
-        uint64_t t[2];
-    };
-
     class EquihashGPUSolver : public IEquihashSolver
     {
     private:
+        // What a single tuning candidate did over the tuning nonces
+        struct TuningTrial
+        {
+            size_t solutions;
+            double seconds;
+            bool tiled;
+            EquihashGPUMetrics metrics;
+        };
+
         EquihashGPUConfig gpu_config_;
         EquihashGPUContext equihash_context_;
+        // The context of every device with its tuned buckets, the workers keep references to them
+        std::vector<EquihashGPUContext> device_contexts_;
+        std::vector<EquihashGPUTuning> device_tunings_;
+        EquihashInput equihash_input_;
+        bool is_prepared_;
+        bool pipelined_;
+        bool specialized_;
+        bool tiled_;
+        bool fused_;
 
-        // OpenCL buffers to be used
-        cl::Buffer table_buffer_;
-        cl::Buffer collision_table_buffer_;
-        cl::Buffer collision_table_size_buffer_;
-        cl::Buffer solutions_buffer_;
-        cl::Buffer solutions_size_buffer_;
-        cl::Buffer digest_buffer_;
-        cl::Buffer context_buffer_;
+        std::vector<std::unique_ptr<EquihashGPUWorker>> workers_;
+        std::mutex workers_mutex_;
+
+        // Host threads that solve nonces of the same range next to the devices, none by default
+        size_t cpu_threads_;
+        std::unique_ptr<EquihashCPUSolver> cpu_solver_;
 
     private:
-        BlakeGPU create_initial_digest(size_t nonce);
         void initialize_context();
-        void prepare_buffers();
-        void enqueue_and_run_hash_kernel(size_t nonce);
-        bool enqueue_and_run_coliision_detection_rounds_kernel();
-        std::vector<Proof> enqueue_and_run_solutions_kernel(size_t nonce);
+        bool apply_tuning(const EquihashGPUTuning & tuning, EquihashGPUContext & context);
+        std::string get_specialized_build_options(const EquihashGPUContext & context);
+        bool prepare_solver();
+        bool run_tuning_trial(size_t device_index, const EquihashGPUTuning & tuning, size_t nonces, TuningTrial & trial);
+
+    protected:
+        virtual size_t solve_range(size_t first_nonce, size_t amount, bool stop_on_first,
+                                   const SolutionCallback & callback, const std::atomic<bool> & cancel) override;
 
     public:
-        EquihashGPUSolver(uint32_t N, uint32_t K, uint32_t seed[SEED_SIZE]);
+        // Every device solves nonces of its own, pipelined solving hashes nonce n+1 
+        // on a second queue while nonce n goes through the rounds
+        EquihashGPUSolver(uint32_t N, uint32_t K, uint32_t seed[SEED_SIZE], 
+                          EquihashGPUStorage storage = STORAGE_PACKED,
+                          bool pipelined = true);
         virtual ~EquihashGPUSolver();
 
+        // Build the kernels for this (N, K) only, sizes become constants the compiler can fold
+        // The generic program is still used if the specialized one can not be built
+        void set_specialized(bool specialized);
+        // Load the buckets of the collision rounds to local memory, a tile of them per work group
+        // Devices without room for a tile keep the global memory rounds
+        void set_tiled(bool tiled);
+        // Bucket the leaves for the first round while hashing them, instead of in a pass of their own
+        // Pipelined solving keeps a spare set of buckets for it, the separate pass needs none
+        void set_fused(bool fused);
+        // Solve on these devices only, see EquihashGPUConfig::set_device_selection
+        void set_devices(const std::vector<size_t> & device_indices);
+        // Solve nonces on the host as well, a nonce at a time on this many threads
+        // The nonces come from the same counter as the ones of the devices, so each side takes what it can
+        // Zero solves on the devices only, CPU_THREADS_AUTO leaves a core to every device thread
+        void set_cpu_threads(size_t threads);
+
+        // Sweeps the buckets, the tiled kernel and the local size and work per item of every kernel
+        // on each device over the given amount of nonces, and saves the best as the device profile
+        // Profiles are loaded when the solver is prepared, so the next solve runs with them
+        bool tune(size_t nonces);
+
+        // Solves a range of nonces on all devices and reports the sustained solutions per second
+        std::vector<Proof> solve_nonces(size_t first_nonce, size_t amount, bool stop_on_first = false);
+
+        // A snapshot per prepared device, safe to take while solving
+        std::vector<EquihashGPUMetrics> get_metrics();
+
         virtual std::vector<Proof> find_proof() override;
         virtual bool verify_proof(const Proof & proof) override;
+        virtual void set_seed(const uint32_t seed[SEED_SIZE]) override;
+        virtual bool set_header(const std::vector<uint8_t> & header, const uint8_t nonce[EQUIHASH_NONCE_SIZE]) override;
     };
 }
 
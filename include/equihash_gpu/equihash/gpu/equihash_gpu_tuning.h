@@ -0,0 +1,52 @@
+/**
+ * @file equihash_gpu_tuning.h
+ * @author ofir iluz (iluzofir@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2018-12-22
+ *
+ * @copyright Copyright (c) 2018
+ *
+ */
+
+#ifndef EQUIHASHGPU_EQUIHASH_GPU_TUNING_H_
+#define EQUIHASHGPU_EQUIHASH_GPU_TUNING_H_
+
+#include <stdint.h>
+
+namespace Equihash
+{
+    // Launch shape of a single kernel, a zero local size leaves the work groups to the driver
+    // Work items stride over their work, so a work item takes about work_per_item of it
+    struct EquihashKernelTuning
+    {
+        uint32_t local_size;
+        uint32_t work_per_item;
+
+        EquihashKernelTuning() : local_size(0), work_per_item(1)
+        {
+
+        }
+    };
+
+    // Everything the tuner picks for a single device and (N, K), zero buckets keep the solver defaults
+    struct EquihashGPUTuning
+    {
+        uint32_t bucket_bits;
+        uint32_t bucket_capacity;
+        // Whether the tiled collision kernel is worth it, it can still be turned off by the solver
+        bool tiled;
+
+        EquihashKernelTuning hash;
+        EquihashKernelTuning bucket;
+        EquihashKernelTuning collision;
+        EquihashKernelTuning solutions;
+
+        EquihashGPUTuning() : bucket_bits(0), bucket_capacity(0), tiled(true)
+        {
+
+        }
+    };
+}
+
+#endif
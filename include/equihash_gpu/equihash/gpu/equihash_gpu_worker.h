@@ -0,0 +1,160 @@
+/**
+ * @file equihash_gpu_worker.h
+ * @author ofir iluz (iluzofir@gmail.com)
+ * @brief 
+ * @version 0.1
+ * @date 2018-12-10
+ * 
+ * @copyright Copyright (c) 2018
+ * 
+ */
+
+#ifndef EQUIHASHGPU_EQUIHASH_GPU_WORKER_H_
+#define EQUIHASHGPU_EQUIHASH_GPU_WORKER_H_
+
+#include <stdint.h>
+#include <iostream>
+#include <atomic>
+#include <mutex>
+#include "equihash_gpu/equihash/proof.h"
+#include "equihash_gpu/equihash/equihash_solver.h"
+#include "equihash_gpu/equihash/equihash_util.h"
+#include "equihash_gpu/equihash/equihash_blake2b.h"
+#include "equihash_gpu/equihash/gpu/equihash_gpu_config.h"
+#include "equihash_gpu/equihash/gpu/equihash_gpu_metrics.h"
+#include <blake2.h>
+#include <algorithm>
+
+#define MAX_BUCKET_AMOUNT 6
+#define MAX_TREE_CANDIDATES 1024
+#define MAX_SOLUTIONS 1024
+#define TABLE_MARGIN_DIVISOR 8
+#define MIN_TABLE_MARGIN 1024
+#define PACKED_WORD_BITS 32
+#define LOCAL_WORK_GROUP_SIZE 64
+// The most rows a bucket can have for the tiled collision kernel, same as in the kernel source
+// Buckets take 2 rows on average, so MAX_BUCKET_AMOUNT times that fits
+#define LOCAL_BUCKET_CAPACITY 16
+// Byte rows are padded to whole uint4 words, so the kernels can load and XOR them a word at a time
+#define ROW_ALIGNMENT 16
+
+namespace Equihash
+{
+    // How the rows keep track of the indices they were built from
+    // Indices storage copies the full index lists forward on every row
+    // Tree storage keeps only the two parent rows per round, indices are rebuilt for solutions only
+    // Packed storage is tree storage with the hash bits packed into words, one column per word
+    enum EquihashGPUStorage
+    {
+        STORAGE_INDICES = 0,
+        STORAGE_TREE = 1,
+        STORAGE_PACKED = 2
+    };
+
+    static const char * const STORAGE_NAMES[] = {"indices", "tree", "packed"};
+
+    // Structure to be used on the GPU aswell
+    struct EquihashGPUContext : public EquihashContext
+    {
+        // Rows are bucketed on the top bucket_bits of the collision block
+        uint32_t bucket_bits;
+        uint32_t bucket_capacity;
+
+        uint32_t storage_mode;
+        uint32_t row_width;
+        uint32_t table_capacity;
+    };
+
+    // Solves nonces on a single device with buffers of its own
+    class EquihashGPUWorker
+    {
+    private:
+        EquihashGPUDevice & gpu_device_;
+        EquihashGPUKernels kernels_;
+        const EquihashGPUContext & equihash_context_;
+        const EquihashInput & equihash_input_;
+        EquihashGPUTuning tuning_;
+        bool pipelined_;
+        bool tiled_;
+        bool fused_;
+        bool is_valid_;
+
+        // OpenCL buffers to be used
+        cl::Buffer table_buffer_;
+        cl::Buffer collision_table_buffer_;
+        // The rows of every round's table, the leaves first, counted on the device
+        cl::Buffer round_rows_buffer_;
+        cl::Buffer solutions_buffer_;
+        cl::Buffer solutions_size_buffer_;
+        cl::Buffer bucket_sizes_buffer_;
+        cl::Buffer buckets_buffer_;
+        cl::Buffer tree_buffer_;
+        cl::Buffer tree_candidates_buffer_;
+        cl::Buffer dropped_rows_buffer_;
+        cl::Buffer digest_buffer_;
+        // Spare leaves table and digest, the next nonce is hashed into them while the rounds run
+        cl::Buffer next_table_buffer_;
+        cl::Buffer next_digest_buffer_;
+        // Fused hashing fills the buckets of the first round as well, so it needs spares of them too
+        cl::Buffer next_bucket_sizes_buffer_;
+        cl::Buffer next_buckets_buffer_;
+        cl::Buffer next_dropped_rows_buffer_;
+        cl::Buffer context_buffer_;
+
+        size_t buffers_size_;
+
+        // Updated by the solving thread, read through snapshots from anywhere
+        EquihashGPUMetrics metrics_;
+        std::mutex metrics_mutex_;
+        cl::Event hash_event_;
+        bool hash_event_pending_;
+
+    private:
+        cl::Buffer create_buffer(cl_mem_flags flags, size_t size);
+        const uint8_t * map_results(cl::Buffer & buffer, size_t size);
+        void unmap_results(cl::Buffer & buffer, const uint8_t * mapped);
+        bool read_counters(cl::Buffer & buffer, uint32_t * counters, size_t amount);
+        void record_kernel(EquihashKernelMetrics & kernel_metrics, const cl::Event & event);
+        void record_transfer(size_t to_device, size_t from_device);
+        void record_pending_hash();
+        bool create_initial_digest(size_t nonce, Blake2bMidstate & midstate);
+        void fit_local_size(cl::Kernel & kernel, EquihashKernelTuning & kernel_tuning);
+        size_t get_global_size(size_t work, const EquihashKernelTuning & kernel_tuning);
+        void prepare_buffers();
+        cl_int enqueue_and_run_kernel(cl::CommandQueue & queue, cl::Kernel & kernel, size_t global_size, 
+                                      bool wait = true, cl::Event * event = nullptr, size_t local_size = 0);
+        void enqueue_hash_kernel(size_t nonce, bool spare, cl::CommandQueue & queue, bool wait);
+        bool enqueue_bucket_kernel(cl::Buffer & working_table, size_t round, cl::Event & event);
+        bool enqueue_and_run_coliision_detection_rounds_kernel(const std::atomic<bool> & cancel);
+        std::vector<Proof> enqueue_and_run_solutions_kernel(size_t nonce);
+
+    public:
+        // Pipelined solving hashes nonce n+1 on the hash queue while nonce n goes through the rounds
+        // Tiled rounds load a tile of buckets to local memory per work group, if the device has room for it
+        // Fused hashing puts the leaves in the buckets of the first round as it writes them
+        // The tuning sets the launch sizes, the buckets of the tuning are already in the context
+        EquihashGPUWorker(EquihashGPUConfig & gpu_config, size_t device_index,
+                          const EquihashGPUContext & context, const EquihashInput & input,
+                          bool pipelined, bool tiled = true, bool fused = true,
+                          const EquihashGPUTuning & tuning = EquihashGPUTuning());
+        virtual ~EquihashGPUWorker();
+
+        bool is_valid();
+        // Whether the collision rounds ended up on the tiled kernel
+        bool is_tiled() const;
+
+        // Device memory taken by the buffers, all of them are allocated once up front
+        size_t get_buffers_size() const;
+        // Everything the device went through so far, kernel times come from the queue profiling
+        EquihashGPUMetrics get_metrics();
+
+        // Pulls nonces until the counter passes the last nonce or stop is raised
+        // Cancel is checked between the rounds, a cancelled nonce is not reported
+        // Returns the amount of nonces this worker went through
+        size_t solve_nonces(std::atomic<size_t> & next_nonce, size_t last_nonce,
+                            std::atomic<bool> & stop, const std::atomic<bool> & cancel,
+                            bool stop_on_first, const SolutionCallback & callback);
+    };
+}
+
+#endif
@@ -29,6 +29,7 @@ namespace Equihash
         virtual ~Proof();
 
         std::vector<uint8_t> & get_solution();
+        const std::vector<uint8_t> & get_solution()const;
         void set_solution(const std::vector<uint8_t> & sol);
         uint32_t get_solution_nonce()const;
         void set_solution_nonce(uint32_t nonce);
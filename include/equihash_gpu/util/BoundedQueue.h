@@ -0,0 +1,78 @@
+#ifndef UTIL_BOUNDED_QUEUE_H_
+#define UTIL_BOUNDED_QUEUE_H_
+
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <algorithm>
+
+// Blocking queue with a fixed capacity, push waits for room and pop waits for an item
+// Closing it wakes everyone up, pop drains what is left and then fails
+template <typename T>
+class BoundedQueue
+{
+private:
+    std::queue<T> items_;
+    std::mutex mutex_;
+    std::condition_variable not_empty_cv_;
+    std::condition_variable not_full_cv_;
+    size_t capacity_;
+    bool closed_;
+
+public:
+    BoundedQueue(size_t capacity) : capacity_(std::max((size_t)1, capacity)), closed_(false)
+    {
+
+    }
+
+    // Returns false if the queue was closed before there was room for the item
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_cv_.wait(lock, [this]{ return closed_ || items_.size() < capacity_; });
+        if(closed_)
+        {
+            return false;
+        }
+
+        items_.push(std::move(item));
+        lock.unlock();
+        not_empty_cv_.notify_one();
+        return true;
+    }
+
+    // Returns false once the queue is closed and empty
+    bool pop(T & item)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_cv_.wait(lock, [this]{ return closed_ || !items_.empty(); });
+        if(items_.empty())
+        {
+            return false;
+        }
+
+        item = std::move(items_.front());
+        items_.pop();
+        lock.unlock();
+        not_full_cv_.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        not_empty_cv_.notify_all();
+        not_full_cv_.notify_all();
+    }
+
+    bool is_closed()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return closed_;
+    }
+};
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef UTIL_THREAD_POOL_H_
+#define UTIL_THREAD_POOL_H_
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <queue>
+#include <vector>
+#include <algorithm>
+
+class ThreadPool
+{
+private:
+    std::vector<std::thread> workers_;
+    std::queue<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable tasks_cv_;
+    bool stopping_;
+
+private:
+    void worker_loop()
+    {
+        while(true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                tasks_cv_.wait(lock, [this]{ return stopping_ || !tasks_.empty(); });
+                if(stopping_ && tasks_.empty())
+                {
+                    return;
+                }
+                task = std::move(tasks_.front());
+                tasks_.pop();
+            }
+            task();
+        }
+    }
+
+public:
+    // Zero threads means one thread per hardware core
+    ThreadPool(size_t threads = 0) : stopping_(false)
+    {
+        if(threads == 0)
+        {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        for(size_t i=0;i<threads;i++)
+        {
+            workers_.emplace_back(&ThreadPool::worker_loop, this);
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        tasks_cv_.notify_all();
+        for(auto && worker : workers_)
+        {
+            worker.join();
+        }
+    }
+
+    size_t size() const
+    {
+        return workers_.size();
+    }
+
+    void enqueue(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.push(std::move(task));
+        }
+        tasks_cv_.notify_one();
+    }
+
+    // Splits [0, amount) into one chunk per worker and blocks until all of them are done
+    // func is called as func(chunk, begin, end), must not be called from inside a worker
+    template <typename Func>
+    void parallel_for(size_t amount, Func && func)
+    {
+        const size_t chunks = size();
+        const size_t chunk_size = (amount + chunks - 1) / chunks;
+        std::mutex done_mutex;
+        std::condition_variable done_cv;
+        size_t remaining = chunks;
+
+        for(size_t chunk=0;chunk<chunks;chunk++)
+        {
+            enqueue([&, chunk]()
+            {
+                size_t begin = std::min(amount, chunk * chunk_size);
+                size_t end = std::min(amount, begin + chunk_size);
+                func(chunk, begin, end);
+
+                std::lock_guard<std::mutex> lock(done_mutex);
+                if(--remaining == 0)
+                {
+                    done_cv.notify_one();
+                }
+            });
+        }
+
+        std::unique_lock<std::mutex> lock(done_mutex);
+        done_cv.wait(lock, [&]{ return remaining == 0; });
+    }
+};
+
+#endif
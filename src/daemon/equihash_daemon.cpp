@@ -0,0 +1,274 @@
+/**
+ * @file equihash_daemon.cpp
+ * @author ofir iluz (iluzofir@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2018-12-18
+ *
+ * @copyright Copyright (c) 2018
+ *
+ */
+
+#include "equihash_gpu/daemon/equihash_daemon.h"
+#include "equihash_gpu/util/Timer.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <iostream>
+
+// How often a connection looks at its job while it runs, and at the stop flag while idle
+#define JOB_POLL_MS 1
+#define IDLE_POLL_MS 100
+// The GPU solver keeps a round past the first and specializes up to 9 of them, a solution takes 2^K indices
+#define MIN_JOB_K 2
+#define MAX_JOB_K 10
+
+namespace Equihash
+{
+    EquihashDaemon::EquihashDaemon(const std::string & socket_path, SolverFactory factory) :
+        socket_path_(socket_path), factory_(factory), listen_fd_(-1), running_(true)
+    {
+
+    }
+
+    EquihashDaemon::~EquihashDaemon()
+    {
+        if(listen_fd_ >= 0)
+        {
+            close(listen_fd_);
+            unlink(socket_path_.c_str());
+        }
+    }
+
+    static bool is_valid_job(const DaemonJob & job)
+    {
+        // Same bounds the solvers size their tables with, a collision block has to fit a 32bit row index
+        // Jobs come off the socket, anything else would shift past the index width or underflow the rounds
+        return job.K >= MIN_JOB_K && job.K <= MAX_JOB_K && job.N <= 512 && job.N % 8 == 0 && 
+               job.N % (job.K + 1) == 0 && job.N / (job.K + 1) >= 4 && job.N / (job.K + 1) <= 30;
+    }
+
+    IEquihashSolver * EquihashDaemon::get_solver(DaemonJob & job)
+    {
+        std::pair<uint32_t, uint32_t> key(job.N, job.K);
+        IEquihashSolver * solver = nullptr;
+        auto it = solvers_.find(key);
+        if(it != solvers_.end())
+        {
+            solver = it->second.get();
+            solver->set_seed(job.seed);
+        }
+        else
+        {
+            solver = factory_(job.N, job.K, job.seed);
+            if(!solver)
+            {
+                return nullptr;
+            }
+            solvers_[key].reset(solver);
+        }
+
+        // The solver stays cached for the next jobs even if this header is refused
+        if(!job.header.empty() && !solver->set_header(job.header, job.nonce))
+        {
+            return nullptr;
+        }
+        return solver;
+    }
+
+    bool EquihashDaemon::warm_up(uint32_t N, uint32_t K)
+    {
+        // Everything else stays zero, an empty range on the seed job
+        DaemonJob job = DaemonJob();
+        job.N = N;
+        job.K = K;
+        job.first_nonce = 1;
+        if(!is_valid_job(job))
+        {
+            std::cout << "Bad parameters to warm up, N " << N << " K " << K << std::endl;
+            return false;
+        }
+
+        IEquihashSolver * solver = get_solver(job);
+        if(!solver)
+        {
+            return false;
+        }
+
+        // An empty range prepares the devices without solving anything
+        solver->solve_async(1, 0, SolutionCallback())->wait();
+        return true;
+    }
+
+    void EquihashDaemon::serve_connection(int fd)
+    {
+        // Solutions are written from the solving thread, the results from this one
+        std::mutex write_mutex;
+        std::shared_ptr<SolveHandle> handle;
+        DaemonJob job;
+        Timer job_timer;
+
+        auto send_frame = [&](uint8_t type, const std::vector<uint8_t> & payload)
+        {
+            std::lock_guard<std::mutex> lock(write_mutex);
+            return EquihashProtocol::write_frame(fd, type, payload);
+        };
+
+        auto finish_job = [&]()
+        {
+            handle->wait();
+            DaemonJobResult result;
+            result.solved_nonces = handle->get_solved_nonces();
+            result.solutions = handle->get_solutions();
+            result.cancelled = handle->is_cancelled();
+            handle.reset();
+
+            printf("Job %u,%u nonces %u-%u: %u solutions of %u nonces in %.2f ms%s\n",
+                   job.N, job.K, job.first_nonce, job.first_nonce + job.amount - 1,
+                   result.solutions, result.solved_nonces, job_timer.elapsed() / 1e6,
+                   result.cancelled ? " (cancelled)" : "");
+            return send_frame(FRAME_DONE, EquihashProtocol::encode_result(result));
+        };
+
+        bool connected = true;
+        while(running_ && connected)
+        {
+            if(handle && handle->is_done())
+            {
+                connected = finish_job();
+                continue;
+            }
+
+            struct pollfd poll_fd = {fd, POLLIN, 0};
+            int ready = poll(&poll_fd, 1, handle ? JOB_POLL_MS : IDLE_POLL_MS);
+            if(ready < 0 && errno != EINTR)
+            {
+                break;
+            }
+            if(ready <= 0)
+            {
+                continue;
+            }
+
+            uint8_t type;
+            std::vector<uint8_t> payload;
+            if(!EquihashProtocol::read_frame(fd, type, payload))
+            {
+                break;
+            }
+
+            if(type == FRAME_CANCEL)
+            {
+                if(handle)
+                {
+                    handle->cancel();
+                }
+                continue;
+            }
+
+            DaemonJob new_job;
+            if(type != FRAME_JOB || !EquihashProtocol::decode_job(payload, new_job) || !is_valid_job(new_job))
+            {
+                connected = send_frame(FRAME_ERROR, EquihashProtocol::encode_error("Bad job frame"));
+                continue;
+            }
+
+            // The running job gives way, it stops within a collision round and still reports its result
+            if(handle)
+            {
+                handle->cancel();
+                if(!finish_job())
+                {
+                    break;
+                }
+            }
+
+            job = new_job;
+            job_timer.reset();
+            IEquihashSolver * solver = get_solver(job);
+            if(!solver)
+            {
+                connected = send_frame(FRAME_ERROR,
+                                       EquihashProtocol::encode_error("No solver for the parameters or the header"));
+                continue;
+            }
+
+            handle = solver->solve_async(job.first_nonce, job.amount, [&send_frame](const Proof & proof)
+            {
+                // A client that went away is noticed by the reads, the job is cancelled there
+                send_frame(FRAME_SOLUTION, EquihashProtocol::encode_solution(proof.get_solution_nonce(),
+                                                                             proof.get_solution()));
+            }, job.stop_on_first);
+        }
+
+        if(handle)
+        {
+            handle->cancel();
+            handle->wait();
+        }
+    }
+
+    bool EquihashDaemon::run()
+    {
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if(socket_path_.size() >= sizeof(address.sun_path))
+        {
+            std::cout << "Socket path is too long: " << socket_path_ << std::endl;
+            return false;
+        }
+        strcpy(address.sun_path, socket_path_.c_str());
+
+        listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(listen_fd_ < 0)
+        {
+            perror("socket");
+            return false;
+        }
+
+        // A daemon that did not exit cleanly leaves its socket file behind
+        unlink(socket_path_.c_str());
+        if(bind(listen_fd_, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listen_fd_, 4) < 0)
+        {
+            perror("bind");
+            close(listen_fd_);
+            listen_fd_ = -1;
+            return false;
+        }
+
+        std::cout << "Listening on " << socket_path_ << std::endl;
+        while(running_)
+        {
+            struct pollfd poll_fd = {listen_fd_, POLLIN, 0};
+            if(poll(&poll_fd, 1, IDLE_POLL_MS) <= 0)
+            {
+                continue;
+            }
+
+            int fd = accept(listen_fd_, NULL, NULL);
+            if(fd < 0)
+            {
+                continue;
+            }
+
+            serve_connection(fd);
+            close(fd);
+        }
+
+        close(listen_fd_);
+        listen_fd_ = -1;
+        unlink(socket_path_.c_str());
+        return true;
+    }
+
+    void EquihashDaemon::stop()
+    {
+        running_ = false;
+    }
+}
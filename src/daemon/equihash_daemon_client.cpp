@@ -0,0 +1,123 @@
+/**
+ * @file equihash_daemon_client.cpp
+ * @author ofir iluz (iluzofir@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2018-12-18
+ *
+ * @copyright Copyright (c) 2018
+ *
+ */
+
+#include "equihash_gpu/daemon/equihash_daemon_client.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+namespace Equihash
+{
+    EquihashDaemonClient::EquihashDaemonClient() : fd_(-1)
+    {
+
+    }
+
+    EquihashDaemonClient::~EquihashDaemonClient()
+    {
+        disconnect();
+    }
+
+    bool EquihashDaemonClient::connect(const std::string & socket_path)
+    {
+        disconnect();
+
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if(socket_path.size() >= sizeof(address.sun_path))
+        {
+            error_ = "Socket path is too long";
+            return false;
+        }
+        strcpy(address.sun_path, socket_path.c_str());
+
+        fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd_ < 0 || ::connect(fd_, (struct sockaddr *)&address, sizeof(address)) < 0)
+        {
+            error_ = std::string("Could not connect: ") + strerror(errno);
+            disconnect();
+            return false;
+        }
+
+        return true;
+    }
+
+    void EquihashDaemonClient::disconnect()
+    {
+        if(fd_ >= 0)
+        {
+            close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    bool EquihashDaemonClient::submit_job(const DaemonJob & job)
+    {
+        return fd_ >= 0 && EquihashProtocol::write_frame(fd_, FRAME_JOB, EquihashProtocol::encode_job(job));
+    }
+
+    bool EquihashDaemonClient::cancel()
+    {
+        return fd_ >= 0 && EquihashProtocol::write_frame(fd_, FRAME_CANCEL, std::vector<uint8_t>());
+    }
+
+    bool EquihashDaemonClient::wait_job(const SolutionCallback & callback, DaemonJobResult & result)
+    {
+        uint8_t type;
+        std::vector<uint8_t> payload;
+        while(fd_ >= 0 && EquihashProtocol::read_frame(fd_, type, payload))
+        {
+            if(type == FRAME_SOLUTION)
+            {
+                Proof proof;
+                uint32_t nonce;
+                if(!EquihashProtocol::decode_solution(payload, nonce, proof.get_solution()))
+                {
+                    break;
+                }
+                proof.set_solution_nonce(nonce);
+                if(callback)
+                {
+                    callback(proof);
+                }
+            }
+            else if(type == FRAME_DONE)
+            {
+                if(EquihashProtocol::decode_result(payload, result))
+                {
+                    return true;
+                }
+                break;
+            }
+            else if(type == FRAME_ERROR)
+            {
+                error_ = EquihashProtocol::decode_error(payload);
+                return false;
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        error_ = "Connection to the daemon broke";
+        return false;
+    }
+
+    const std::string & EquihashDaemonClient::get_error() const
+    {
+        return error_;
+    }
+}
@@ -0,0 +1,219 @@
+/**
+ * @file equihash_protocol.cpp
+ * @author ofir iluz (iluzofir@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2018-12-18
+ *
+ * @copyright Copyright (c) 2018
+ *
+ */
+
+#include "equihash_gpu/daemon/equihash_protocol.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+namespace Equihash
+{
+    static void put_uint32(std::vector<uint8_t> & out, uint32_t value)
+    {
+        for(size_t i=0;i<sizeof(uint32_t);i++)
+        {
+            out.push_back((value >> (8*i)) & 0xFF);
+        }
+    }
+
+    static uint32_t get_uint32(const uint8_t * in)
+    {
+        return (uint32_t)in[0] | ((uint32_t)in[1] << 8) | ((uint32_t)in[2] << 16) | ((uint32_t)in[3] << 24);
+    }
+
+    static bool write_all(int fd, const uint8_t * data, size_t size)
+    {
+        while(size > 0)
+        {
+            // A client that went away must not kill the daemon with SIGPIPE
+            ssize_t written = send(fd, data, size, MSG_NOSIGNAL);
+            if(written < 0)
+            {
+                if(errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    static bool read_all(int fd, uint8_t * data, size_t size)
+    {
+        while(size > 0)
+        {
+            ssize_t got = recv(fd, data, size, 0);
+            if(got < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(got <= 0)
+            {
+                return false;
+            }
+            data += got;
+            size -= got;
+        }
+        return true;
+    }
+
+    bool EquihashProtocol::write_frame(int fd, uint8_t type, const std::vector<uint8_t> & payload)
+    {
+        if(payload.size() > MAX_FRAME_PAYLOAD)
+        {
+            return false;
+        }
+
+        // Header and payload go out in a single send so small frames are a single packet
+        std::vector<uint8_t> frame;
+        frame.reserve(FRAME_HEADER_SIZE + payload.size());
+        put_uint32(frame, payload.size());
+        frame.push_back(type);
+        frame.insert(frame.end(), payload.begin(), payload.end());
+        return write_all(fd, frame.data(), frame.size());
+    }
+
+    bool EquihashProtocol::read_frame(int fd, uint8_t & type, std::vector<uint8_t> & payload)
+    {
+        uint8_t header[FRAME_HEADER_SIZE];
+        if(!read_all(fd, header, FRAME_HEADER_SIZE))
+        {
+            return false;
+        }
+
+        uint32_t size = get_uint32(header);
+        if(size > MAX_FRAME_PAYLOAD)
+        {
+            return false;
+        }
+
+        type = header[4];
+        payload.resize(size);
+        return read_all(fd, payload.data(), size);
+    }
+
+    std::vector<uint8_t> EquihashProtocol::encode_job(const DaemonJob & job)
+    {
+        std::vector<uint8_t> payload;
+        put_uint32(payload, job.N);
+        put_uint32(payload, job.K);
+        for(size_t i=0;i<SEED_SIZE;i++)
+        {
+            put_uint32(payload, job.seed[i]);
+        }
+        put_uint32(payload, job.first_nonce);
+        put_uint32(payload, job.amount);
+        payload.push_back(job.stop_on_first ? 1 : 0);
+        if(!job.header.empty())
+        {
+            put_uint32(payload, job.header.size());
+            payload.insert(payload.end(), job.header.begin(), job.header.end());
+            payload.insert(payload.end(), job.nonce, job.nonce + EQUIHASH_NONCE_SIZE);
+        }
+        return payload;
+    }
+
+    bool EquihashProtocol::decode_job(const std::vector<uint8_t> & payload, DaemonJob & job)
+    {
+        const size_t seed_job_size = (4 + SEED_SIZE)*sizeof(uint32_t) + 1;
+        if(payload.size() != seed_job_size && payload.size() < seed_job_size + sizeof(uint32_t) + EQUIHASH_NONCE_SIZE)
+        {
+            return false;
+        }
+
+        const uint8_t * in = payload.data();
+        job.N = get_uint32(in);
+        job.K = get_uint32(in + 4);
+        for(size_t i=0;i<SEED_SIZE;i++)
+        {
+            job.seed[i] = get_uint32(in + 8 + 4*i);
+        }
+        in += 8 + 4*SEED_SIZE;
+        job.first_nonce = get_uint32(in);
+        job.amount = get_uint32(in + 4);
+        job.stop_on_first = in[8] != 0;
+
+        job.header.clear();
+        if(payload.size() == seed_job_size)
+        {
+            return true;
+        }
+
+        in = payload.data() + seed_job_size;
+        uint32_t header_size = get_uint32(in);
+        if(header_size == 0 || payload.size() != seed_job_size + sizeof(uint32_t) + header_size + EQUIHASH_NONCE_SIZE)
+        {
+            return false;
+        }
+        in += sizeof(uint32_t);
+        job.header.assign(in, in + header_size);
+        memcpy(job.nonce, in + header_size, EQUIHASH_NONCE_SIZE);
+        return true;
+    }
+
+    std::vector<uint8_t> EquihashProtocol::encode_result(const DaemonJobResult & result)
+    {
+        std::vector<uint8_t> payload;
+        put_uint32(payload, result.solved_nonces);
+        put_uint32(payload, result.solutions);
+        payload.push_back(result.cancelled ? 1 : 0);
+        return payload;
+    }
+
+    bool EquihashProtocol::decode_result(const std::vector<uint8_t> & payload, DaemonJobResult & result)
+    {
+        if(payload.size() != 2*sizeof(uint32_t) + 1)
+        {
+            return false;
+        }
+
+        result.solved_nonces = get_uint32(payload.data());
+        result.solutions = get_uint32(payload.data() + 4);
+        result.cancelled = payload[8] != 0;
+        return true;
+    }
+
+    std::vector<uint8_t> EquihashProtocol::encode_solution(uint32_t nonce, const std::vector<uint8_t> & solution)
+    {
+        std::vector<uint8_t> payload;
+        payload.reserve(sizeof(uint32_t) + solution.size());
+        put_uint32(payload, nonce);
+        payload.insert(payload.end(), solution.begin(), solution.end());
+        return payload;
+    }
+
+    bool EquihashProtocol::decode_solution(const std::vector<uint8_t> & payload, uint32_t & nonce, std::vector<uint8_t> & solution)
+    {
+        if(payload.size() < sizeof(uint32_t))
+        {
+            return false;
+        }
+
+        nonce = get_uint32(payload.data());
+        solution.assign(payload.begin() + sizeof(uint32_t), payload.end());
+        return true;
+    }
+
+    std::vector<uint8_t> EquihashProtocol::encode_error(const std::string & error)
+    {
+        return std::vector<uint8_t>(error.begin(), error.end());
+    }
+
+    std::string EquihashProtocol::decode_error(const std::vector<uint8_t> & payload)
+    {
+        return std::string(payload.begin(), payload.end());
+    }
+}
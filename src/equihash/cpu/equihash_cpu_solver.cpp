@@ -0,0 +1,476 @@
+/**
+ * @file equihash_cpu_solver.cpp
+ * @author ofir iluz (iluzofir@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2018-11-24
+ *
+ * @copyright Copyright (c) 2018
+ *
+ */
+
+#include "equihash_gpu/equihash/cpu/equihash_cpu_solver.h"
+#include <string.h>
+#include <endian.h>
+#include <algorithm>
+
+namespace Equihash
+{
+    EquihashCPUSolver::EquihashCPUSolver(uint32_t N, uint32_t K, uint32_t seed[SEED_SIZE], size_t threads)
+        : thread_pool_(threads)
+    {
+        equihash_context_.N = N;
+        equihash_context_.K = K;
+
+        // For now copy all the seed, can be changed later
+        memcpy(equihash_context_.seed, seed, sizeof(uint32_t)*SEED_SIZE);
+        EquihashUtils::initialize_input(N, K, seed, equihash_input_);
+
+        initialize_context();
+    }
+
+    EquihashCPUSolver::~EquihashCPUSolver()
+    {
+        cancel_async();
+    }
+
+    void EquihashCPUSolver::initialize_context()
+    {
+        EquihashUtils::initialize_context(equihash_context_);
+        EquihashUtils::print_context(equihash_context_);
+
+        // Buckets are keyed on the top bits of the collision block
+        bucket_bits_ = std::min<uint32_t>(CPU_BUCKET_BITS, equihash_context_.collision_bits_length);
+
+        // One table per level of the tree, the last level is only used for the final round
+        tables_.resize(equihash_context_.K);
+    }
+
+    void EquihashCPUSolver::generate_leaves(size_t nonce)
+    {
+        CollisionTable & leaves = tables_[0];
+        leaves.width = equihash_context_.hash_length;
+        leaves.rows = equihash_context_.init_size;
+        leaves.hashes.resize((size_t)leaves.rows * leaves.width);
+        leaves.parents.clear();
+
+        Blake2bMidstate midstate;
+        if(!EquihashUtils::initialize_midstate(equihash_input_, nonce, midstate))
+        {
+            std::cout << "The nonce prefix does not leave room for the leaf index in its final block" << std::endl;
+            leaves.rows = 0;
+            return;
+        }
+
+        const uint32_t leaf_bytes = equihash_context_.N / 8;
+        const uint32_t hashes_amount = (equihash_context_.init_size + equihash_context_.indices_per_hash_output - 1)
+                                        / equihash_context_.indices_per_hash_output;
+
+        thread_pool_.parallel_for(hashes_amount, [&](size_t, size_t begin, size_t end)
+        {
+            // Each hash continues from the seed and nonce midstate with its own index
+            // A batch of them is hashed at once on the lanes of the widest implementation
+            uint32_t indices[BLAKE2B_MAX_LANES];
+            uint8_t digests[BLAKE2B_MAX_LANES * BLAKE2B_OUTBYTES];
+            for(size_t i=begin;i<end;i+=BLAKE2B_MAX_LANES)
+            {
+                size_t batch = std::min((size_t)BLAKE2B_MAX_LANES, end - i);
+                for(size_t b=0;b<batch;b++)
+                {
+                    indices[b] = (uint32_t)(i + b);
+                }
+                EquihashBlake2b::hash_leaves(midstate, indices, batch, digests);
+
+                for(size_t b=0;b<batch;b++)
+                {
+                    // Split the hash to the fitting rows, limited to the table size
+                    const uint8_t * digest = digests + b*equihash_context_.hash_output;
+                    for(size_t j=0;j<equihash_context_.indices_per_hash_output;j++)
+                    {
+                        size_t row = (i + b)*equihash_context_.indices_per_hash_output + j;
+                        if(row >= leaves.rows)
+                        {
+                            break;
+                        }
+
+                        EquihashUtils::expand_array(digest + j*leaf_bytes, leaf_bytes,
+                                                    &leaves.hashes[row*leaves.width], leaves.width,
+                                                    equihash_context_.collision_bits_length);
+                    }
+                }
+            }
+        });
+    }
+
+    void EquihashCPUSolver::sort_into_buckets(const CollisionTable & table)
+    {
+        const uint32_t collision_bytes = equihash_context_.collision_bytes_length;
+        const uint32_t shift = equihash_context_.collision_bits_length - bucket_bits_;
+        const size_t buckets = (size_t)1 << bucket_bits_;
+        const size_t chunks = thread_pool_.size();
+        std::vector<uint32_t> counts(chunks * buckets, 0);
+
+        auto key_of = [&](size_t row)
+        {
+            const uint8_t * hash = &table.hashes[row*table.width];
+            uint32_t key = 0;
+            for(uint32_t x=0;x<collision_bytes;x++)
+            {
+                key = (key << 8) | hash[x];
+            }
+            return key;
+        };
+
+        // Count the rows of each bucket per chunk
+        thread_pool_.parallel_for(table.rows, [&](size_t chunk, size_t begin, size_t end)
+        {
+            uint32_t * chunk_counts = &counts[chunk*buckets];
+            for(size_t i=begin;i<end;i++)
+            {
+                chunk_counts[key_of(i) >> shift]++;
+            }
+        });
+
+        // Turn the counts into offsets, bucket major so each bucket ends up contiguous
+        bucket_offsets_.resize(buckets + 1);
+        uint32_t offset = 0;
+        for(size_t b=0;b<buckets;b++)
+        {
+            bucket_offsets_[b] = offset;
+            for(size_t chunk=0;chunk<chunks;chunk++)
+            {
+                uint32_t count = counts[chunk*buckets + b];
+                counts[chunk*buckets + b] = offset;
+                offset += count;
+            }
+        }
+        bucket_offsets_[buckets] = offset;
+
+        // Scatter the rows, the chunks split the same way so the order is deterministic
+        bucket_entries_.resize(table.rows);
+        thread_pool_.parallel_for(table.rows, [&](size_t chunk, size_t begin, size_t end)
+        {
+            uint32_t * chunk_offsets = &counts[chunk*buckets];
+            for(size_t i=begin;i<end;i++)
+            {
+                uint32_t key = key_of(i);
+                bucket_entries_[chunk_offsets[key >> shift]++] = BucketEntry{key, (uint32_t)i};
+            }
+        });
+    }
+
+    void EquihashCPUSolver::collision_round(uint32_t round)
+    {
+        const CollisionTable & in = tables_[round];
+        CollisionTable & out = tables_[round + 1];
+        const uint32_t collision_bytes = equihash_context_.collision_bytes_length;
+        const size_t buckets = (size_t)1 << bucket_bits_;
+        const size_t chunks = thread_pool_.size();
+
+        sort_into_buckets(in);
+        out.width = in.width - collision_bytes;
+
+        std::vector<std::vector<uint8_t>> chunk_hashes(chunks);
+        std::vector<std::vector<uint32_t>> chunk_parents(chunks);
+
+        thread_pool_.parallel_for(buckets, [&](size_t chunk, size_t begin, size_t end)
+        {
+            std::vector<uint8_t> & hashes = chunk_hashes[chunk];
+            std::vector<uint32_t> & parents = chunk_parents[chunk];
+            std::vector<uint8_t> combined(out.width);
+
+            for(size_t b=begin;b<end;b++)
+            {
+                BucketEntry * first = bucket_entries_.data() + bucket_offsets_[b];
+                BucketEntry * last = bucket_entries_.data() + bucket_offsets_[b + 1];
+                std::sort(first, last, [](const BucketEntry & x, const BucketEntry & y)
+                {
+                    return x.key < y.key || (x.key == y.key && x.row < y.row);
+                });
+
+                // Every run of equal keys collides on this round's block
+                for(BucketEntry * run = first, * run_end = first;run < last;run = run_end)
+                {
+                    while(run_end < last && run_end->key == run->key)
+                    {
+                        run_end++;
+                    }
+                    BucketEntry * group_end = std::min(run_end, run + MAX_COLLISION_GROUP_SIZE);
+
+                    for(BucketEntry * x = run;x < group_end;x++)
+                    {
+                        const uint8_t * a = &in.hashes[(size_t)x->row*in.width + collision_bytes];
+                        for(BucketEntry * y = x + 1;y < group_end;y++)
+                        {
+                            const uint8_t * b = &in.hashes[(size_t)y->row*in.width + collision_bytes];
+                            uint8_t any = 0;
+                            for(uint32_t i=0;i<out.width;i++)
+                            {
+                                combined[i] = a[i] ^ b[i];
+                                any |= combined[i];
+                            }
+
+                            // Identical hashes can only be made of the same leaves, drop them early
+                            if(!any)
+                            {
+                                continue;
+                            }
+
+                            hashes.insert(hashes.end(), combined.begin(), combined.end());
+                            parents.push_back(x->row);
+                            parents.push_back(y->row);
+                        }
+                    }
+                }
+            }
+        });
+
+        // Join the chunks in order
+        out.rows = 0;
+        for(auto && parents : chunk_parents)
+        {
+            out.rows += parents.size() / 2;
+        }
+        out.hashes.resize((size_t)out.rows * out.width);
+        out.parents.resize((size_t)out.rows * 2);
+
+        size_t row = 0;
+        for(size_t chunk=0;chunk<chunks;chunk++)
+        {
+            std::copy(chunk_hashes[chunk].begin(), chunk_hashes[chunk].end(), out.hashes.begin() + row*out.width);
+            std::copy(chunk_parents[chunk].begin(), chunk_parents[chunk].end(), out.parents.begin() + row*2);
+            row += chunk_parents[chunk].size() / 2;
+        }
+    }
+
+    std::vector<std::pair<uint32_t, uint32_t>> EquihashCPUSolver::final_round()
+    {
+        const CollisionTable & in = tables_[equihash_context_.K - 1];
+        const uint32_t collision_bytes = equihash_context_.collision_bytes_length;
+        const size_t buckets = (size_t)1 << bucket_bits_;
+        const size_t chunks = thread_pool_.size();
+
+        sort_into_buckets(in);
+
+        std::vector<std::vector<std::pair<uint32_t, uint32_t>>> chunk_candidates(chunks);
+        thread_pool_.parallel_for(buckets, [&](size_t chunk, size_t begin, size_t end)
+        {
+            for(size_t b=begin;b<end;b++)
+            {
+                BucketEntry * first = bucket_entries_.data() + bucket_offsets_[b];
+                BucketEntry * last = bucket_entries_.data() + bucket_offsets_[b + 1];
+                std::sort(first, last, [](const BucketEntry & x, const BucketEntry & y)
+                {
+                    return x.key < y.key || (x.key == y.key && x.row < y.row);
+                });
+
+                // The last two blocks have to fully collide for a solution
+                for(BucketEntry * x = first;x < last;x++)
+                {
+                    const uint8_t * a = &in.hashes[(size_t)x->row*in.width];
+                    for(BucketEntry * y = x + 1;y < last && y->key == x->key;y++)
+                    {
+                        const uint8_t * b = &in.hashes[(size_t)y->row*in.width];
+                        if(memcmp(a + collision_bytes, b + collision_bytes, in.width - collision_bytes) == 0)
+                        {
+                            chunk_candidates[chunk].push_back(std::make_pair(x->row, y->row));
+                        }
+                    }
+                }
+            }
+        });
+
+        std::vector<std::pair<uint32_t, uint32_t>> candidates;
+        for(auto && chunk : chunk_candidates)
+        {
+            candidates.insert(candidates.end(), chunk.begin(), chunk.end());
+        }
+
+        return candidates;
+    }
+
+    void EquihashCPUSolver::collect_leaves(uint32_t level, uint32_t row, uint32_t * indices)
+    {
+        if(level == 0)
+        {
+            *indices = row;
+            return;
+        }
+
+        const uint32_t * parents = &tables_[level].parents[(size_t)row*2];
+        collect_leaves(level - 1, parents[0], indices);
+        collect_leaves(level - 1, parents[1], indices + (1 << (level - 1)));
+    }
+
+    bool EquihashCPUSolver::rebuild_indices(uint32_t left, uint32_t right, std::vector<uint32_t> & indices)
+    {
+        const uint32_t half = 1 << (equihash_context_.K - 1);
+        indices.resize(2 * half);
+
+        // Walk back through the tables to get the leaves of both sides
+        collect_leaves(equihash_context_.K - 1, left, &indices[0]);
+        collect_leaves(equihash_context_.K - 1, right, &indices[half]);
+
+        // Order each pair of subtrees so the one with the smaller first index is on the left
+        for(size_t size=1;size<indices.size();size<<=1)
+        {
+            for(size_t i=0;i<indices.size();i+=2*size)
+            {
+                if(indices[i] == indices[i + size])
+                {
+                    return false;
+                }
+                if(indices[i] > indices[i + size])
+                {
+                    std::swap_ranges(indices.begin() + i, indices.begin() + i + size, indices.begin() + i + size);
+                }
+            }
+        }
+
+        // All of the leaves must be distinct
+        std::vector<uint32_t> sorted(indices);
+        std::sort(sorted.begin(), sorted.end());
+        return std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end();
+    }
+
+    std::vector<Proof> EquihashCPUSolver::collect_solutions(size_t nonce,
+                                                            const std::vector<std::pair<uint32_t, uint32_t>> & candidates)
+    {
+        std::vector<std::vector<uint8_t>> solutions;
+        std::vector<uint32_t> indices;
+        for(auto && candidate : candidates)
+        {
+            if(rebuild_indices(candidate.first, candidate.second, indices))
+            {
+                solutions.push_back(EquihashUtils::indices_to_solution(equihash_context_, indices));
+            }
+        }
+
+        // Different trees can end up with the same leaves
+        std::sort(solutions.begin(), solutions.end());
+        solutions.erase(std::unique(solutions.begin(), solutions.end()), solutions.end());
+
+        std::vector<Proof> proofs;
+        proofs.reserve(solutions.size());
+        for(auto && solution : solutions)
+        {
+            proofs.push_back(Proof(solution, nonce));
+        }
+
+        return proofs;
+    }
+
+    std::vector<Proof> EquihashCPUSolver::solve_nonce(size_t nonce)
+    {
+        std::atomic<bool> cancel(false);
+        return solve_nonce(nonce, cancel);
+    }
+
+    std::vector<Proof> EquihashCPUSolver::solve_nonce(size_t nonce, const std::atomic<bool> & cancel)
+    {
+        generate_leaves(nonce);
+
+        // All of the rounds but the last collide on a single block
+        for(uint32_t round=0;round+1<equihash_context_.K;round++)
+        {
+            if(cancel)
+            {
+                return std::vector<Proof>();
+            }
+
+            collision_round(round);
+            std::cout << "Round " << round+1 << " finished, collision size = " << tables_[round+1].rows << std::endl;
+
+            if(tables_[round+1].rows == 0)
+            {
+                return std::vector<Proof>();
+            }
+        }
+
+        if(cancel)
+        {
+            return std::vector<Proof>();
+        }
+
+        return collect_solutions(nonce, final_round());
+    }
+
+    size_t EquihashCPUSolver::solve_range(size_t first_nonce, size_t amount, bool stop_on_first,
+                                          const SolutionCallback & callback, const std::atomic<bool> & cancel)
+    {
+        size_t last_nonce = std::min(first_nonce + amount, (size_t)MAX_NONCE);
+        size_t solved = 0;
+        for(size_t nonce=first_nonce;nonce<last_nonce && !cancel;nonce++)
+        {
+            std::vector<Proof> solutions = solve_nonce(nonce, cancel);
+            if(cancel)
+            {
+                break;
+            }
+
+            solved++;
+            for(auto && proof : solutions)
+            {
+                callback(proof);
+            }
+
+            if(stop_on_first && !solutions.empty())
+            {
+                break;
+            }
+        }
+
+        return solved;
+    }
+
+    std::vector<Proof> EquihashCPUSolver::find_proof()
+    {
+        for(size_t nonce=1;nonce<MAX_NONCE;nonce++)
+        {
+            std::vector<Proof> solutions = solve_nonce(nonce);
+            std::cout << "Nonce " << nonce << " finished, solutions = " << solutions.size() << std::endl;
+
+            if(!solutions.empty())
+            {
+                return solutions;
+            }
+        }
+
+        return std::vector<Proof>();
+    }
+
+    bool EquihashCPUSolver::verify_proof(const Proof & proof)
+    {
+        EquihashVerifier verifier(equihash_context_, equihash_input_);
+        return verifier.verify(proof);
+    }
+
+    void EquihashCPUSolver::set_seed(const uint32_t seed[SEED_SIZE])
+    {
+        // The seed only goes into the digest of each nonce, the rest of the state stays as it is
+        cancel_async();
+        memcpy(equihash_context_.seed, seed, sizeof(uint32_t)*SEED_SIZE);
+        EquihashUtils::initialize_input(equihash_context_.N, equihash_context_.K, seed, equihash_input_);
+    }
+
+    void EquihashCPUSolver::set_input(const EquihashInput & input)
+    {
+        cancel_async();
+        equihash_input_ = input;
+    }
+
+    bool EquihashCPUSolver::set_header(const std::vector<uint8_t> & header, const uint8_t nonce[EQUIHASH_NONCE_SIZE])
+    {
+        EquihashInput input;
+        if(!EquihashUtils::initialize_input(equihash_context_.N, equihash_context_.K,
+                                            header.data(), header.size(), nonce, input))
+        {
+            std::cout << "A header of " << header.size() << " bytes splits the leaf index between two blocks" << std::endl;
+            return false;
+        }
+
+        cancel_async();
+        equihash_input_ = input;
+        return true;
+    }
+}
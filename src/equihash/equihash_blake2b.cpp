@@ -0,0 +1,400 @@
+/**
+ * @file equihash_blake2b.cpp
+ * @author ofir iluz (iluzofir@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2018-12-16
+ *
+ * @copyright Copyright (c) 2018
+ *
+ */
+
+#include "equihash_gpu/equihash/equihash_blake2b.h"
+#include <string.h>
+#include <endian.h>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLAKE2B_HAS_SIMD
+#endif
+
+#define ROTR64(x, y) (((x) >> (y)) ^ ((x) << (64 - (y))))
+
+namespace Equihash
+{
+    static const uint64_t BLAKE2B_IV[8] =
+    {
+        0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL, 0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
+        0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL, 0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL
+    };
+
+    static const uint8_t BLAKE2B_SIGMA[12][16] =
+    {
+        {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+        { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+        { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+        {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+        {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+        {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+        { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+        { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+        {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+        { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+        {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+        { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 }
+    };
+
+    void EquihashBlake2b::compress(uint64_t hash_state[8], const uint64_t block[BLAKE2B_WORDS], uint64_t t, bool last)
+    {
+        uint64_t v[16];
+        memcpy(v, hash_state, sizeof(uint64_t)*8);
+        memcpy(v + 8, BLAKE2B_IV, sizeof(uint64_t)*8);
+        v[12] ^= t;
+        if(last)
+        {
+            v[14] = ~v[14];
+        }
+
+#define G(r, i, a, b, c, d)                                      \
+        a = a + b + block[BLAKE2B_SIGMA[r][2*i]];                \
+        d = ROTR64(d ^ a, 32);                                   \
+        c = c + d;                                               \
+        b = ROTR64(b ^ c, 24);                                   \
+        a = a + b + block[BLAKE2B_SIGMA[r][2*i+1]];              \
+        d = ROTR64(d ^ a, 16);                                   \
+        c = c + d;                                               \
+        b = ROTR64(b ^ c, 63);
+
+        for(uint32_t r=0;r<12;r++)
+        {
+            G(r, 0, v[0], v[4], v[8],  v[12]);
+            G(r, 1, v[1], v[5], v[9],  v[13]);
+            G(r, 2, v[2], v[6], v[10], v[14]);
+            G(r, 3, v[3], v[7], v[11], v[15]);
+            G(r, 4, v[0], v[5], v[10], v[15]);
+            G(r, 5, v[1], v[6], v[11], v[12]);
+            G(r, 6, v[2], v[7], v[8],  v[13]);
+            G(r, 7, v[3], v[4], v[9],  v[14]);
+        }
+
+#undef G
+
+        for(uint32_t i=0;i<8;i++)
+        {
+            hash_state[i] ^= v[i] ^ v[i + 8];
+        }
+    }
+
+    size_t EquihashBlake2b::compress_blocks(uint64_t hash_state[8], uint64_t & length, const uint8_t * data, size_t size)
+    {
+        size_t compressed = 0;
+        for(;compressed+BLAKE2B_BLOCKBYTES<=size;compressed+=BLAKE2B_BLOCKBYTES)
+        {
+            uint64_t block[BLAKE2B_WORDS];
+            for(uint32_t i=0;i<BLAKE2B_WORDS;i++)
+            {
+                uint64_t word;
+                memcpy(&word, data + compressed + i*sizeof(uint64_t), sizeof(word));
+                block[i] = le64toh(word);
+            }
+
+            length += BLAKE2B_BLOCKBYTES;
+            compress(hash_state, block, length, false);
+        }
+
+        return compressed;
+    }
+
+    bool EquihashBlake2b::create_midstate(const blake2b_state & state, size_t digest_length, Blake2bMidstate & midstate)
+    {
+        return create_midstate(state.h, state.t[0], state.buf, state.buflen, digest_length, midstate);
+    }
+
+    bool EquihashBlake2b::create_midstate(const uint64_t hash_state[8], uint64_t length, const uint8_t * buffer, 
+                                          size_t buffer_length, size_t digest_length, Blake2bMidstate & midstate)
+    {
+        uint64_t t = length;
+        memcpy(midstate.hash_state, hash_state, sizeof(midstate.hash_state));
+
+        // Whatever is left of the prefix may still hold whole blocks, the index comes after them
+        size_t compressed = compress_blocks(midstate.hash_state, t, buffer, buffer_length);
+        buffer += compressed;
+        buffer_length -= compressed;
+
+        // The index has to fit in the final block along with the rest of the prefix
+        if(buffer_length + LEAF_INDEX_SIZE > BLAKE2B_BLOCKBYTES)
+        {
+            return false;
+        }
+
+        // The final block is zero padded, the index goes right after the prefix
+        uint8_t final_block[BLAKE2B_BLOCKBYTES] = {0};
+        memcpy(final_block, buffer, buffer_length);
+        for(uint32_t i=0;i<BLAKE2B_WORDS;i++)
+        {
+            uint64_t word;
+            memcpy(&word, final_block + i*sizeof(uint64_t), sizeof(word));
+            midstate.block[i] = le64toh(word);
+        }
+
+        midstate.length = t + buffer_length + LEAF_INDEX_SIZE;
+        midstate.index_offset = buffer_length;
+        midstate.digest_length = digest_length;
+
+        return true;
+    }
+
+    void EquihashBlake2b::hash_leaf(const Blake2bMidstate & midstate, uint32_t index, uint8_t * out)
+    {
+        uint64_t hash_state[8];
+        uint64_t block[BLAKE2B_WORDS];
+        memcpy(hash_state, midstate.hash_state, sizeof(hash_state));
+        memcpy(block, midstate.block, sizeof(block));
+
+        // The index may straddle two words
+        const uint32_t word = midstate.index_offset / sizeof(uint64_t);
+        const uint32_t shift = (midstate.index_offset % sizeof(uint64_t)) * 8;
+        block[word] |= (uint64_t)index << shift;
+        if(shift > 32)
+        {
+            block[word + 1] |= (uint64_t)index >> (64 - shift);
+        }
+
+        compress(hash_state, block, midstate.length, true);
+        for(uint32_t i=0;i<8;i++)
+        {
+            hash_state[i] = htole64(hash_state[i]);
+        }
+        memcpy(out, hash_state, midstate.digest_length);
+    }
+    // Splits the index of every lane over the block words it lands in
+    // Only these two words differ between the lanes, the rest of the block is shared
+    static void lane_index_words(const Blake2bMidstate & midstate, const uint32_t * indices, size_t lanes,
+                                 uint64_t low[BLAKE2B_MAX_LANES], uint64_t high[BLAKE2B_MAX_LANES])
+    {
+        const uint32_t word = midstate.index_offset / sizeof(uint64_t);
+        const uint32_t shift = (midstate.index_offset % sizeof(uint64_t)) * 8;
+        for(size_t l=0;l<lanes;l++)
+        {
+            low[l] = midstate.block[word] | ((uint64_t)indices[l] << shift);
+            high[l] = word + 1 < BLAKE2B_WORDS ? midstate.block[word + 1] : 0;
+            if(shift > 32)
+            {
+                high[l] |= (uint64_t)indices[l] >> (64 - shift);
+            }
+        }
+    }
+
+#ifdef BLAKE2B_HAS_SIMD
+#define LANES_G(r, i, a, b, c, d, ADD, XOR, ROTR)                \
+        a = ADD(ADD(a, b), m[BLAKE2B_SIGMA[r][2*i]]);            \
+        d = ROTR(XOR(d, a), 32);                                 \
+        c = ADD(c, d);                                           \
+        b = ROTR(XOR(b, c), 24);                                 \
+        a = ADD(ADD(a, b), m[BLAKE2B_SIGMA[r][2*i+1]]);          \
+        d = ROTR(XOR(d, a), 16);                                 \
+        c = ADD(c, d);                                           \
+        b = ROTR(XOR(b, c), 63);
+
+#define LANES_ROUND(r, ADD, XOR, ROTR)                           \
+        LANES_G(r, 0, v[0], v[4], v[8],  v[12], ADD, XOR, ROTR); \
+        LANES_G(r, 1, v[1], v[5], v[9],  v[13], ADD, XOR, ROTR); \
+        LANES_G(r, 2, v[2], v[6], v[10], v[14], ADD, XOR, ROTR); \
+        LANES_G(r, 3, v[3], v[7], v[11], v[15], ADD, XOR, ROTR); \
+        LANES_G(r, 4, v[0], v[5], v[10], v[15], ADD, XOR, ROTR); \
+        LANES_G(r, 5, v[1], v[6], v[11], v[12], ADD, XOR, ROTR); \
+        LANES_G(r, 6, v[2], v[7], v[8],  v[13], ADD, XOR, ROTR); \
+        LANES_G(r, 7, v[3], v[4], v[9],  v[14], ADD, XOR, ROTR);
+
+    // Rotations by 32, 24 and 16 are whole bytes, done with shuffles
+    __attribute__((target("avx2")))
+    static inline __m256i rotr_avx2(__m256i x, int bits)
+    {
+        const __m256i rotate16 = _mm256_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+                                                  2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+        const __m256i rotate24 = _mm256_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+                                                  3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+        switch(bits)
+        {
+            case 32: return _mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1));
+            case 24: return _mm256_shuffle_epi8(x, rotate24);
+            case 16: return _mm256_shuffle_epi8(x, rotate16);
+            default: return _mm256_or_si256(_mm256_srli_epi64(x, 63), _mm256_add_epi64(x, x));
+        }
+    }
+
+    __attribute__((target("avx2")))
+    static void hash_lanes_avx2(const Blake2bMidstate & midstate, const uint32_t * indices,
+                                uint64_t out[8][BLAKE2B_MAX_LANES])
+    {
+        const uint32_t word = midstate.index_offset / sizeof(uint64_t);
+        uint64_t low[BLAKE2B_MAX_LANES], high[BLAKE2B_MAX_LANES];
+        __m256i m[BLAKE2B_WORDS], v[16];
+        lane_index_words(midstate, indices, 4, low, high);
+
+        for(uint32_t i=0;i<BLAKE2B_WORDS;i++)
+        {
+            m[i] = _mm256_set1_epi64x(midstate.block[i]);
+        }
+        m[word] = _mm256_loadu_si256((const __m256i *)low);
+        if(word + 1 < BLAKE2B_WORDS)
+        {
+            m[word + 1] = _mm256_loadu_si256((const __m256i *)high);
+        }
+
+        for(uint32_t i=0;i<8;i++)
+        {
+            v[i] = _mm256_set1_epi64x(midstate.hash_state[i]);
+            v[i + 8] = _mm256_set1_epi64x(BLAKE2B_IV[i]);
+        }
+        v[12] = _mm256_xor_si256(v[12], _mm256_set1_epi64x(midstate.length));
+        v[14] = _mm256_xor_si256(v[14], _mm256_set1_epi64x(-1));
+
+        for(uint32_t r=0;r<12;r++)
+        {
+            LANES_ROUND(r, _mm256_add_epi64, _mm256_xor_si256, rotr_avx2);
+        }
+
+        for(uint32_t i=0;i<8;i++)
+        {
+            __m256i h = _mm256_xor_si256(_mm256_set1_epi64x(midstate.hash_state[i]),
+                                         _mm256_xor_si256(v[i], v[i + 8]));
+            _mm256_storeu_si256((__m256i *)out[i], h);
+        }
+    }
+
+    // The masked form with all lanes set is the same vprorq, without the undefined source operand
+    __attribute__((target("avx512f")))
+    static inline __m512i rotr_avx512(__m512i x, int bits)
+    {
+        switch(bits)
+        {
+            case 32: return _mm512_mask_ror_epi64(x, 0xFF, x, 32);
+            case 24: return _mm512_mask_ror_epi64(x, 0xFF, x, 24);
+            case 16: return _mm512_mask_ror_epi64(x, 0xFF, x, 16);
+            default: return _mm512_mask_ror_epi64(x, 0xFF, x, 63);
+        }
+    }
+
+    __attribute__((target("avx512f")))
+    static void hash_lanes_avx512(const Blake2bMidstate & midstate, const uint32_t * indices,
+                                  uint64_t out[8][BLAKE2B_MAX_LANES])
+    {
+        const uint32_t word = midstate.index_offset / sizeof(uint64_t);
+        uint64_t low[BLAKE2B_MAX_LANES], high[BLAKE2B_MAX_LANES];
+        __m512i m[BLAKE2B_WORDS], v[16];
+        lane_index_words(midstate, indices, 8, low, high);
+
+        for(uint32_t i=0;i<BLAKE2B_WORDS;i++)
+        {
+            m[i] = _mm512_set1_epi64(midstate.block[i]);
+        }
+        m[word] = _mm512_loadu_si512(low);
+        if(word + 1 < BLAKE2B_WORDS)
+        {
+            m[word + 1] = _mm512_loadu_si512(high);
+        }
+
+        for(uint32_t i=0;i<8;i++)
+        {
+            v[i] = _mm512_set1_epi64(midstate.hash_state[i]);
+            v[i + 8] = _mm512_set1_epi64(BLAKE2B_IV[i]);
+        }
+        v[12] = _mm512_xor_si512(v[12], _mm512_set1_epi64(midstate.length));
+        v[14] = _mm512_xor_si512(v[14], _mm512_set1_epi64(-1));
+
+        for(uint32_t r=0;r<12;r++)
+        {
+            LANES_ROUND(r, _mm512_add_epi64, _mm512_xor_si512, rotr_avx512);
+        }
+
+        for(uint32_t i=0;i<8;i++)
+        {
+            __m512i h = _mm512_xor_si512(_mm512_set1_epi64(midstate.hash_state[i]),
+                                         _mm512_xor_si512(v[i], v[i + 8]));
+            _mm512_storeu_si512(out[i], h);
+        }
+    }
+
+#undef LANES_ROUND
+#undef LANES_G
+#endif
+
+    bool EquihashBlake2b::is_supported(Blake2bImplementation implementation)
+    {
+        switch(implementation)
+        {
+            case BLAKE2B_SCALAR:
+                return true;
+#ifdef BLAKE2B_HAS_SIMD
+            case BLAKE2B_AVX2:
+                return __builtin_cpu_supports("avx2");
+            case BLAKE2B_AVX512:
+                return __builtin_cpu_supports("avx512f");
+#endif
+            default:
+                return false;
+        }
+    }
+
+    Blake2bImplementation EquihashBlake2b::get_implementation()
+    {
+        static const Blake2bImplementation implementation =
+            is_supported(BLAKE2B_AVX512) ? BLAKE2B_AVX512 :
+            is_supported(BLAKE2B_AVX2) ? BLAKE2B_AVX2 : BLAKE2B_SCALAR;
+        return implementation;
+    }
+
+    void EquihashBlake2b::hash_leaves(const Blake2bMidstate & midstate, const uint32_t * indices, size_t count, uint8_t * out)
+    {
+        hash_leaves(midstate, indices, count, out, get_implementation());
+    }
+
+    void EquihashBlake2b::hash_leaves(const Blake2bMidstate & midstate, const uint32_t * indices, size_t count, uint8_t * out,
+                                      Blake2bImplementation implementation)
+    {
+        if(implementation == BLAKE2B_SCALAR || !is_supported(implementation))
+        {
+            for(size_t i=0;i<count;i++)
+            {
+                hash_leaf(midstate, indices[i], out + i*midstate.digest_length);
+            }
+            return;
+        }
+
+#ifdef BLAKE2B_HAS_SIMD
+        const size_t lanes = implementation == BLAKE2B_AVX512 ? 8 : 4;
+        uint32_t lane_indices[BLAKE2B_MAX_LANES];
+        uint64_t words[8][BLAKE2B_MAX_LANES];
+        for(size_t i=0;i<count;i+=lanes)
+        {
+            // The last batch repeats its last index on the lanes that are left
+            size_t amount = std::min(lanes, count - i);
+            for(size_t l=0;l<lanes;l++)
+            {
+                lane_indices[l] = indices[i + std::min(l, amount - 1)];
+            }
+
+            if(implementation == BLAKE2B_AVX512)
+            {
+                hash_lanes_avx512(midstate, lane_indices, words);
+            }
+            else
+            {
+                hash_lanes_avx2(midstate, lane_indices, words);
+            }
+
+            // The lanes come out transposed, each word of a digest in a different vector
+            for(size_t l=0;l<amount;l++)
+            {
+                uint64_t digest[8];
+                for(uint32_t w=0;w<8;w++)
+                {
+                    digest[w] = htole64(words[w][l]);
+                }
+                memcpy(out + (i + l)*midstate.digest_length, digest, midstate.digest_length);
+            }
+        }
+#endif
+    }
+}
@@ -0,0 +1,135 @@
+/**
+ * @file equihash_solver.cpp
+ * @author ofir iluz (iluzofir@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2018-12-17
+ *
+ * @copyright Copyright (c) 2018
+ *
+ */
+
+#include "equihash_gpu/equihash/equihash_solver.h"
+
+namespace Equihash
+{
+    SolveHandle::SolveHandle() : cancelled_(false), solved_nonces_(0), solutions_(0), done_(false)
+    {
+
+    }
+
+    void SolveHandle::finish(size_t solved_nonces)
+    {
+        solved_nonces_ = solved_nonces;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done_ = true;
+        }
+        done_cv_.notify_all();
+    }
+
+    void SolveHandle::cancel()
+    {
+        cancelled_ = true;
+        if(on_cancel_)
+        {
+            on_cancel_();
+        }
+    }
+
+    bool SolveHandle::is_cancelled() const
+    {
+        return cancelled_;
+    }
+
+    bool SolveHandle::is_done()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return done_;
+    }
+
+    void SolveHandle::wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_cv_.wait(lock, [this]{ return done_; });
+    }
+
+    size_t SolveHandle::get_solved_nonces() const
+    {
+        return solved_nonces_;
+    }
+
+    size_t SolveHandle::get_solutions() const
+    {
+        return solutions_;
+    }
+
+    void IEquihashSolver::cancel_async()
+    {
+        std::lock_guard<std::mutex> lock(async_mutex_);
+        if(current_handle_)
+        {
+            current_handle_->cancel();
+        }
+        if(current_thread_.joinable())
+        {
+            current_thread_.join();
+        }
+        current_handle_.reset();
+    }
+
+    std::shared_ptr<SolveHandle> IEquihashSolver::start_async(size_t first_nonce, size_t amount, SolutionCallback callback,
+                                                              bool stop_on_first, std::function<void()> on_finish,
+                                                              std::function<void()> on_cancel)
+    {
+        // The backends are not reentrant, the running solve gives way to the new one
+        cancel_async();
+
+        std::lock_guard<std::mutex> lock(async_mutex_);
+        std::shared_ptr<SolveHandle> handle = std::make_shared<SolveHandle>();
+        handle->on_cancel_ = on_cancel;
+        current_handle_ = handle;
+        current_thread_ = std::thread([this, handle, first_nonce, amount, callback, stop_on_first, on_finish]()
+        {
+            SolutionCallback counted_callback = [&handle, &callback](const Proof & proof)
+            {
+                handle->solutions_++;
+                if(callback)
+                {
+                    callback(proof);
+                }
+            };
+
+            size_t solved = solve_range(first_nonce, amount, stop_on_first, counted_callback, handle->cancelled_);
+            if(on_finish)
+            {
+                on_finish();
+            }
+            handle->finish(solved);
+        });
+
+        return handle;
+    }
+
+    std::shared_ptr<SolveHandle> IEquihashSolver::solve_async(size_t first_nonce, size_t amount,
+                                                              SolutionCallback callback, bool stop_on_first)
+    {
+        return start_async(first_nonce, amount, callback, stop_on_first, 
+                           std::function<void()>(), std::function<void()>());
+    }
+
+    std::shared_ptr<SolveHandle> IEquihashSolver::solve_async(size_t first_nonce, size_t amount,
+                                                              std::shared_ptr<ProofChannel> channel, bool stop_on_first)
+    {
+        // The solving thread pushes under the lock of the solver, a full channel would block every device
+        // and the join of the cancel with them, closing it on cancel lets the push fail instead
+        auto close_channel = [channel]()
+        {
+            channel->close();
+        };
+        return start_async(first_nonce, amount, [channel](const Proof & proof)
+        {
+            channel->push(proof);
+        }, stop_on_first, close_channel, close_channel);
+    }
+}
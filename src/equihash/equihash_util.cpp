@@ -0,0 +1,241 @@
+/**
+ * @file equihash_util.cpp
+ * @author ofir iluz (iluzofir@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2018-12-02
+ *
+ * @copyright Copyright (c) 2018
+ *
+ */
+
+#include "equihash_gpu/equihash/equihash_util.h"
+#include <stdio.h>
+#include <string.h>
+#include <endian.h>
+
+namespace Equihash
+{
+    void EquihashUtils::initialize_context(EquihashContext & context)
+    {
+        // Number of bits to extract for each block - N / (K+1)
+        context.collision_bits_length = context.N / (context.K + 1);
+        // Same as above but in bytes rounded up
+        context.collision_bytes_length = (context.collision_bits_length+7)/8;
+        // Jump between each block of bits - (k+1) * collisionBytesLength
+        context.hash_length = (context.K+1) * context.collision_bytes_length;
+        // Number of parts to derive blocks from the hash - blake_bits(512) / N
+        context.indices_per_hash_output = 512 / context.N;
+        // Blake output size in bytes
+        context.hash_output = context.indices_per_hash_output*context.N / 8;
+        // Width of a single row in the hash table - sizeof(uint32) * (2^(k-1)) + 2*collisionByteLength
+        context.full_width = sizeof(uint32_t) * (1 << (context.K-1)) + 2*context.collision_bytes_length;
+        // Amount of rows on the hash table - 2^(collisionBitLength+1)
+        context.init_size = 1 << (context.collision_bits_length+1);
+        // The indices that gave the solution - 2^k * (n / (k + 1) + 1) / 8
+        context.solution_size = (1 << context.K) * (context.N / (context.K + 1) + 1) / 8;
+    }
+
+    void EquihashUtils::print_context(const EquihashContext & context)
+    {
+        printf(": n %d, k %d\n",              context.N, context.K);                 //  200, 9
+        printf(": collisionBitLength %d\n",   context.collision_bits_length);   //   20
+        printf(": collisionByteLength %d\n",  context.collision_bytes_length);  //    3
+        printf(": hashLength %d\n",           context.hash_length);           //   30
+        printf(": indicesPerHashOutput %d\n", context.indices_per_hash_output); //    2
+        printf(": hashOutput %d\n",           context.hash_output);           //   50
+        printf(": fullWidth %d\n",            context.full_width);            // 1030
+        printf(": initSize %d (memory %u)\n",
+            context.init_size, context.init_size * context.full_width); // 2097152, 2160066560
+    }
+
+    static void initialize_header(uint32_t N, uint32_t K, const uint8_t * header, size_t header_size,
+                                  uint32_t nonce_size, EquihashInput & input)
+    {
+        EquihashContext context;
+        context.N = N;
+        context.K = K;
+        EquihashUtils::initialize_context(context);
+
+        blake2b_param P[1];
+        memset(P, 0, sizeof(blake2b_param));
+        P->fanout = 1;
+        P->depth = 1;
+        P->digest_length = context.hash_output;
+        memcpy(P->personal, "ZcashPoW", 8);
+        *(uint32_t *)(P->personal +  8) = htole32(N);
+        *(uint32_t *)(P->personal + 12) = htole32(K);
+        blake2b_state state;
+        blake2b_init_param(&state, P);
+
+        // Every whole block of the header is compressed here, once for all of the nonces
+        // libb2 would hold on to them until the final block, so they are compressed apart from it
+        memcpy(input.header_hash_state, state.h, sizeof(input.header_hash_state));
+        input.header_compressed_length = 0;
+        size_t compressed = EquihashBlake2b::compress_blocks(input.header_hash_state, input.header_compressed_length,
+                                                             header, header_size);
+        input.header_tail_length = header_size - compressed;
+        memcpy(input.header_tail, header + compressed, input.header_tail_length);
+
+        memset(input.nonce_base, 0, EQUIHASH_NONCE_SIZE);
+        input.nonce_size = nonce_size;
+        input.digest_length = context.hash_output;
+    }
+
+    bool EquihashUtils::initialize_input(uint32_t N, uint32_t K, const uint32_t seed[SEED_SIZE], EquihashInput & input)
+    {
+        initialize_header(N, K, (const uint8_t *)seed, SEED_SIZE*sizeof(uint32_t), sizeof(uint32_t), input);
+        return true;
+    }
+
+    bool EquihashUtils::initialize_input(uint32_t N, uint32_t K, const uint8_t * header, size_t header_size,
+                                         const uint8_t nonce[EQUIHASH_NONCE_SIZE], EquihashInput & input)
+    {
+        initialize_header(N, K, header, header_size, EQUIHASH_NONCE_SIZE, input);
+        memcpy(input.nonce_base, nonce, EQUIHASH_NONCE_SIZE);
+
+        // The prefix length is the same for every nonce, one midstate tells for all of them
+        Blake2bMidstate midstate;
+        return initialize_midstate(input, 0, midstate);
+    }
+
+    void EquihashUtils::get_nonce_bytes(const EquihashInput & input, size_t nonce, uint8_t * out)
+    {
+        // Little endian addition, the carry runs through the whole nonce
+        uint64_t carry = nonce;
+        for(size_t i=0;i<input.nonce_size;i++)
+        {
+            carry += input.nonce_base[i];
+            out[i] = carry & 0xFF;
+            carry >>= 8;
+        }
+    }
+
+    bool EquihashUtils::initialize_midstate(const EquihashInput & input, size_t nonce, Blake2bMidstate & midstate)
+    {
+        // Only the tail of the header and the nonce are left to hash
+        uint8_t buffer[BLAKE2B_BLOCKBYTES + EQUIHASH_NONCE_SIZE];
+        memcpy(buffer, input.header_tail, input.header_tail_length);
+        get_nonce_bytes(input, nonce, buffer + input.header_tail_length);
+        return EquihashBlake2b::create_midstate(input.header_hash_state, input.header_compressed_length, buffer,
+                                                input.header_tail_length + input.nonce_size, input.digest_length,
+                                                midstate);
+    }
+
+    void EquihashUtils::expand_array(const uint8_t * in, size_t in_len,
+                                     uint8_t * out, size_t out_len,
+                                     size_t bit_len, size_t byte_pad)
+    {
+        // Calculate the actual width to produce, padded to bytes
+        const size_t out_width = (bit_len + 7) / 8 + byte_pad;
+
+        // Calculate the bits mask, to use to take the blocks
+        const uint32_t bit_len_mask = ((uint32_t)1 << bit_len) - 1;
+
+        // Start accumilating bits until we reached collision bits amount
+        // Once reached, add it to the blocks masked to big endian
+        size_t acc_bits = 0;
+        uint32_t acc_value = 0;
+        size_t j = 0;
+
+        for(size_t i=0;i<in_len && j+out_width<=out_len;i++)
+        {
+            acc_value = (acc_value << 8) | in[i];
+            acc_bits += 8;
+
+            if(acc_bits >= bit_len)
+            {
+                acc_bits -= bit_len;
+                for(size_t x=0;x<byte_pad;x++)
+                {
+                    out[j + x] = 0;
+                }
+                for(size_t x=byte_pad;x<out_width;x++)
+                {
+                    out[j + x] = (
+                        // Big-endian
+                        acc_value >> (acc_bits + (8 * (out_width - x - 1)))
+                    ) & (
+                        // Apply bit_len_mask across byte boundaries
+                        (bit_len_mask >> (8 * (out_width - x - 1))) & 0xFF
+                    );
+                }
+
+                j += out_width;
+            }
+        }
+    }
+
+    void EquihashUtils::compress_array(const uint8_t * in, size_t in_len,
+                                       uint8_t * out, size_t out_len,
+                                       size_t bit_len, size_t byte_pad)
+    {
+        // Calculate the actual width that was produced, padded to bytes
+        const size_t in_width = (bit_len + 7) / 8 + byte_pad;
+
+        // Calculate the bits mask, to use to take the blocks
+        const uint32_t bit_len_mask = ((uint32_t)1 << bit_len) - 1;
+
+        // Accumilate the blocks and write a byte whenever there are enough bits
+        size_t acc_bits = 0;
+        uint32_t acc_value = 0;
+        size_t j = 0;
+
+        for(size_t i=0;i<out_len;i++)
+        {
+            if(acc_bits < 8)
+            {
+                if(j + in_width > in_len)
+                {
+                    break;
+                }
+
+                acc_value = acc_value << bit_len;
+                for(size_t x=byte_pad;x<in_width;x++)
+                {
+                    acc_value = acc_value | (
+                        // Apply bit_len_mask across byte boundaries
+                        in[j + x] & ((bit_len_mask >> (8 * (in_width - x - 1))) & 0xFF)
+                    ) << (8 * (in_width - x - 1)); // Big-endian
+                }
+                j += in_width;
+                acc_bits += bit_len;
+            }
+
+            acc_bits -= 8;
+            out[i] = (acc_value >> acc_bits) & 0xFF;
+        }
+    }
+
+    void EquihashUtils::index_to_array(uint32_t index, uint8_t * array)
+    {
+        uint32_t be_index = htobe32(index);
+        memcpy(array, &be_index, sizeof(uint32_t));
+    }
+
+    uint32_t EquihashUtils::array_to_index(const uint8_t * array)
+    {
+        uint32_t be_index;
+        memcpy(&be_index, array, sizeof(uint32_t));
+        return be32toh(be_index);
+    }
+
+    std::vector<uint8_t> EquihashUtils::indices_to_solution(const EquihashContext & context,
+                                                            const std::vector<uint32_t> & indices)
+    {
+        // Each index is stored on collision_bits_length + 1 bits
+        const size_t bit_len = context.collision_bits_length + 1;
+        const size_t byte_pad = sizeof(uint32_t) - (bit_len + 7) / 8;
+        std::vector<uint8_t> array(indices.size() * sizeof(uint32_t));
+        std::vector<uint8_t> solution(context.solution_size);
+
+        for(size_t i=0;i<indices.size();i++)
+        {
+            index_to_array(indices[i], &array[i*sizeof(uint32_t)]);
+        }
+
+        compress_array(array.data(), array.size(), solution.data(), solution.size(), bit_len, byte_pad);
+
+        return solution;
+    }
+}
@@ -0,0 +1,303 @@
+/**
+ * @file equihash_verifier.cpp
+ * @author ofir iluz (iluzofir@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2018-12-04
+ *
+ * @copyright Copyright (c) 2018
+ *
+ */
+
+#include "equihash_gpu/equihash/equihash_verifier.h"
+#include "equihash_gpu/util/Timer.h"
+#include <string.h>
+#include <endian.h>
+#include <algorithm>
+#include <functional>
+
+namespace Equihash
+{
+    EquihashVerifier::EquihashVerifier(const EquihashContext & context, size_t threads)
+        : equihash_context_(context), threads_(threads)
+    {
+        EquihashUtils::initialize_context(equihash_context_);
+        EquihashUtils::initialize_input(context.N, context.K, context.seed, equihash_input_);
+    }
+
+    EquihashVerifier::EquihashVerifier(const EquihashContext & context, const EquihashInput & input, size_t threads)
+        : equihash_context_(context), equihash_input_(input), threads_(threads)
+    {
+        EquihashUtils::initialize_context(equihash_context_);
+    }
+
+    EquihashVerifier::~EquihashVerifier()
+    {
+
+    }
+
+    bool EquihashVerifier::decode_indices(const Proof & proof, std::vector<uint32_t> & indices) const
+    {
+        const std::vector<uint8_t> & solution = proof.get_solution();
+        if(solution.size() != equihash_context_.solution_size)
+        {
+            return false;
+        }
+
+        // Each index is stored on collision_bits_length + 1 bits, expand them back to big endian words
+        const size_t bit_len = equihash_context_.collision_bits_length + 1;
+        const size_t byte_pad = sizeof(uint32_t) - (bit_len + 7) / 8;
+        indices.resize((size_t)1 << equihash_context_.K);
+        std::vector<uint8_t> array(indices.size() * sizeof(uint32_t));
+        EquihashUtils::expand_array(solution.data(), solution.size(), array.data(), array.size(), bit_len, byte_pad);
+
+        for(size_t i=0;i<indices.size();i++)
+        {
+            indices[i] = EquihashUtils::array_to_index(&array[i*sizeof(uint32_t)]);
+        }
+
+        return true;
+    }
+
+    bool EquihashVerifier::check_indices(const std::vector<uint32_t> & indices) const
+    {
+        // On every level the left subtree has to start with the smaller index
+        for(size_t size=1;size<indices.size();size<<=1)
+        {
+            for(size_t i=0;i<indices.size();i+=2*size)
+            {
+                if(indices[i] >= indices[i + size])
+                {
+                    return false;
+                }
+            }
+        }
+
+        // And all of the indices have to be distinct
+        std::vector<uint32_t> sorted(indices);
+        std::sort(sorted.begin(), sorted.end());
+        return std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end();
+    }
+
+    bool EquihashVerifier::generate_leaves(const Proof & proof,
+                                           const std::vector<uint32_t> & indices,
+                                           std::vector<uint8_t> & rows) const
+    {
+        const uint32_t leaf_bytes = equihash_context_.N / 8;
+        const uint32_t hash_length = equihash_context_.hash_length;
+        Blake2bMidstate midstate;
+        if(!EquihashUtils::initialize_midstate(equihash_input_, proof.get_solution_nonce(), midstate))
+        {
+            return false;
+        }
+
+        // Same derivation as the solvers, one hash per indices_per_hash_output leaves
+        // All of the hashes of the proof go through the lanes together
+        std::vector<uint32_t> hash_indices(indices.size());
+        for(size_t i=0;i<indices.size();i++)
+        {
+            hash_indices[i] = indices[i] / equihash_context_.indices_per_hash_output;
+        }
+        std::vector<uint8_t> digests(indices.size() * equihash_context_.hash_output);
+        EquihashBlake2b::hash_leaves(midstate, hash_indices.data(), hash_indices.size(), digests.data());
+
+        rows.resize(indices.size() * hash_length);
+        for(size_t i=0;i<indices.size();i++)
+        {
+            uint32_t part = indices[i] % equihash_context_.indices_per_hash_output;
+            EquihashUtils::expand_array(&digests[i*equihash_context_.hash_output + part*leaf_bytes], leaf_bytes,
+                                        &rows[i*hash_length], hash_length,
+                                        equihash_context_.collision_bits_length);
+        }
+
+        return true;
+    }
+
+    bool EquihashVerifier::check_tree(std::vector<uint8_t> & rows) const
+    {
+        const uint32_t hash_length = equihash_context_.hash_length;
+        const uint32_t collision_bytes = equihash_context_.collision_bytes_length;
+        size_t amount = rows.size() / hash_length;
+
+        // Combine the rows level by level in place, each level has to collide on its block
+        for(uint32_t level=0;level<equihash_context_.K;level++)
+        {
+            const uint32_t start = level * collision_bytes;
+            for(size_t i=0;i<amount/2;i++)
+            {
+                uint8_t * dest = &rows[i*hash_length];
+                const uint8_t * a = &rows[(2*i)*hash_length];
+                const uint8_t * b = &rows[(2*i+1)*hash_length];
+                if(memcmp(a + start, b + start, collision_bytes) != 0)
+                {
+                    return false;
+                }
+
+                for(uint32_t x=start+collision_bytes;x<hash_length;x++)
+                {
+                    dest[x] = a[x] ^ b[x];
+                }
+            }
+            amount /= 2;
+        }
+
+        // What is left of the root has to be zero
+        for(uint32_t x=equihash_context_.K*collision_bytes;x<hash_length;x++)
+        {
+            if(rows[x] != 0)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool EquihashVerifier::verify(const Proof & proof) const
+    {
+        std::vector<uint32_t> indices;
+        std::vector<uint8_t> rows;
+
+        // Cheap structural checks first, only then hash the leaves
+        if(!decode_indices(proof, indices) || !check_indices(indices))
+        {
+            return false;
+        }
+
+        return generate_leaves(proof, indices, rows) && check_tree(rows);
+    }
+
+    bool EquihashVerifier::order_level(uint32_t level, std::vector<uint32_t> & indices, std::vector<uint8_t> & rows) const
+    {
+        const uint32_t hash_length = equihash_context_.hash_length;
+        const uint32_t collision_bytes = equihash_context_.collision_bytes_length;
+        const uint32_t start = level * collision_bytes;
+        if(level == equihash_context_.K)
+        {
+            // What is left of the root has to be zero
+            for(uint32_t x=start;x<hash_length;x++)
+            {
+                if(rows[x] != 0)
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // The two sides of a pair collide on the block of this level, so they end up next to each other
+        const size_t size = (size_t)1 << level;
+        const size_t amount = indices.size() / size;
+        auto key_less = [&](uint32_t a, uint32_t b)
+        {
+            return memcmp(&rows[a*hash_length + start], &rows[b*hash_length + start], collision_bytes) < 0;
+        };
+        std::vector<uint32_t> order(amount);
+        for(size_t i=0;i<amount;i++)
+        {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), key_less);
+
+        // More than two subtrees can share a block, then every way of pairing them up is tried
+        std::vector<uint8_t> paired(amount, 0);
+        std::vector<std::pair<uint32_t, uint32_t>> pairs;
+        std::function<bool(size_t)> match = [&](size_t position) -> bool
+        {
+            while(position < amount && paired[position])
+            {
+                position++;
+            }
+            if(position == amount)
+            {
+                std::vector<uint32_t> next_indices(indices.size());
+                std::vector<uint8_t> next_rows(rows.size() / 2);
+                for(size_t i=0;i<pairs.size();i++)
+                {
+                    uint32_t a = pairs[i].first;
+                    uint32_t b = pairs[i].second;
+                    if(indices[b*size] < indices[a*size])
+                    {
+                        std::swap(a, b);
+                    }
+                    std::copy(&indices[a*size], &indices[(a+1)*size], &next_indices[2*i*size]);
+                    std::copy(&indices[b*size], &indices[(b+1)*size], &next_indices[(2*i+1)*size]);
+                    for(uint32_t x=start+collision_bytes;x<hash_length;x++)
+                    {
+                        next_rows[i*hash_length + x] = rows[a*hash_length + x] ^ rows[b*hash_length + x];
+                    }
+                }
+                if(!order_level(level + 1, next_indices, next_rows))
+                {
+                    return false;
+                }
+                indices.swap(next_indices);
+                return true;
+            }
+
+            paired[position] = 1;
+            for(size_t other=position+1;other<amount && !key_less(order[position], order[other]);other++)
+            {
+                if(paired[other])
+                {
+                    continue;
+                }
+                paired[other] = 1;
+                pairs.push_back(std::make_pair(order[position], order[other]));
+                if(match(position + 1))
+                {
+                    return true;
+                }
+                pairs.pop_back();
+                paired[other] = 0;
+            }
+            paired[position] = 0;
+            return false;
+        };
+
+        return match(0);
+    }
+
+    bool EquihashVerifier::order_proof(Proof & proof) const
+    {
+        std::vector<uint32_t> indices;
+        std::vector<uint8_t> rows;
+        if(!decode_indices(proof, indices) || !generate_leaves(proof, indices, rows) ||
+           !order_level(0, indices, rows) || !check_indices(indices))
+        {
+            return false;
+        }
+
+        proof.set_solution(EquihashUtils::indices_to_solution(equihash_context_, indices));
+        return true;
+    }
+
+    std::vector<bool> EquihashVerifier::verify_batch(const std::vector<Proof> & proofs, VerificationStats * stats)
+    {
+        if(!thread_pool_)
+        {
+            thread_pool_.reset(new ThreadPool(threads_));
+        }
+
+        Timer timer;
+        std::vector<uint8_t> results(proofs.size(), 0);
+        thread_pool_->parallel_for(proofs.size(), [&](size_t, size_t begin, size_t end)
+        {
+            for(size_t i=begin;i<end;i++)
+            {
+                results[i] = verify(proofs[i]);
+            }
+        });
+        int64_t elapsed = timer.elapsed();
+
+        if(stats)
+        {
+            stats->proofs = proofs.size();
+            stats->verified = std::count(results.begin(), results.end(), 1);
+            stats->elapsed_seconds = elapsed / 1e9;
+            stats->proofs_per_second = elapsed > 0 ? proofs.size() / stats->elapsed_seconds : 0;
+        }
+
+        return std::vector<bool>(results.begin(), results.end());
+    }
+}
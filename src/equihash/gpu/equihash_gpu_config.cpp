@@ -10,6 +10,14 @@
  */
 
 #include "equihash_gpu/equihash/gpu/equihash_gpu_config.h"
+#include "equihash_gpu/equihash/gpu/equihash_kernels.h"
+#include <blake2.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <algorithm>
+#include <sstream>
 
 namespace Equihash
 {
@@ -24,9 +32,22 @@ namespace Equihash
         std::cout << std::endl;
     }
 
-    EquihashGPUConfig::EquihashGPUConfig(): is_configured_(false)
+    EquihashGPUConfig::EquihashGPUConfig(): is_configured_(false), profiling_(true)
     {
-
+        // Default to the user cache directory, can be overriden from the environment
+        const char * directory = getenv("EQUIHASH_GPU_CACHE_DIR");
+        if(directory)
+        {
+            cache_directory_ = directory;
+        }
+        else if((directory = getenv("XDG_CACHE_HOME")))
+        {
+            cache_directory_ = std::string(directory) + "/equihash_gpu";
+        }
+        else if((directory = getenv("HOME")))
+        {
+            cache_directory_ = std::string(directory) + "/.cache/equihash_gpu";
+        }
     }
 
     EquihashGPUConfig::~EquihashGPUConfig()
@@ -46,41 +67,55 @@ namespace Equihash
         cl::Platform::get(&platforms);
 
         // For each platform discover the devices and add them to the device list
-        // Note that all of the devices are joined together from nvidia and amd etc
+        // Each device gets a context of its own, so devices from different platforms can be used together
+        size_t device_index = 0;
         for(auto && platform : platforms) 
         {
             // Get devices
             std::vector<cl::Device> devices;
             platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
 
-            // Add them to the devices list
-            gpu_used_devices_.insert(
-                std::end(gpu_used_devices_), std::begin(devices), std::end(devices));
+            for(auto && device : devices)
+            {
+                size_t current_index = device_index++;
+                if(!device_selection_.empty() && 
+                   std::find(device_selection_.begin(), device_selection_.end(), current_index) == device_selection_.end())
+                {
+                    continue;
+                }
+
+                cl_int err;
+                EquihashGPUDevice gpu_device;
+                gpu_device.device = device;
+                gpu_device.context = cl::Context(std::vector<cl::Device>(1, device), NULL, notify_cb, NULL, &err);
+                if(err != CL_SUCCESS)
+                {
+                    std::cout << "Could not create context for " << device.getInfo<CL_DEVICE_NAME>() 
+                              << " - " << EquihashGPUUtils::get_cl_errno(err) << std::endl;
+                    continue;
+                }
+
+                cl_command_queue_properties properties = profiling_ ? CL_QUEUE_PROFILING_ENABLE : 0;
+                gpu_device.queue = cl::CommandQueue(gpu_device.context, device, properties);
+                gpu_device.hash_queue = cl::CommandQueue(gpu_device.context, device, properties);
+                gpu_device.profiling = profiling_;
+                gpu_device.build_options = build_options_;
+                gpu_devices_.push_back(gpu_device);
+            }
         }
 
-        for (cl::Device dev : gpu_used_devices_)
+        for (auto && gpu_device : gpu_devices_)
         {
             size_t size, local, s;
-            dev.getInfo(CL_DEVICE_MAX_MEM_ALLOC_SIZE, &size);
-            dev.getInfo(CL_DEVICE_MAX_WORK_GROUP_SIZE, &local);
-            dev.getInfo(CL_DEVICE_GLOBAL_MEM_SIZE, &s);
+            gpu_device.device.getInfo(CL_DEVICE_MAX_MEM_ALLOC_SIZE, &size);
+            gpu_device.device.getInfo(CL_DEVICE_MAX_WORK_GROUP_SIZE, &local);
+            gpu_device.device.getInfo(CL_DEVICE_GLOBAL_MEM_SIZE, &s);
+            std::cout << gpu_device.device.getInfo<CL_DEVICE_NAME>() << std::endl;
             std::cout << size/(1024*1024) << "MB" << std::endl;
             std::cout << s/(1024*1024) << "MB" << std::endl;
             std::cout << local << std::endl;
         }
 
-        // Create the context
-        cl_int err;
-        gpu_context_ = cl::Context(gpu_used_devices_, NULL, notify_cb, NULL, &err);
-        
-        for(auto && device : gpu_used_devices_)
-        {
-            gpu_devices_queues_.push_back(cl::CommandQueue(get_context(), device));
-            // gpu_devices_queues_.push_back(cl::CommandQueue(get_context(), device));
-            // gpu_devices_queues_.push_back(cl::CommandQueue(get_context(), device));
-            // gpu_devices_queues_.push_back(cl::CommandQueue(get_context(), device));
-        }
-
         is_configured_ = true;
     }
 
@@ -91,120 +126,378 @@ namespace Equihash
             return;
         }
 
-        gpu_used_devices_.clear();
-        gpu_devices_queues_.clear();
-        compiled_gpu_program_ = cl::Program();
-        gpu_context_ = cl::Context();
-        equihash_hash_kernel_ = cl::Kernel();
-        equihash_collision_detection_round_kernel_ = cl::Kernel();
+        gpu_devices_.clear();
 
         is_configured_ = false;
     }
 
-    std::string EquihashGPUConfig::read_source(const std::string & path)
+    void EquihashGPUConfig::set_build_options(const std::string & options)
     {
-        std::fstream stream(path);
-        return std::string(std::istreambuf_iterator<char>(stream),
-                                        (std::istreambuf_iterator<char>()));
+        build_options_ = options;
+        for(auto && gpu_device : gpu_devices_)
+        {
+            gpu_device.build_options = options;
+        }
     }
 
-    bool EquihashGPUConfig::prepare_program()
+    void EquihashGPUConfig::set_build_options(size_t device_index, const std::string & options)
     {
-        cl_int err = CL_SUCCESS;
-        // std::string source = read_source("/home/ofir/Desktop/Equihash/equihash_gpu/include/equihash_gpu/equihash/gpu/equihash.cl"); 
-        // Static as temp for now
-        std::fstream stream("/home/ofir/Desktop/Equihash/equihash_gpu/include/equihash_gpu/equihash/gpu/equihash.cl");
-        std::string source = std::string(std::istreambuf_iterator<char>(stream),
-                                        (std::istreambuf_iterator<char>()));
+        gpu_devices_[device_index].build_options = options;
+    }
 
-        // Create the program and load the .cl files
-        compiled_gpu_program_ = cl::Program(gpu_context_, source, true, &err);
-        // compiled_gpu_program_.build("-cl-opt-disable")
-        if (err != CL_SUCCESS)
+    void EquihashGPUConfig::set_cache_directory(const std::string & directory)
+    {
+        cache_directory_ = directory;
+    }
+
+    void EquihashGPUConfig::set_profiling(bool profiling)
+    {
+        profiling_ = profiling;
+    }
+
+    void EquihashGPUConfig::set_device_selection(const std::vector<size_t> & device_indices)
+    {
+        device_selection_ = device_indices;
+    }
+
+    std::string EquihashGPUConfig::get_program_source()
+    {
+        return std::string(BLAKE2B_KERNEL_SOURCE) + "\n" + EQUIHASH_KERNEL_SOURCE;
+    }
+
+    std::string EquihashGPUConfig::hash_key(const std::string & key)
+    {
+        uint8_t digest[16];
+        char hex[2*sizeof(digest)+1];
+        blake2b(digest, key.data(), NULL, sizeof(digest), key.size(), 0);
+        for(size_t i=0;i<sizeof(digest);i++)
         {
-            for (cl::Device dev : gpu_used_devices_)
-            {
-                // Check the build status
-                cl_build_status status = compiled_gpu_program_.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(dev);
-                if (status != CL_BUILD_ERROR)
-                    continue;
+            snprintf(hex + 2*i, 3, "%02x", digest[i]);
+        }
 
-                // Get the build log
-                std::string name     = dev.getInfo<CL_DEVICE_NAME>();
-                std::string buildlog = compiled_gpu_program_.getBuildInfo<CL_PROGRAM_BUILD_LOG>(dev);
-                std::cerr << "Build log for " << name << ":" << std::endl
-                            << buildlog << std::endl;
+        return hex;
+    }
+
+    std::string EquihashGPUConfig::get_device_key(EquihashGPUDevice & gpu_device)
+    {
+        return gpu_device.device.getInfo<CL_DEVICE_NAME>() + "\n" +
+               gpu_device.device.getInfo<CL_DEVICE_VENDOR>() + "\n" +
+               gpu_device.device.getInfo<CL_DEVICE_VERSION>() + "\n" +
+               gpu_device.device.getInfo<CL_DRIVER_VERSION>();
+    }
+
+    std::string EquihashGPUConfig::get_cache_path(EquihashGPUDevice & gpu_device, const std::string & source)
+    {
+        // Anything that can change the binary is part of the key
+        return cache_directory_ + "/" + 
+               hash_key(get_device_key(gpu_device) + "\n" + gpu_device.build_options + "\n" + source) + ".bin";
+    }
+
+    std::string EquihashGPUConfig::get_tuning_path(EquihashGPUDevice & gpu_device)
+    {
+        // A new driver can move the best launch sizes, it starts from a profile of its own
+        return cache_directory_ + "/" + hash_key(get_device_key(gpu_device)) + ".tuning";
+    }
+
+    bool EquihashGPUConfig::make_cache_directory()
+    {
+        // Create the directories on the way
+        for(size_t i=1;i<=cache_directory_.size();i++)
+        {
+            if(i == cache_directory_.size() || cache_directory_[i] == '/')
+            {
+                mkdir(cache_directory_.substr(0, i).c_str(), 0755);
             }
+        }
+
+        struct stat info;
+        return stat(cache_directory_.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+    }
 
+    bool EquihashGPUConfig::load_program_binary(EquihashGPUDevice & gpu_device, const std::string & path)
+    {
+        std::ifstream stream(path, std::ios::binary);
+        if(!stream)
+        {
             return false;
         }
-
-        // Create the command queue for equihash;
-        std::cout << EquihashGPUUtils::get_cl_errno(err) << std::endl;
-        if (err != CL_SUCCESS)
+        std::vector<char> binary((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+        if(binary.empty())
         {
-            std::cout << "Could not create command queue" << std::endl;
             return false;
         }
 
-        // Get the kernel for equihash hashing, collision and solutions
-        equihash_hash_kernel_ = cl::Kernel(compiled_gpu_program_,"equihash_initialize_hash" , &err);
-        std::cout << EquihashGPUUtils::get_cl_errno(err) << std::endl;
-        if (err != CL_SUCCESS)
+        cl_int err = CL_SUCCESS;
+        std::vector<cl_int> binary_status;
+        std::vector<cl::Device> devices(1, gpu_device.device);
+        cl::Program::Binaries binaries(1, std::make_pair((const void *)binary.data(), binary.size()));
+        cl::Program program(gpu_device.context, devices, binaries, &binary_status, &err);
+        if(err != CL_SUCCESS || program.build(devices, gpu_device.build_options.c_str()) != CL_SUCCESS)
         {
-            std::cout << "Could not retrieve hash kernel" << std::endl;
+            std::cout << "Cached program " << path << " could not be loaded, rebuilding it" << std::endl;
             return false;
         }
-        equihash_collision_detection_round_kernel_ = cl::Kernel(compiled_gpu_program_,"equihash_collision_detection_round" , &err);
-        std::cout << EquihashGPUUtils::get_cl_errno(err) << std::endl;
-        if (err != CL_SUCCESS)
+
+        gpu_device.program = program;
+        return true;
+    }
+
+    void EquihashGPUConfig::save_program_binary(EquihashGPUDevice & gpu_device, const std::string & path)
+    {
+        // Every device has a program of its own, so there is a single binary
+        size_t binary_size = 0;
+        if(clGetProgramInfo(gpu_device.program(), CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binary_size, NULL) != CL_SUCCESS ||
+           binary_size == 0)
         {
-            std::cout << "Could not retrieve collision kernel" << std::endl;
-            return false;
+            return;
+        }
+
+        std::vector<unsigned char> binary(binary_size);
+        unsigned char * binaries[1] = {binary.data()};
+        if(clGetProgramInfo(gpu_device.program(), CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL) != CL_SUCCESS)
+        {
+            return;
         }
 
-        equihash_solutions_kernel_ = cl::Kernel(compiled_gpu_program_, "equihash_solutions_detection" , &err);
+        make_cache_directory();
+
+        // Write aside and rename, so concurrent solvers never see a partial binary
+        std::string temp_path = path + "." + std::to_string(getpid());
+        {
+            std::ofstream stream(temp_path, std::ios::binary);
+            stream.write((const char *)binary.data(), binary.size());
+            if(!stream)
+            {
+                std::cout << "Could not write program cache " << temp_path << std::endl;
+                remove(temp_path.c_str());
+                return;
+            }
+        }
+        rename(temp_path.c_str(), path.c_str());
+    }
+
+    bool EquihashGPUConfig::build_program(EquihashGPUDevice & gpu_device, const std::string & source)
+    {
+        std::vector<cl::Device> devices(1, gpu_device.device);
+
+        // Create the program and load the .cl files
+        gpu_device.program = cl::Program(gpu_device.context, source);
+        cl_int err = gpu_device.program.build(devices, gpu_device.build_options.c_str());
         if (err != CL_SUCCESS)
         {
-            std::cout << "Could not retrieve solutions kernel" << std::endl;
+            // Check the build status
+            cl_build_status status = gpu_device.program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(gpu_device.device);
+            if (status == CL_BUILD_ERROR)
+            {
+                // Get the build log
+                std::string name     = gpu_device.device.getInfo<CL_DEVICE_NAME>();
+                std::string buildlog = gpu_device.program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(gpu_device.device);
+                std::cerr << "Build log for " << name << ":" << std::endl
+                            << buildlog << std::endl;
+            }
+
             return false;
         }
 
         return true;
     }
 
-    cl::Context & EquihashGPUConfig::get_context()
+    bool EquihashGPUConfig::prepare_program()
+    {
+        for(size_t i=0;i<gpu_devices_.size();i++)
+        {
+            if(!prepare_program(i))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool EquihashGPUConfig::prepare_program(size_t device_index)
     {
-        return gpu_context_;
+        std::string source = get_program_source();
+        EquihashGPUDevice & gpu_device = gpu_devices_[device_index];
+
+        // Prefer a binary that was built before, otherwise build it and keep it for the next time
+        std::string cache_path = cache_directory_.empty() ? "" : get_cache_path(gpu_device, source);
+        if(cache_path.empty() || !load_program_binary(gpu_device, cache_path))
+        {
+            if(!build_program(gpu_device, source))
+            {
+                return false;
+            }
+
+            if(!cache_path.empty())
+            {
+                save_program_binary(gpu_device, cache_path);
+            }
+        }
+
+        // Make sure all of the kernels are there
+        EquihashGPUKernels kernels;
+        return create_kernels(device_index, kernels);
     }
 
-    cl::Program & EquihashGPUConfig::get_program()
+    static bool read_kernel_tuning(std::istream & stream, EquihashKernelTuning & tuning)
     {
-        return compiled_gpu_program_;
+        return (stream >> tuning.local_size >> tuning.work_per_item) && tuning.work_per_item > 0;
     }
 
-    cl::Kernel & EquihashGPUConfig::get_equihash_hash_kernel()
+    static void write_kernel_tuning(std::ostream & stream, const EquihashKernelTuning & tuning)
     {
-        return equihash_hash_kernel_;
+        stream << " " << tuning.local_size << " " << tuning.work_per_item;
     }
 
-    cl::Kernel & EquihashGPUConfig::get_equihash_collision_detection_round_kernel()
+    bool EquihashGPUConfig::load_tuning(size_t device_index, uint32_t N, uint32_t K, uint32_t storage,
+                                        EquihashGPUTuning & tuning)
     {
-        return equihash_collision_detection_round_kernel_;
+        if(cache_directory_.empty())
+        {
+            return false;
+        }
+
+        // Lines are N K storage, the buckets, tiled and the local size and work per item of every kernel
+        std::ifstream stream(get_tuning_path(gpu_devices_[device_index]));
+        std::string line;
+        while(std::getline(stream, line))
+        {
+            std::istringstream fields(line);
+            uint32_t line_N, line_K, line_storage, tiled;
+            EquihashGPUTuning line_tuning;
+            if(line.empty() || line[0] == '#' ||
+               !(fields >> line_N >> line_K >> line_storage) ||
+               line_N != N || line_K != K || line_storage != storage)
+            {
+                continue;
+            }
+
+            if(!(fields >> line_tuning.bucket_bits >> line_tuning.bucket_capacity >> tiled) ||
+               !read_kernel_tuning(fields, line_tuning.hash) || !read_kernel_tuning(fields, line_tuning.bucket) ||
+               !read_kernel_tuning(fields, line_tuning.collision) || !read_kernel_tuning(fields, line_tuning.solutions))
+            {
+                std::cout << "Ignoring a broken tuning line for " << N << "," << K << std::endl;
+                return false;
+            }
+
+            line_tuning.tiled = tiled != 0;
+            tuning = line_tuning;
+            return true;
+        }
+
+        return false;
     }
 
-    cl::Kernel & EquihashGPUConfig::get_equihash_solutions_kernel()
+    bool EquihashGPUConfig::save_tuning(size_t device_index, uint32_t N, uint32_t K, uint32_t storage,
+                                        const EquihashGPUTuning & tuning)
     {
-        return equihash_solutions_kernel_;
+        if(cache_directory_.empty() || !make_cache_directory())
+        {
+            return false;
+        }
+
+        // The other parameters of the device keep their lines, this one is replaced
+        EquihashGPUDevice & gpu_device = gpu_devices_[device_index];
+        std::string path = get_tuning_path(gpu_device);
+        std::ostringstream profile;
+        profile << "# " << gpu_device.device.getInfo<CL_DEVICE_NAME>() << ", driver " 
+                << gpu_device.device.getInfo<CL_DRIVER_VERSION>() << "\n"
+                << "# N K storage bucket_bits bucket_capacity tiled hash bucket collision solutions"
+                << " (local size and work per item each)\n";
+        {
+            std::ifstream stream(path);
+            std::string line;
+            while(std::getline(stream, line))
+            {
+                std::istringstream fields(line);
+                uint32_t line_N, line_K, line_storage;
+                if(line.empty() || line[0] == '#' || 
+                   ((fields >> line_N >> line_K >> line_storage) && 
+                    line_N == N && line_K == K && line_storage == storage))
+                {
+                    continue;
+                }
+                profile << line << "\n";
+            }
+        }
+        profile << N << " " << K << " " << storage << " " << tuning.bucket_bits << " " 
+                << tuning.bucket_capacity << " " << (tuning.tiled ? 1 : 0);
+        write_kernel_tuning(profile, tuning.hash);
+        write_kernel_tuning(profile, tuning.bucket);
+        write_kernel_tuning(profile, tuning.collision);
+        write_kernel_tuning(profile, tuning.solutions);
+        profile << "\n";
+
+        // Same as the binaries, written aside and renamed
+        std::string temp_path = path + "." + std::to_string(getpid());
+        {
+            std::ofstream stream(temp_path);
+            stream << profile.str();
+            if(!stream)
+            {
+                std::cout << "Could not write tuning profile " << temp_path << std::endl;
+                remove(temp_path.c_str());
+                return false;
+            }
+        }
+        return rename(temp_path.c_str(), path.c_str()) == 0;
     }
 
-    std::vector<cl::Device> & EquihashGPUConfig::get_devices()
+    bool EquihashGPUConfig::create_kernels(size_t device_index, EquihashGPUKernels & kernels)
     {
-        return gpu_used_devices_;
+        cl_int err = CL_SUCCESS;
+        cl::Program & program = gpu_devices_[device_index].program;
+
+        // Get the kernel for equihash hashing, collision and solutions
+        kernels.hash_kernel = cl::Kernel(program, "equihash_initialize_hash", &err);
+        if (err != CL_SUCCESS)
+        {
+            std::cout << "Could not retrieve hash kernel" << std::endl;
+            return false;
+        }
+
+        kernels.bucketed_hash_kernel = cl::Kernel(program, "equihash_initialize_hash_bucketed", &err);
+        if (err != CL_SUCCESS)
+        {
+            std::cout << "Could not retrieve bucketed hash kernel" << std::endl;
+            return false;
+        }
+
+        kernels.bucket_kernel = cl::Kernel(program, "equihash_bucket_rows", &err);
+        if (err != CL_SUCCESS)
+        {
+            std::cout << "Could not retrieve bucket kernel" << std::endl;
+            return false;
+        }
+
+        kernels.collision_detection_round_kernel = cl::Kernel(program, "equihash_collision_detection_round", &err);
+        if (err != CL_SUCCESS)
+        {
+            std::cout << "Could not retrieve collision kernel" << std::endl;
+            return false;
+        }
+
+        kernels.tiled_collision_detection_round_kernel = 
+            cl::Kernel(program, "equihash_collision_detection_round_tiled", &err);
+        if (err != CL_SUCCESS)
+        {
+            std::cout << "Could not retrieve tiled collision kernel" << std::endl;
+            return false;
+        }
+
+        kernels.solutions_kernel = cl::Kernel(program, "equihash_solutions_detection", &err);
+        if (err != CL_SUCCESS)
+        {
+            std::cout << "Could not retrieve solutions kernel" << std::endl;
+            return false;
+        }
+
+        return true;
     }
 
-    std::vector<cl::CommandQueue> & EquihashGPUConfig::get_device_queues()
+    std::vector<EquihashGPUDevice> & EquihashGPUConfig::get_devices()
     {
-        return gpu_devices_queues_;
+        return gpu_devices_;
     }
 }
\ No newline at end of file
@@ -0,0 +1,256 @@
+/**
+ * @file equihash_gpu_metrics.cpp
+ * @author ofir iluz (iluzofir@gmail.com)
+ * @brief
+ * @version 0.1
+ * @date 2018-12-19
+ *
+ * @copyright Copyright (c) 2018
+ *
+ */
+
+#include "equihash_gpu/equihash/gpu/equihash_gpu_metrics.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <sstream>
+
+namespace Equihash
+{
+    EquihashKernelMetrics::EquihashKernelMetrics() :
+        launches(0), queued_ns(0), submitted_ns(0), execution_ns(0), max_execution_ns(0)
+    {
+
+    }
+
+    void EquihashKernelMetrics::add(uint64_t queued, uint64_t submitted, uint64_t started, uint64_t ended)
+    {
+        launches++;
+        // Times that are out of order (or missing) count as zero instead of wrapping around
+        queued_ns += submitted > queued ? submitted - queued : 0;
+        submitted_ns += started > submitted ? started - submitted : 0;
+        uint64_t execution = ended > started ? ended - started : 0;
+        execution_ns += execution;
+        max_execution_ns = std::max(max_execution_ns, execution);
+    }
+
+    EquihashGPUMetrics::EquihashGPUMetrics() :
+        profiling(false), nonces(0), solutions(0), bucket_dropped_rows(0), table_dropped_rows(0),
+        dropped_solutions(0), bytes_to_device(0), bytes_from_device(0), buffers_size(0)
+    {
+        memset(nonces_by_solutions, 0, sizeof(nonces_by_solutions));
+    }
+
+    void EquihashGPUMetrics::initialize(const std::string & name, uint32_t K, bool profiled)
+    {
+        device_name = name;
+        profiling = profiled;
+        round_rows.assign(K-1, 0);
+        bucket.assign(K, EquihashKernelMetrics());
+        rounds.assign(K-1, EquihashKernelMetrics());
+    }
+
+    void EquihashGPUMetrics::add_nonce(size_t nonce_solutions)
+    {
+        nonces++;
+        solutions += nonce_solutions;
+        nonces_by_solutions[std::min(nonce_solutions, (size_t)SOLUTIONS_HISTOGRAM_SIZE - 1)]++;
+    }
+
+    static std::string escape_label(const std::string & value)
+    {
+        std::string escaped;
+        for(char c : value)
+        {
+            if(c == '\\' || c == '"')
+            {
+                escaped += '\\';
+            }
+            if(c == '\n')
+            {
+                escaped += "\\n";
+                continue;
+            }
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    typedef std::function<void(const std::string & kernel_labels, const EquihashKernelMetrics & metrics)> KernelWriter;
+
+    static void write_kernel(const std::string & labels, const char * kernel, int round, 
+                             const EquihashKernelMetrics & metrics, const KernelWriter & writer)
+    {
+        std::string kernel_labels = labels + ",kernel=\"" + kernel + "\"";
+        if(round >= 0)
+        {
+            kernel_labels += ",round=\"" + std::to_string(round) + "\"";
+        }
+        writer(kernel_labels, metrics);
+    }
+
+    // Goes over every kernel of every device, once per family so the samples of a family stay together
+    static void write_kernels(const std::vector<EquihashGPUMetrics> & metrics, const std::vector<std::string> & labels,
+                              const KernelWriter & writer)
+    {
+        for(size_t i=0;i<metrics.size();i++)
+        {
+            write_kernel(labels[i], "hash", -1, metrics[i].hash, writer);
+            for(size_t r=0;r<metrics[i].bucket.size();r++)
+            {
+                write_kernel(labels[i], "bucket", r+1, metrics[i].bucket[r], writer);
+            }
+            for(size_t r=0;r<metrics[i].rounds.size();r++)
+            {
+                write_kernel(labels[i], "collision", r+1, metrics[i].rounds[r], writer);
+            }
+            write_kernel(labels[i], "solutions", -1, metrics[i].solutions_kernel, writer);
+        }
+    }
+
+    std::string EquihashGPUMetricsExporter::to_prometheus(const std::vector<EquihashGPUMetrics> & metrics)
+    {
+        std::ostringstream out;
+        std::vector<std::string> labels;
+        for(size_t i=0;i<metrics.size();i++)
+        {
+            labels.push_back("device=\"" + std::to_string(i) + "\",name=\"" + escape_label(metrics[i].device_name) + "\"");
+        }
+
+        // Every family gets a single header, the devices follow it
+        out << "# HELP equihash_nonces_total Nonces solved.\n# TYPE equihash_nonces_total counter\n";
+        for(size_t i=0;i<metrics.size();i++)
+        {
+            out << "equihash_nonces_total{" << labels[i] << "} " << metrics[i].nonces << "\n";
+        }
+
+        out << "# HELP equihash_solutions_total Solutions found.\n# TYPE equihash_solutions_total counter\n";
+        for(size_t i=0;i<metrics.size();i++)
+        {
+            out << "equihash_solutions_total{" << labels[i] << "} " << metrics[i].solutions << "\n";
+        }
+
+        out << "# HELP equihash_nonce_solutions Solutions per nonce.\n# TYPE equihash_nonce_solutions histogram\n";
+        for(size_t i=0;i<metrics.size();i++)
+        {
+            uint64_t cumulative = 0;
+            for(size_t s=0;s+1<SOLUTIONS_HISTOGRAM_SIZE;s++)
+            {
+                cumulative += metrics[i].nonces_by_solutions[s];
+                out << "equihash_nonce_solutions_bucket{" << labels[i] << ",le=\"" << s << "\"} " << cumulative << "\n";
+            }
+            out << "equihash_nonce_solutions_bucket{" << labels[i] << ",le=\"+Inf\"} " << metrics[i].nonces << "\n";
+            out << "equihash_nonce_solutions_sum{" << labels[i] << "} " << metrics[i].solutions << "\n";
+            out << "equihash_nonce_solutions_count{" << labels[i] << "} " << metrics[i].nonces << "\n";
+        }
+
+        out << "# HELP equihash_round_rows_total Rows produced by each collision round.\n"
+               "# TYPE equihash_round_rows_total counter\n";
+        for(size_t i=0;i<metrics.size();i++)
+        {
+            for(size_t r=0;r<metrics[i].round_rows.size();r++)
+            {
+                out << "equihash_round_rows_total{" << labels[i] << ",round=\"" << r+1 << "\"} "
+                    << metrics[i].round_rows[r] << "\n";
+            }
+        }
+
+        out << "# HELP equihash_dropped_total Rows and solutions that did not fit their buffers.\n"
+               "# TYPE equihash_dropped_total counter\n";
+        for(size_t i=0;i<metrics.size();i++)
+        {
+            out << "equihash_dropped_total{" << labels[i] << ",buffer=\"bucket\"} " << metrics[i].bucket_dropped_rows << "\n";
+            out << "equihash_dropped_total{" << labels[i] << ",buffer=\"table\"} " << metrics[i].table_dropped_rows << "\n";
+            out << "equihash_dropped_total{" << labels[i] << ",buffer=\"solutions\"} " << metrics[i].dropped_solutions << "\n";
+        }
+
+        out << "# HELP equihash_transfer_bytes_total Bytes moved between the host and the device.\n"
+               "# TYPE equihash_transfer_bytes_total counter\n";
+        for(size_t i=0;i<metrics.size();i++)
+        {
+            out << "equihash_transfer_bytes_total{" << labels[i] << ",direction=\"to_device\"} " << metrics[i].bytes_to_device << "\n";
+            out << "equihash_transfer_bytes_total{" << labels[i] << ",direction=\"from_device\"} " << metrics[i].bytes_from_device << "\n";
+        }
+
+        out << "# HELP equihash_buffers_bytes Device memory taken by the buffers.\n# TYPE equihash_buffers_bytes gauge\n";
+        for(size_t i=0;i<metrics.size();i++)
+        {
+            out << "equihash_buffers_bytes{" << labels[i] << "} " << metrics[i].buffers_size << "\n";
+        }
+
+        out << "# HELP equihash_kernel_launches_total Kernel launches.\n# TYPE equihash_kernel_launches_total counter\n";
+        write_kernels(metrics, labels, [&out](const std::string & kernel_labels, const EquihashKernelMetrics & kernel)
+        {
+            out << "equihash_kernel_launches_total{" << kernel_labels << "} " << kernel.launches << "\n";
+        });
+
+        out << "# HELP equihash_kernel_seconds_total Kernel time by phase, from the profiling info of the launches.\n"
+               "# TYPE equihash_kernel_seconds_total counter\n";
+        write_kernels(metrics, labels, [&out](const std::string & kernel_labels, const EquihashKernelMetrics & kernel)
+        {
+            out << "equihash_kernel_seconds_total{" << kernel_labels << ",phase=\"queued\"} " << kernel.queued_ns / 1e9 << "\n";
+            out << "equihash_kernel_seconds_total{" << kernel_labels << ",phase=\"submitted\"} " << kernel.submitted_ns / 1e9 << "\n";
+            out << "equihash_kernel_seconds_total{" << kernel_labels << ",phase=\"execution\"} " << kernel.execution_ns / 1e9 << "\n";
+        });
+
+        out << "# HELP equihash_kernel_max_execution_seconds Slowest launch of the kernel.\n"
+               "# TYPE equihash_kernel_max_execution_seconds gauge\n";
+        write_kernels(metrics, labels, [&out](const std::string & kernel_labels, const EquihashKernelMetrics & kernel)
+        {
+            out << "equihash_kernel_max_execution_seconds{" << kernel_labels << "} " << kernel.max_execution_ns / 1e9 << "\n";
+        });
+
+        return out.str();
+    }
+
+    bool EquihashGPUMetricsExporter::write_prometheus(const std::string & path, const std::vector<EquihashGPUMetrics> & metrics)
+    {
+        std::string temp_path = path + ".tmp";
+        {
+            std::ofstream file(temp_path, std::ios::out | std::ios::trunc);
+            if(!file)
+            {
+                return false;
+            }
+            file << to_prometheus(metrics);
+            if(!file.good())
+            {
+                return false;
+            }
+        }
+        return rename(temp_path.c_str(), path.c_str()) == 0;
+    }
+
+    void EquihashGPUMetricsExporter::print(const std::vector<EquihashGPUMetrics> & metrics)
+    {
+        auto average_ms = [](const EquihashKernelMetrics & kernel)
+        {
+            return kernel.launches > 0 ? kernel.execution_ns / 1e6 / kernel.launches : 0;
+        };
+
+        for(size_t i=0;i<metrics.size();i++)
+        {
+            const EquihashGPUMetrics & device = metrics[i];
+            printf("Device %zu (%s): %lu nonces, %lu solutions, %lu/%lu bytes to/from the device\n",
+                   i, device.device_name.c_str(), (unsigned long)device.nonces, (unsigned long)device.solutions,
+                   (unsigned long)device.bytes_to_device, (unsigned long)device.bytes_from_device);
+            if(!device.profiling)
+            {
+                printf("  No profiling info, the kernel times are not available\n");
+            }
+            printf("  hash      %8.3f ms\n", average_ms(device.hash));
+            for(size_t r=0;r<device.rounds.size();r++)
+            {
+                printf("  round %zu   %8.3f ms (bucket %.3f ms), %.0f rows\n", r+1, average_ms(device.rounds[r]),
+                       average_ms(device.bucket[r]), device.nonces > 0 ? (double)device.round_rows[r] / device.nonces : 0);
+            }
+            printf("  solutions %8.3f ms (bucket %.3f ms)\n", average_ms(device.solutions_kernel),
+                   average_ms(device.bucket.back()));
+            printf("  dropped %lu bucketed rows, %lu table rows, %lu solutions\n",
+                   (unsigned long)device.bucket_dropped_rows, (unsigned long)device.table_dropped_rows,
+                   (unsigned long)device.dropped_solutions);
+        }
+    }
+}
@@ -10,12 +10,16 @@
  */
 
 #include "equihash_gpu/equihash/gpu/equihash_gpu_solver.h"
+#include "equihash_gpu/util/Timer.h"
 #include <unistd.h>
 #include <stdlib.h>
 #define UNW_LOCAL_ONLY
 #include <cxxabi.h>
 #include <libunwind.h>
 
+// How often a range with the host in it checks for a cancel the host can not see by itself
+#define CANCEL_POLL_MS 10
+
 void backtrace() {
   unw_cursor_t cursor;
   unw_context_t context;
@@ -51,378 +55,626 @@ void backtrace() {
 
 namespace Equihash
 {
-    EquihashGPUSolver::EquihashGPUSolver(uint32_t N, uint32_t K, uint32_t seed[SEED_SIZE])
+    static uint32_t align_row(uint32_t width)
+    {
+        return (width + ROW_ALIGNMENT - 1) & ~(uint32_t)(ROW_ALIGNMENT - 1);
+    }
+
+    EquihashGPUSolver::EquihashGPUSolver(uint32_t N, uint32_t K, uint32_t seed[SEED_SIZE], 
+                                         EquihashGPUStorage storage, bool pipelined)
+        : is_prepared_(false), pipelined_(pipelined), specialized_(true), tiled_(true), fused_(true), cpu_threads_(0)
     {
         equihash_context_.N = N;
         equihash_context_.K = K;
+        equihash_context_.storage_mode = storage;
 
         // For now copy all the seed, can be changed later
         memcpy(equihash_context_.seed, seed, sizeof(uint32_t)*SEED_SIZE);
+        EquihashUtils::initialize_input(N, K, seed, equihash_input_);
     }
 
     EquihashGPUSolver::~EquihashGPUSolver()
     {
+        cancel_async();
+    }
 
+    void EquihashGPUSolver::set_specialized(bool specialized)
+    {
+        specialized_ = specialized;
     }
 
-    void EquihashGPUSolver::initialize_context()
+    void EquihashGPUSolver::set_tiled(bool tiled)
     {
-        // Number of bits to extract for each block - N / (K+1)
-        equihash_context_.collision_bits_length = equihash_context_.N / (equihash_context_.K + 1);
-        // Same as above but in bytes rounded up 
-        equihash_context_.collision_bytes_length = (equihash_context_.collision_bits_length+7)/8;
-        // Jump between each block of bits - (k+1) * collisionBytesLength
-        equihash_context_.hash_length = (equihash_context_.K+1) * equihash_context_.collision_bytes_length;
-        // Number of parts to derive blocks from the hash - blake_bits(512) / N
-        equihash_context_.indices_per_hash_output = 512 / equihash_context_.N;
-        // Blake output size in bytes
-        equihash_context_.hash_output = equihash_context_.indices_per_hash_output*equihash_context_.N / 8;
-        // Width of a single row in the hash table - sizeof(uint32) * (2^(k-1)) + 2*collisionByteLength
-        equihash_context_.full_width = sizeof(uint32_t) * (1 << (equihash_context_.K-1)) + 2*equihash_context_.collision_bytes_length;
-        // Amount of rows on the hash table - 2^(collisionBitLength+1)
-        equihash_context_.init_size = 1 << (equihash_context_.collision_bits_length+1);
-        // The indices that gave the solution - 2^k * (n / (k + 1) + 1) / 8
-        equihash_context_.solution_size = (1 << equihash_context_.K) * (equihash_context_.N / (equihash_context_.K + 1) + 1) / 8;
-  
-        printf(": n %d, k %d\n",              equihash_context_.N, equihash_context_.K);                 //  200, 9
-        printf(": collisionBitLength %d\n",   equihash_context_.collision_bits_length);   //   20
-        printf(": collisionByteLength %d\n",  equihash_context_.collision_bytes_length);  //    3
-        printf(": hashLength %d\n",           equihash_context_.hash_length);           //   30
-        printf(": indicesPerHashOutput %d\n", equihash_context_.indices_per_hash_output); //    2
-        printf(": hashOutput %d\n",           equihash_context_.hash_output);           //   50
-        printf(": fullWidth %d\n",            equihash_context_.full_width);            // 1030
-        printf(": initSize %d (memory %u)\n",
-            equihash_context_.init_size, equihash_context_.init_size * equihash_context_.full_width); // 2097152, 2160066560
-        sleep(2);
+        tiled_ = tiled;
+    }
+
+    void EquihashGPUSolver::set_fused(bool fused)
+    {
+        fused_ = fused;
     }
 
-    void EquihashGPUSolver::prepare_buffers()
+    void EquihashGPUSolver::set_devices(const std::vector<size_t> & device_indices)
     {
-        cl::CommandQueue & queue = gpu_config_.get_device_queues()[0];
-        cl_int zero = 0;
-        // Create the hash table s
-        table_buffer_ = cl::Buffer(
-            gpu_config_.get_context(),
-            CL_MEM_READ_WRITE,
-            equihash_context_.init_size*equihash_context_.full_width*2
-        );
-        queue.enqueueFillBuffer(table_buffer_, zero, 0, 
-            equihash_context_.init_size*equihash_context_.full_width*2
-        );
-
-        solutions_size_buffer_ = cl::Buffer(
-            gpu_config_.get_context(),
-            CL_MEM_READ_WRITE,
-            sizeof(uint32_t)
-        );
-        queue.enqueueFillBuffer(solutions_size_buffer_, zero, 0, 
-            sizeof(uint32_t));
-
-        // TODO - Change this to a more reasonable buffer
-        collision_table_buffer_ = cl::Buffer(
-            gpu_config_.get_context(),
-            CL_MEM_READ_WRITE,
-            equihash_context_.init_size*equihash_context_.full_width*2
-        );
-        queue.enqueueFillBuffer(collision_table_buffer_, zero, 0, 
-            equihash_context_.init_size*equihash_context_.full_width*2
-        );
-            
-        collision_table_size_buffer_ = cl::Buffer(
-            gpu_config_.get_context(),
-            CL_MEM_READ_WRITE,
-            sizeof(uint32_t)
-        );
-
-        // Construct the digests buffer for the hashes (256 bits)
-        digest_buffer_ = cl::Buffer(
-            gpu_config_.get_context(),
-            CL_MEM_READ_WRITE,
-            sizeof(BlakeGPU)
-        );
-        queue.enqueueFillBuffer(digest_buffer_, zero, 0, 
-            sizeof(BlakeGPU));
-
-        // Construct the context buffer to be used, will be the same as the gpu structure
-        context_buffer_ = cl::Buffer(
-            gpu_config_.get_context(),
-            CL_MEM_READ_ONLY,
-            sizeof(EquihashGPUContext)
-        );
-
-        // Copy the context to the buffer
-        queue.enqueueWriteBuffer(context_buffer_, false, 0, sizeof(EquihashGPUContext), &equihash_context_);
+        gpu_config_.set_device_selection(device_indices);
     }
 
-    BlakeGPU EquihashGPUSolver::create_initial_digest(size_t nonce)
+    void EquihashGPUSolver::set_cpu_threads(size_t threads)
     {
-        blake2b_state blake_state;
-        blake2b_param P[1];
-        memset(P, 0, sizeof(blake2b_param));
-        P->fanout = 1;
-        P->depth = 1;
-        P->digest_length = (512 / equihash_context_.N) * equihash_context_.N / 8;
-        memcpy(P->personal, "ZcashPoW", 8);
-        *(uint32_t *)(P->personal +  8) = htole32(equihash_context_.N);
-        *(uint32_t *)(P->personal + 12) = htole32(equihash_context_.K);
-        blake2b_init_param(&blake_state, P);
-        blake2b_update(&blake_state, (uint8_t*)equihash_context_.seed, SEED_SIZE*sizeof(uint32_t));
-        blake2b_update(&blake_state, (uint8_t*)&nonce, sizeof(uint32_t));
-        BlakeGPU blake_gpu;
-        memcpy(blake_gpu.hash_state, blake_state.h, sizeof(uint64_t)*8);
-        memcpy(blake_gpu.buf, blake_state.buf, blake_state.buflen);
-        blake_gpu.t[0] = blake_state.t[0];
-        blake_gpu.t[1] = blake_state.t[1];
-        blake_gpu.buflen = blake_state.buflen;
-
-        return blake_gpu;
+        // The host solver is made with the rest of the solver, once it is prepared
+        cpu_threads_ = threads;
     }
 
-    void EquihashGPUSolver::enqueue_and_run_hash_kernel(size_t nonce)
+    void EquihashGPUSolver::initialize_context()
     {
-        std::cout << "Starting to create hashes" << std::endl;
-        std::vector<cl::CommandQueue> & device_queues = gpu_config_.get_device_queues();
-
-        BlakeGPU blake = create_initial_digest(nonce);
-        device_queues[0].enqueueWriteBuffer(digest_buffer_, true, 0, sizeof(BlakeGPU), &blake);
-        
-        size_t s = ((equihash_context_.init_size / equihash_context_.indices_per_hash_output) + 1)
-                        / device_queues.size();
-        
-        cl::Kernel & hash_kernel = gpu_config_.get_equihash_hash_kernel();
-
-        hash_kernel.setArg(0, context_buffer_);
-        hash_kernel.setArg(1, table_buffer_);
-        hash_kernel.setArg(2, digest_buffer_);
-
-        // Run the kernels
-        for(size_t i=0;i<device_queues.size();i++)
-        {
-            device_queues[i].enqueueNDRangeKernel(hash_kernel, 
-                                                 cl::NDRange(i*s),
-                                                 cl::NDRange(s),
-                                                 cl::NullRange);
-            
-            cl_int err = device_queues[i].flush();
-            std::cout << EquihashGPUUtils::get_cl_errno(err) << std::endl;
+        EquihashUtils::initialize_context(equihash_context_);
+
+        // One bucket per collision value, the capacity is a multiple of the average bucket load
+        // so that only a negligible amount of rows overflow and get dropped
+        equihash_context_.bucket_bits = equihash_context_.collision_bits_length;
+        equihash_context_.bucket_capacity = MAX_BUCKET_AMOUNT *
+            (equihash_context_.init_size >> equihash_context_.bucket_bits);
+
+        // Tree storage rows hold only the hash, the parents live in the per round tables
+        // Packed rows hold the N hash bits as they are, rounded up to whole words
+        // Byte rows keep the hash in place for all the rounds, the index lists start on the next aligned word
+        uint32_t hash_width = align_row(equihash_context_.hash_length);
+        switch(equihash_context_.storage_mode)
+        {
+            case STORAGE_PACKED:
+                equihash_context_.row_width = sizeof(uint32_t) * 
+                    ((equihash_context_.N + PACKED_WORD_BITS - 1) / PACKED_WORD_BITS);
+                break;
+            case STORAGE_TREE:
+                equihash_context_.row_width = hash_width;
+                break;
+            default:
+                equihash_context_.row_width = hash_width + 
+                    align_row(sizeof(uint32_t) * (1 << (equihash_context_.K-1)));
+                break;
         }
+        // Every round keeps about init_size rows, the margin covers the spread between nonces
+        // and the slow growth over the rounds, whatever is left over gets dropped on the device
+        equihash_context_.table_capacity = equihash_context_.init_size +
+            std::max<uint32_t>(equihash_context_.init_size / TABLE_MARGIN_DIVISOR, MIN_TABLE_MARGIN);
+
+        EquihashUtils::print_context(equihash_context_);
+        printf(": buckets %d (capacity %d)\n",
+            1 << equihash_context_.bucket_bits, equihash_context_.bucket_capacity);
+        printf(": storage %s (row width %d)\n",
+            STORAGE_NAMES[equihash_context_.storage_mode], equihash_context_.row_width);
+        printf(": table capacity %d (memory %zu)\n", equihash_context_.table_capacity,
+            (size_t)equihash_context_.table_capacity * equihash_context_.row_width);
+        sleep(2);
+    }
 
-        // Wait for all to end
-        std::cout << "Done enqueing, waiting for finish" << std::endl;
-        for(size_t i=0;i<device_queues.size();i++)
+    bool EquihashGPUSolver::apply_tuning(const EquihashGPUTuning & tuning, EquihashGPUContext & context)
+    {
+        // Buckets can only be coarser than the collision block, rows of a bucket are still compared on all of it
+        context = equihash_context_;
+        if(tuning.bucket_bits == 0)
+        {
+            return true;
+        }
+        if(tuning.bucket_bits > equihash_context_.collision_bits_length || tuning.bucket_capacity == 0)
         {
-            cl_int err = device_queues[i].finish();
-            std::cout << EquihashGPUUtils::get_cl_errno(err) << std::endl;
+            return false;
         }
-        
-        std::cout << "Finished creating hashes" << std::endl;
+
+        context.bucket_bits = tuning.bucket_bits;
+        context.bucket_capacity = tuning.bucket_capacity;
+        return true;
+    }
+
+    std::string EquihashGPUSolver::get_specialized_build_options(const EquihashGPUContext & context)
+    {
+        std::string options = "-D EQUIHASH_SPECIALIZED";
+        auto add_constant = [&options](const char * name, uint32_t value)
+        {
+            options += std::string(" -D EQUIHASH_") + name + "=" + std::to_string(value) + "U";
+        };
+
+        add_constant("N", context.N);
+        add_constant("K", context.K);
+        add_constant("collision_bits_length", context.collision_bits_length);
+        add_constant("collision_bytes_length", context.collision_bytes_length);
+        add_constant("hash_length", context.hash_length);
+        add_constant("indices_per_hash_output", context.indices_per_hash_output);
+        add_constant("hash_output", context.hash_output);
+        add_constant("full_width", context.full_width);
+        add_constant("init_size", context.init_size);
+        add_constant("solution_size", context.solution_size);
+        add_constant("bucket_bits", context.bucket_bits);
+        add_constant("bucket_capacity", context.bucket_capacity);
+        add_constant("storage_mode", context.storage_mode);
+        add_constant("row_width", context.row_width);
+        add_constant("table_capacity", context.table_capacity);
+
+        return options;
     }
 
-    bool EquihashGPUSolver::enqueue_and_run_coliision_detection_rounds_kernel()
+    bool EquihashGPUSolver::prepare_solver()
     {
-        std::vector<cl::CommandQueue> & device_queues = gpu_config_.get_device_queues();
-        
-        cl::Kernel collision_detection_kernel = gpu_config_.get_equihash_collision_detection_round_kernel();
-     
-        cl::Buffer * temp = &table_buffer_;
-        cl_int zero = 0;
-        uint32_t current_table_rows = equihash_context_.init_size;
-
-        // Go over K rounds, each time swapping the buffers
-        cl_int err;
-        collision_detection_kernel.setArg(0, context_buffer_);
-        collision_detection_kernel.setArg(3, collision_table_size_buffer_);
-        for(size_t i=0;i<equihash_context_.K && current_table_rows > 0;i++)
-        {
-            uint32_t kernel_size_per_queue = current_table_rows / device_queues.size();
-            
-            std::cout << "Starting Kernel Round " << i+1 << "/" << equihash_context_.K << std::endl;
-
-            std::cout << "Restarting the collision table size" << std::endl;
-            device_queues[0].enqueueFillBuffer(collision_table_size_buffer_, 
-                                                zero, 0, sizeof(uint32_t));
-            device_queues[0].flush();
-            device_queues[0].finish();
-
-            // Set the arguments
-            if(i % 2 == 0)
+        if(is_prepared_)
+        {
+            return true;
+        }
+
+        // Initialize the context for equihash, the specialized programs are built from it
+        initialize_context();
+
+        // Initialize the GPU config, every device takes its profile if it was tuned before
+        gpu_config_.initialize_configuration();
+        size_t devices = gpu_config_.get_devices().size();
+        device_contexts_.assign(devices, equihash_context_);
+        device_tunings_.assign(devices, EquihashGPUTuning());
+        for(size_t i=0;i<devices;i++)
+        {
+            EquihashGPUTuning tuning;
+            if(gpu_config_.load_tuning(i, equihash_context_.N, equihash_context_.K, equihash_context_.storage_mode, tuning))
             {
-                collision_detection_kernel.setArg(1, table_buffer_);
-                collision_detection_kernel.setArg(2, collision_table_buffer_);
+                if(apply_tuning(tuning, device_contexts_[i]))
+                {
+                    device_tunings_[i] = tuning;
+                    printf("Device %zu runs with its tuning profile, %d buckets (capacity %d)\n", i,
+                           1 << device_contexts_[i].bucket_bits, device_contexts_[i].bucket_capacity);
+                }
+                else
+                {
+                    printf("Device %zu has a tuning profile that does not fit, ignoring it\n", i);
+                    device_contexts_[i] = equihash_context_;
+                }
             }
-            else
+            gpu_config_.set_build_options(i, specialized_ ? get_specialized_build_options(device_contexts_[i]) : "");
+        }
+
+        // Every device gets its own program, buffers and kernels, a device that fails any of them is skipped
+        for(size_t i=0;i<devices;i++)
+        {
+            if(!gpu_config_.prepare_program(i))
+            {
+                if(!specialized_)
+                {
+                    std::cout << "Could not build the program of device " << i << ", skipping it" << std::endl;
+                    continue;
+                }
+
+                // The generic program reads everything from the context, so it is usable where this one was not
+                std::cout << "Could not build the specialized program of device " << i 
+                          << ", falling back to the generic one" << std::endl;
+                gpu_config_.set_build_options(i, "");
+                if(!gpu_config_.prepare_program(i))
+                {
+                    std::cout << "Could not build the program of device " << i << ", skipping it" << std::endl;
+                    continue;
+                }
+            }
+
+            std::unique_ptr<EquihashGPUWorker> worker(
+                new EquihashGPUWorker(gpu_config_, i, device_contexts_[i], equihash_input_, 
+                                      pipelined_, tiled_, fused_, device_tunings_[i]));
+            if(!worker->is_valid())
             {
-                collision_detection_kernel.setArg(1, collision_table_buffer_);
-                collision_detection_kernel.setArg(2, table_buffer_);
+                std::cout << "Could not prepare device " << i << ", skipping it" << std::endl;
+                continue;
             }
+            std::lock_guard<std::mutex> lock(workers_mutex_);
+            workers_.push_back(std::move(worker));
+        }
+
+        // The host solver keeps its tables between the nonces, it is made once like the device buffers
+        if(cpu_threads_ > 0 && !workers_.empty())
+        {
+            size_t threads = cpu_threads_;
+            if(threads == CPU_THREADS_AUTO)
+            {
+                size_t cores = std::thread::hardware_concurrency();
+                threads = cores > workers_.size() + 1 ? cores - workers_.size() : 1;
+            }
+            cpu_solver_.reset(new EquihashCPUSolver(equihash_context_.N, equihash_context_.K, 
+                                                    equihash_context_.seed, threads));
+            cpu_solver_->set_input(equihash_input_);
+            printf("Solving on %zu host threads alongside the devices\n", threads);
+        }
+
+        is_prepared_ = !workers_.empty();
+        return is_prepared_;
+    }
+
+    bool EquihashGPUSolver::run_tuning_trial(size_t device_index, const EquihashGPUTuning & tuning, 
+                                             size_t nonces, TuningTrial & trial)
+    {
+        EquihashGPUContext context;
+        if(!apply_tuning(tuning, context))
+        {
+            return false;
+        }
+
+        // Other buckets are other constants, the cache keeps every build the sweep goes through
+        gpu_config_.set_build_options(device_index, specialized_ ? get_specialized_build_options(context) : "");
+        if(!gpu_config_.prepare_program(device_index))
+        {
+            return false;
+        }
+
+        EquihashGPUWorker worker(gpu_config_, device_index, context, equihash_input_, pipelined_, tiled_, fused_, 
+                                 tuning);
+        if(!worker.is_valid())
+        {
+            return false;
+        }
+
+        // The same nonces for every candidate, so they only differ by what they drop
+        std::atomic<size_t> next_nonce(1);
+        std::atomic<bool> stop(false);
+        std::atomic<bool> cancel(false);
+        size_t solutions = 0;
+        Timer timer;
+        worker.solve_nonces(next_nonce, 1 + nonces, stop, cancel, false, [&solutions](const Proof &)
+        {
+            solutions++;
+        });
+        trial.seconds = timer.elapsed() / 1e9;
+        trial.solutions = solutions;
+        trial.tiled = worker.is_tiled();
+        trial.metrics = worker.get_metrics();
+        return true;
+    }
+
+    // Execution time of a kernel over the trial, the wall time if the queue was not profiled
+    static double kernel_seconds(const EquihashGPUMetrics & metrics, double seconds, size_t kernel)
+    {
+        if(!metrics.profiling)
+        {
+            return seconds;
+        }
+
+        uint64_t execution_ns = 0;
+        switch(kernel)
+        {
+            case 0:
+                execution_ns = metrics.hash.execution_ns;
+                break;
+            case 1:
+                for(auto && bucket : metrics.bucket)
+                {
+                    execution_ns += bucket.execution_ns;
+                }
+                break;
+            case 2:
+                for(auto && round : metrics.rounds)
+                {
+                    execution_ns += round.execution_ns;
+                }
+                break;
+            default:
+                execution_ns = metrics.solutions_kernel.execution_ns;
+                break;
+        }
+        return execution_ns / 1e9;
+    }
+
+    bool EquihashGPUSolver::tune(size_t nonces)
+    {
+        static const uint32_t LOCAL_SIZES[] = {0, 32, 64, 128, 256, 512, 1024};
+        static const uint32_t WORK_PER_ITEM[] = {1, 2, 4, 8};
+        static const uint32_t BUCKET_AMOUNTS[] = {4, 8};
+        static const char * const KERNEL_NAMES[] = {"hash", "bucket", "collision", "solutions"};
+        EquihashKernelTuning EquihashGPUTuning::* const kernel_tunings[] = 
+        {
+            &EquihashGPUTuning::hash, &EquihashGPUTuning::bucket, 
+            &EquihashGPUTuning::collision, &EquihashGPUTuning::solutions
+        };
+
+        // The tuned workers replace whatever was prepared before
+        cancel_async();
+        {
+            std::lock_guard<std::mutex> lock(workers_mutex_);
+            workers_.clear();
+        }
+        is_prepared_ = false;
+        nonces = std::max<size_t>(nonces, 1);
 
-            collision_detection_kernel.setArg(4, current_table_rows);
-            collision_detection_kernel.setArg(5, (uint8_t)i);
+        initialize_context();
+        gpu_config_.initialize_configuration();
+        bool tuned = false;
+        for(size_t i=0;i<gpu_config_.get_devices().size();i++)
+        {
+            size_t max_local_size = gpu_config_.get_devices()[i].device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+            EquihashGPUTuning best;
+            TuningTrial best_trial;
+            best.bucket_bits = equihash_context_.bucket_bits;
+            best.bucket_capacity = equihash_context_.bucket_capacity;
+            if(!run_tuning_trial(i, best, nonces, best_trial))
+            {
+                std::cout << "Could not run device " << i << ", skipping it" << std::endl;
+                continue;
+            }
 
-            std::cout << "Running the kernels" << std::endl;
-            std::cout << "kernel_size_per_queue = " << kernel_size_per_queue << std::endl;
-            for(size_t j=0;j<device_queues.size();j++)
+            // Whole solves decide the buckets and the tiled kernel, a candidate has to win by the margin
+            // Dropped rows cost solutions, so the rate of solutions is compared and the time breaks ties
+            auto try_solving = [&](const EquihashGPUTuning & candidate)
             {
-                size_t queue_offset = kernel_size_per_queue*j;
-                
-                err = device_queues[j].enqueueNDRangeKernel(collision_detection_kernel,
-                                                      cl::NDRange(queue_offset),
-                                                      cl::NDRange(kernel_size_per_queue),
-                                                      cl::NullRange);
-                std::cout << EquihashGPUUtils::get_cl_errno(err) << std::endl;
-                err = device_queues[j].flush();
-                std::cout << EquihashGPUUtils::get_cl_errno(err) << std::endl;
+                TuningTrial trial;
+                if(!run_tuning_trial(i, candidate, nonces, trial))
+                {
+                    return;
+                }
+                printf("Device %zu: %d buckets (capacity %d), %s, %zu solutions in %.3fs\n", i,
+                       1 << candidate.bucket_bits, candidate.bucket_capacity, trial.tiled ? "tiled" : "global",
+                       trial.solutions, trial.seconds);
+                if(trial.solutions * best_trial.seconds > TUNING_MARGIN * best_trial.solutions * trial.seconds ||
+                   (trial.solutions == best_trial.solutions && trial.seconds * TUNING_MARGIN < best_trial.seconds))
+                {
+                    best = candidate;
+                    best_trial = trial;
+                }
+            };
+
+            for(uint32_t shift=1;shift<=2 && shift<equihash_context_.collision_bits_length;shift++)
+            {
+                EquihashGPUTuning candidate = best;
+                candidate.bucket_bits = equihash_context_.collision_bits_length - shift;
+                candidate.bucket_capacity = MAX_BUCKET_AMOUNT * std::max<uint32_t>(
+                    equihash_context_.init_size >> candidate.bucket_bits, 1);
+                try_solving(candidate);
             }
-            std::cout << "Waiting for kernels to end" << std::endl;
-            for(size_t j=0;j<device_queues.size();j++)
+            uint32_t bucket_load = std::max<uint32_t>(equihash_context_.init_size >> best.bucket_bits, 1);
+            for(uint32_t amount : BUCKET_AMOUNTS)
             {
-                err = device_queues[j].finish();
-                std::cout << EquihashGPUUtils::get_cl_errno(err) << std::endl;
+                EquihashGPUTuning candidate = best;
+                candidate.bucket_capacity = amount * bucket_load;
+                try_solving(candidate);
             }
-            if(err)
+            if(tiled_)
             {
-                std::cout << "Err occured on round, stopping" << std::endl;
-                break;
+                EquihashGPUTuning candidate = best;
+                candidate.tiled = !best.tiled;
+                try_solving(candidate);
             }
 
-            device_queues[0].enqueueReadBuffer(collision_table_size_buffer_, true, 0, sizeof(uint32_t), &current_table_rows);
-            std::cout << "Round " << i+1 << " finished, collision size = " << current_table_rows << std::endl;
+            // Launch sizes only change the time of their own kernel, a local size first and then the work per item
+            for(size_t kernel=0;kernel<4;kernel++)
+            {
+                if(kernel == 2 && best_trial.tiled)
+                {
+                    continue;
+                }
+
+                auto try_launch = [&](const EquihashGPUTuning & candidate)
+                {
+                    TuningTrial trial;
+                    if(!run_tuning_trial(i, candidate, nonces, trial))
+                    {
+                        return;
+                    }
+                    double seconds = kernel_seconds(trial.metrics, trial.seconds, kernel);
+                    printf("Device %zu: %s kernel, local size %u, %u per work item, %.3f ms\n", i, KERNEL_NAMES[kernel],
+                           (candidate.*kernel_tunings[kernel]).local_size, (candidate.*kernel_tunings[kernel]).work_per_item,
+                           seconds * 1e3 / nonces);
+                    if(seconds * TUNING_MARGIN < kernel_seconds(best_trial.metrics, best_trial.seconds, kernel))
+                    {
+                        best = candidate;
+                        best_trial = trial;
+                    }
+                };
+
+                for(uint32_t local_size : LOCAL_SIZES)
+                {
+                    EquihashGPUTuning candidate = best;
+                    if(local_size > max_local_size || local_size == (best.*kernel_tunings[kernel]).local_size)
+                    {
+                        continue;
+                    }
+                    (candidate.*kernel_tunings[kernel]).local_size = local_size;
+                    try_launch(candidate);
+                }
+                for(uint32_t work_per_item : WORK_PER_ITEM)
+                {
+                    EquihashGPUTuning candidate = best;
+                    if(work_per_item == (best.*kernel_tunings[kernel]).work_per_item)
+                    {
+                        continue;
+                    }
+                    (candidate.*kernel_tunings[kernel]).work_per_item = work_per_item;
+                    try_launch(candidate);
+                }
+            }
 
-            if(current_table_rows == 0)
+            printf("Device %zu tuned: %d buckets (capacity %d), %s, %zu solutions in %.3fs\n", i,
+                   1 << best.bucket_bits, best.bucket_capacity, best_trial.tiled ? "tiled" : "global",
+                   best_trial.solutions, best_trial.seconds);
+            for(size_t kernel=0;kernel<4;kernel++)
             {
-                return false;
+                printf("  %-9s local size %u, %u per work item\n", KERNEL_NAMES[kernel],
+                       (best.*kernel_tunings[kernel]).local_size, (best.*kernel_tunings[kernel]).work_per_item);
             }
+            if(!gpu_config_.save_tuning(i, equihash_context_.N, equihash_context_.K, equihash_context_.storage_mode, best))
+            {
+                std::cout << "Could not save the tuning profile of device " << i << std::endl;
+                continue;
+            }
+            tuned = true;
         }
 
-        std::cout << "Finished Rounds" << std::endl;
-
-        return true;
+        return tuned;
     }
 
-    std::vector<Proof> EquihashGPUSolver::enqueue_and_run_solutions_kernel(size_t nonce)
+    size_t EquihashGPUSolver::solve_range(size_t first_nonce, size_t amount, bool stop_on_first,
+                                          const SolutionCallback & callback, const std::atomic<bool> & cancel)
     {
-        std::vector<cl::CommandQueue> & device_queues = gpu_config_.get_device_queues();
-        
-        cl::Kernel solutions_kernel = gpu_config_.get_equihash_solutions_kernel();
-
-        uint32_t table_size;
-        cl_int zero = 0;
-        uint32_t single_solution_size = sizeof(uint32_t) * (equihash_context_.K + 1);
-        device_queues[0].enqueueReadBuffer(collision_table_size_buffer_, true, 0, sizeof(uint32_t), &table_size);
-        uint32_t kernel_size_per_queue = table_size / device_queues.size();
-
-        // The solutions buffer based on the size of the table
-        solutions_buffer_ = cl::Buffer(
-            gpu_config_.get_context(),
-            CL_MEM_READ_WRITE,
-            table_size*(table_size+1)*single_solution_size
-        );
-
-        device_queues[0].enqueueFillBuffer(solutions_buffer_, zero, 0, (table_size/2)*single_solution_size);
-
-        // Set the arguments
-        solutions_kernel.setArg(0, context_buffer_);
-        if(equihash_context_.K % 2 == 0)
-        {
-            solutions_kernel.setArg(1, table_buffer_);
-            solutions_kernel.setArg(2, collision_table_buffer_);
+        if(!prepare_solver())
+        {
+            std::cout << "No device could be prepared" << std::endl;
+            return 0;
         }
-        else
+
+        // The nonces are handed out one at a time from a shared counter
+        // so faster devices simply come back for more
+        std::atomic<size_t> next_nonce(first_nonce);
+        std::atomic<bool> stop(false);
+        size_t last_nonce = std::min(first_nonce + amount, (size_t)MAX_NONCE);
+        std::vector<size_t> worker_solved(workers_.size(), 0);
+        std::vector<std::thread> threads;
+        std::mutex callback_mutex;
+        size_t solutions = 0;
+        Timer timer;
+
+        // The devices report from their own threads, the callback sees one solution at a time
+        SolutionCallback locked_callback = [&](const Proof & proof)
         {
-            solutions_kernel.setArg(1, collision_table_buffer_);
-            solutions_kernel.setArg(2, table_buffer_);
+            std::lock_guard<std::mutex> lock(callback_mutex);
+            solutions++;
+            callback(proof);
+        };
+
+        for(size_t i=0;i<workers_.size();i++)
+        {
+            threads.emplace_back([&, i]()
+            {
+                worker_solved[i] = workers_[i]->solve_nonces(next_nonce, last_nonce, stop, cancel,
+                                                             stop_on_first, locked_callback);
+            });
         }
-        solutions_kernel.setArg(3, solutions_buffer_);
-        solutions_kernel.setArg(4, collision_table_size_buffer_);
-        solutions_kernel.setArg(5, solutions_size_buffer_);
-        solutions_kernel.setArg(6, table_size);
-
-        std::cout << "Running solutions kernels" << std::endl;
-        cl_int err;
-        for(size_t j=0;j<device_queues.size();j++)
-        {
-            size_t queue_offset = kernel_size_per_queue*j;
-            err = device_queues[j].enqueueNDRangeKernel(solutions_kernel,
-                                                    cl::NDRange(queue_offset),
-                                                    cl::NDRange(kernel_size_per_queue),
-                                                    cl::NullRange);
-            std::cout << EquihashGPUUtils::get_cl_errno(err) << std::endl;
-            err = device_queues[j].flush();
-            std::cout << EquihashGPUUtils::get_cl_errno(err) << std::endl;
+
+        // The host takes a nonce whenever it is done with the last one, like another device
+        // It only checks a single flag inside a nonce, so stop is raised on a cancel as well
+        size_t cpu_solved = 0;
+        std::atomic<bool> cpu_done(false);
+        std::thread cpu_thread;
+        if(cpu_solver_)
+        {
+            cpu_thread = std::thread([&]()
+            {
+                size_t nonce;
+                while(!stop && !cancel && (nonce = next_nonce.fetch_add(1)) < last_nonce)
+                {
+                    std::vector<Proof> solutions = cpu_solver_->solve_nonce(nonce, stop);
+                    if(stop || cancel)
+                    {
+                        break;
+                    }
+                    cpu_solved++;
+                    for(auto && proof : solutions)
+                    {
+                        locked_callback(proof);
+                    }
+                    if(stop_on_first && !solutions.empty())
+                    {
+                        stop = true;
+                    }
+                }
+                cpu_done = true;
+            });
         }
-        std::cout << "Waiting for kernels to end" << std::endl;
-        for(size_t j=0;j<device_queues.size();j++)
+        for(auto && thread : threads)
         {
-            err = device_queues[j].finish();
-            std::cout << EquihashGPUUtils::get_cl_errno(err) << std::endl;
+            thread.join();
         }
-        if(err)
+        // The devices leave as soon as they see the cancel, the host is told through stop
+        while(cpu_thread.joinable() && !cpu_done)
         {
-            std::cout << "Err occured on round, stopping" << std::endl;
-            return std::vector<Proof>();
+            if(cancel)
+            {
+                stop = true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(CANCEL_POLL_MS));
         }
+        if(cpu_thread.joinable())
+        {
+            cpu_thread.join();
+        }
+        double elapsed = timer.elapsed() / 1e9;
 
-        // Collect the solutions
-        uint32_t solutions_amount;
-        device_queues[0].enqueueReadBuffer(solutions_size_buffer_, true, 0, sizeof(uint32_t), &solutions_amount);
-
-        uint8_t solutions_temp[solutions_amount * equihash_context_.solution_size];
-        device_queues[0].enqueueReadBuffer(solutions_buffer_, true, 0, solutions_amount * equihash_context_.solution_size, solutions_temp);
-        std::vector<Proof> solutions(solutions_amount);
-        std::vector<uint8_t> sol(equihash_context_.solution_size);
-        Proof p;
-        p.set_solution_nonce(nonce);
-        for(size_t i=0;i<solutions_amount;i++)
-        {
-            memcpy(&sol[0], solutions_temp + (equihash_context_.solution_size*i), equihash_context_.solution_size);
-            p.set_solution(sol);
-            solutions.push_back(p);
+        size_t solved = 0;
+        for(size_t i=0;i<workers_.size();i++)
+        {
+            printf("Device %zu solved %zu nonces\n", i, worker_solved[i]);
+            solved += worker_solved[i];
         }
+        if(cpu_solver_)
+        {
+            printf("Host solved %zu nonces\n", cpu_solved);
+            solved += cpu_solved;
+        }
+
+        printf("Solved %zu nonces (%s, %s, %zu devices%s), %zu solutions in %.2fs: %.2f Sol/s, %.2f nonces/s%s\n",
+               solved, pipelined_ ? "pipelined" : "serial", specialized_ ? "specialized" : "generic",
+               workers_.size(), cpu_solver_ ? " and the host" : "", solutions, elapsed,
+               elapsed > 0 ? solutions / elapsed : 0, elapsed > 0 ? solved / elapsed : 0,
+               cancel ? " (cancelled)" : "");
 
-        return solutions;
+        return solved;
     }
 
-    std::vector<Proof> EquihashGPUSolver::find_proof()
+    std::vector<EquihashGPUMetrics> EquihashGPUSolver::get_metrics()
     {
-    //     try
-    //     {
-        size_t nonce = 1;
-        // Initialize the GPU config
-        gpu_config_.initialize_configuration();
-        gpu_config_.prepare_program();
+        std::lock_guard<std::mutex> lock(workers_mutex_);
+        std::vector<EquihashGPUMetrics> metrics;
+        for(auto && worker : workers_)
+        {
+            metrics.push_back(worker->get_metrics());
+        }
+        return metrics;
+    }
 
-        // Initialize the context for equihash
-        initialize_context();
+    std::vector<Proof> EquihashGPUSolver::solve_nonces(size_t first_nonce, size_t amount, bool stop_on_first)
+    {
+        std::vector<Proof> proofs;
+        std::atomic<bool> cancel(false);
+        solve_range(first_nonce, amount, stop_on_first, [&proofs](const Proof & proof)
+        {
+            proofs.push_back(proof);
+        }, cancel);
 
-        // Prepare the GPU buffers
-        prepare_buffers();
-        while(nonce < MAX_NONCE)
+        // Keep the results in nonce order regardless of which device found them
+        std::stable_sort(proofs.begin(), proofs.end(), [](const Proof & a, const Proof & b)
         {
-            // Fill the buffer hashes, note that this will block and run in batches on the GPU
-            enqueue_and_run_hash_kernel(nonce);
+            return a.get_solution_nonce() < b.get_solution_nonce();
+        });
 
-            // Perform the coliision detection
-            if(enqueue_and_run_coliision_detection_rounds_kernel())
-            {
-                // Perform the final round and get the solutions if any
-                std::vector<Proof> && solutions = enqueue_and_run_solutions_kernel(nonce);   
-            }
+        return proofs;
+    }
 
-            nonce++;
-        }
-        // }
-        // catch(cl::Error & err)
-        // {
-        //     std::cout << "Error Occured" << std::endl;
-        //     std::cout << err.what() << " - " << EquihashGPUUtils::get_cl_errno(err.err()) << std::endl;
-        //     backtrace();
-        //     return std::vector<Proof>();
-        // }
-        return std::vector<Proof>();
+    std::vector<Proof> EquihashGPUSolver::find_proof()
+    {
+        // Go over the nonces until one of them has solutions
+        return solve_nonces(1, MAX_NONCE - 1, true);
     }
 
     bool EquihashGPUSolver::verify_proof(const Proof & proof)
     {
-        // TODO
+        EquihashVerifier verifier(equihash_context_, equihash_input_);
+        return verifier.verify(proof);
+    }
+
+    void EquihashGPUSolver::set_seed(const uint32_t seed[SEED_SIZE])
+    {
+        // The seed only goes into the digest of each nonce, the rest of the state stays as it is
+        cancel_async();
+        memcpy(equihash_context_.seed, seed, sizeof(uint32_t)*SEED_SIZE);
+        EquihashUtils::initialize_input(equihash_context_.N, equihash_context_.K, seed, equihash_input_);
+        if(cpu_solver_)
+        {
+            cpu_solver_->set_input(equihash_input_);
+        }
+    }
+
+    bool EquihashGPUSolver::set_header(const std::vector<uint8_t> & header, const uint8_t nonce[EQUIHASH_NONCE_SIZE])
+    {
+        EquihashInput input;
+        if(!EquihashUtils::initialize_input(equihash_context_.N, equihash_context_.K,
+                                            header.data(), header.size(), nonce, input))
+        {
+            std::cout << "A header of " << header.size() << " bytes splits the leaf index between two blocks" << std::endl;
+            return false;
+        }
+
+        cancel_async();
+        equihash_input_ = input;
+        if(cpu_solver_)
+        {
+            cpu_solver_->set_input(equihash_input_);
+        }
+        return true;
     }
 }
\ No newline at end of file
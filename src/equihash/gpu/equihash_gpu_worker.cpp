@@ -0,0 +1,655 @@
+/**
+ * @file equihash_gpu_worker.cpp
+ * @author ofir iluz (iluzofir@gmail.com)
+ * @brief 
+ * @version 0.1
+ * @date 2018-12-10
+ * 
+ * @copyright Copyright (c) 2018
+ * 
+ */
+
+#include "equihash_gpu/equihash/gpu/equihash_gpu_worker.h"
+#include "equihash_gpu/equihash/equihash_verifier.h"
+#include <string.h>
+
+namespace Equihash
+{
+    EquihashGPUWorker::EquihashGPUWorker(EquihashGPUConfig & gpu_config, size_t device_index,
+                                         const EquihashGPUContext & context, const EquihashInput & input,
+                                         bool pipelined, bool tiled, bool fused, const EquihashGPUTuning & tuning)
+        : gpu_device_(gpu_config.get_devices()[device_index]), equihash_context_(context), equihash_input_(input),
+          tuning_(tuning), pipelined_(pipelined), tiled_(false), fused_(fused), is_valid_(false), buffers_size_(0), 
+          hash_event_pending_(false)
+    {
+        metrics_.initialize(gpu_device_.device.getInfo<CL_DEVICE_NAME>(), context.K, gpu_device_.profiling);
+
+        // The prefix length is the same for every nonce, the leaves are hashed from a midstate
+        Blake2bMidstate midstate;
+        if(!create_initial_digest(0, midstate))
+        {
+            std::cout << "The nonce prefix does not leave room for the leaf index in its final block" << std::endl;
+            return;
+        }
+
+        // The tile of a work group is sized at build time, buckets and the device both have to fit it
+        if(tiled && tuning_.tiled)
+        {
+            size_t tile_memory = sizeof(uint32_t) * LOCAL_WORK_GROUP_SIZE * (2 + 4*LOCAL_BUCKET_CAPACITY);
+            tiled_ = equihash_context_.bucket_capacity <= LOCAL_BUCKET_CAPACITY &&
+                     gpu_device_.device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>() >= LOCAL_WORK_GROUP_SIZE &&
+                     gpu_device_.device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() >= tile_memory;
+            std::cout << (tiled_ ? "Collision rounds run on local memory tiles" : 
+                                   "Collision rounds can not be tiled on this device") << std::endl;
+        }
+
+        if(gpu_config.create_kernels(device_index, kernels_))
+        {
+            fit_local_size(fused_ ? kernels_.bucketed_hash_kernel : kernels_.hash_kernel, tuning_.hash);
+            fit_local_size(kernels_.bucket_kernel, tuning_.bucket);
+            fit_local_size(kernels_.collision_detection_round_kernel, tuning_.collision);
+            fit_local_size(kernels_.solutions_kernel, tuning_.solutions);
+            prepare_buffers();
+            metrics_.buffers_size = buffers_size_;
+            is_valid_ = true;
+        }
+    }
+
+    EquihashGPUWorker::~EquihashGPUWorker()
+    {
+
+    }
+
+    bool EquihashGPUWorker::is_valid()
+    {
+        return is_valid_;
+    }
+
+    bool EquihashGPUWorker::is_tiled() const
+    {
+        return tiled_;
+    }
+
+    size_t EquihashGPUWorker::get_buffers_size() const
+    {
+        return buffers_size_;
+    }
+
+    EquihashGPUMetrics EquihashGPUWorker::get_metrics()
+    {
+        std::lock_guard<std::mutex> lock(metrics_mutex_);
+        return metrics_;
+    }
+
+    void EquihashGPUWorker::record_kernel(EquihashKernelMetrics & kernel_metrics, const cl::Event & event)
+    {
+        cl_ulong queued = 0, submitted = 0, started = 0, ended = 0;
+        if(gpu_device_.profiling)
+        {
+            event.getProfilingInfo(CL_PROFILING_COMMAND_QUEUED, &queued);
+            event.getProfilingInfo(CL_PROFILING_COMMAND_SUBMIT, &submitted);
+            event.getProfilingInfo(CL_PROFILING_COMMAND_START, &started);
+            event.getProfilingInfo(CL_PROFILING_COMMAND_END, &ended);
+        }
+
+        std::lock_guard<std::mutex> lock(metrics_mutex_);
+        kernel_metrics.add(queued, submitted, started, ended);
+    }
+
+    void EquihashGPUWorker::record_transfer(size_t to_device, size_t from_device)
+    {
+        std::lock_guard<std::mutex> lock(metrics_mutex_);
+        metrics_.bytes_to_device += to_device;
+        metrics_.bytes_from_device += from_device;
+    }
+
+    void EquihashGPUWorker::record_pending_hash()
+    {
+        // A pipelined hash is only known to be done once its queue was finished
+        if(hash_event_pending_)
+        {
+            record_kernel(metrics_.hash, hash_event_);
+            hash_event_pending_ = false;
+        }
+    }
+
+    cl::Buffer EquihashGPUWorker::create_buffer(cl_mem_flags flags, size_t size)
+    {
+        buffers_size_ += size;
+        return cl::Buffer(gpu_device_.context, flags, size);
+    }
+
+    const uint8_t * EquihashGPUWorker::map_results(cl::Buffer & buffer, size_t size)
+    {
+        // Results and counters are in host visible memory, on devices that share it the map copies nothing
+        cl_int err = CL_SUCCESS;
+        void * mapped = gpu_device_.queue.enqueueMapBuffer(buffer, CL_TRUE, CL_MAP_READ, 0, size, NULL, NULL, &err);
+        if(err != CL_SUCCESS)
+        {
+            std::cout << "Could not map the results - " << EquihashGPUUtils::get_cl_errno(err) << std::endl;
+            return nullptr;
+        }
+        record_transfer(0, size);
+        return (const uint8_t *)mapped;
+    }
+
+    void EquihashGPUWorker::unmap_results(cl::Buffer & buffer, const uint8_t * mapped)
+    {
+        // The queue is in order, the kernels after this see the buffer unmapped
+        gpu_device_.queue.enqueueUnmapMemObject(buffer, (void *)mapped);
+    }
+
+    bool EquihashGPUWorker::read_counters(cl::Buffer & buffer, uint32_t * counters, size_t amount)
+    {
+        const uint8_t * mapped = map_results(buffer, amount*sizeof(uint32_t));
+        if(!mapped)
+        {
+            return false;
+        }
+        memcpy(counters, mapped, amount*sizeof(uint32_t));
+        unmap_results(buffer, mapped);
+        return true;
+    }
+
+    void EquihashGPUWorker::prepare_buffers()
+    {
+        cl::CommandQueue & queue = gpu_device_.queue;
+        cl_int zero = 0;
+        size_t table_size = (size_t)equihash_context_.table_capacity*equihash_context_.row_width;
+        // Create the hash table s
+        table_buffer_ = create_buffer(CL_MEM_READ_WRITE, table_size);
+        queue.enqueueFillBuffer(table_buffer_, zero, 0, 
+            table_size
+        );
+
+        // The solutions counter, followed by the tree candidates counter
+        // Everything the host reads back is allocated host visible and mapped instead of copied
+        solutions_size_buffer_ = create_buffer(CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, 2*sizeof(uint32_t));
+        queue.enqueueFillBuffer(solutions_size_buffer_, zero, 0, 
+            2*sizeof(uint32_t));
+
+        // Each nonce has about two solutions, the capacity is far above anything seen in practice
+        solutions_buffer_ = create_buffer(CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, 
+                                          (size_t)MAX_SOLUTIONS*equihash_context_.solution_size);
+
+        // Every round writes its rows into the other table, both have the same capacity
+        collision_table_buffer_ = create_buffer(CL_MEM_READ_WRITE, table_size);
+        queue.enqueueFillBuffer(collision_table_buffer_, zero, 0, 
+            table_size
+        );
+            
+        round_rows_buffer_ = create_buffer(CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, 
+                                           equihash_context_.K*sizeof(uint32_t));
+
+        // Bucket sizes and the row indices of each bucket
+        bucket_sizes_buffer_ = create_buffer(CL_MEM_READ_WRITE, sizeof(uint32_t) << equihash_context_.bucket_bits);
+
+        buckets_buffer_ = create_buffer(CL_MEM_READ_WRITE,
+            (sizeof(uint32_t)*equihash_context_.bucket_capacity) << equihash_context_.bucket_bits);
+
+        // Rows the buckets had no room for, summed over the rounds of a nonce
+        dropped_rows_buffer_ = create_buffer(CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, sizeof(uint32_t));
+
+        // The parents of every round and scratch space to rebuild the indices of the candidates
+        // The kernels always take them, so on indices storage they are kept minimal
+        if(equihash_context_.storage_mode != STORAGE_INDICES)
+        {
+            tree_buffer_ = create_buffer(CL_MEM_READ_WRITE,
+                (size_t)(equihash_context_.K-1)*equihash_context_.table_capacity*2*sizeof(uint32_t));
+
+            // Every candidate slot takes its indices and a sorted copy of them
+            tree_candidates_buffer_ = create_buffer(CL_MEM_READ_WRITE,
+                (MAX_TREE_CANDIDATES*sizeof(uint32_t)) << (equihash_context_.K + 1));
+        }
+        else
+        {
+            tree_buffer_ = create_buffer(CL_MEM_READ_WRITE, 2*sizeof(uint32_t));
+            tree_candidates_buffer_ = create_buffer(CL_MEM_READ_WRITE, sizeof(uint32_t));
+        }
+
+        // Construct the digest buffer, holds the midstate the leaves are hashed from
+        digest_buffer_ = create_buffer(CL_MEM_READ_WRITE, sizeof(Blake2bMidstate));
+        queue.enqueueFillBuffer(digest_buffer_, zero, 0, 
+            sizeof(Blake2bMidstate));
+
+        // Only the leaves and the digest are written by the hashing, the rest is used by the rounds alone
+        if(pipelined_)
+        {
+            next_table_buffer_ = create_buffer(CL_MEM_READ_WRITE, table_size);
+            next_digest_buffer_ = create_buffer(CL_MEM_READ_WRITE, sizeof(Blake2bMidstate));
+            if(fused_)
+            {
+                next_bucket_sizes_buffer_ = create_buffer(CL_MEM_READ_WRITE, 
+                                                          sizeof(uint32_t) << equihash_context_.bucket_bits);
+                next_buckets_buffer_ = create_buffer(CL_MEM_READ_WRITE,
+                    (sizeof(uint32_t)*equihash_context_.bucket_capacity) << equihash_context_.bucket_bits);
+                next_dropped_rows_buffer_ = create_buffer(CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, sizeof(uint32_t));
+            }
+        }
+
+        // Construct the context buffer to be used, will be the same as the gpu structure
+        context_buffer_ = create_buffer(CL_MEM_READ_ONLY, sizeof(EquihashGPUContext));
+
+        // Copy the context to the buffer
+        queue.enqueueWriteBuffer(context_buffer_, false, 0, sizeof(EquihashGPUContext), &equihash_context_);
+
+        printf("Device buffers take %.1f MB\n", buffers_size_ / (1024.0*1024.0));
+    }
+
+    bool EquihashGPUWorker::create_initial_digest(size_t nonce, Blake2bMidstate & midstate)
+    {
+        return EquihashUtils::initialize_midstate(equihash_input_, nonce, midstate);
+    }
+
+    void EquihashGPUWorker::fit_local_size(cl::Kernel & kernel, EquihashKernelTuning & kernel_tuning)
+    {
+        // A profile from another build of the kernels may ask for more than this one allows
+        size_t max_local_size = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(gpu_device_.device);
+        if(kernel_tuning.local_size > max_local_size)
+        {
+            std::cout << "Local size " << kernel_tuning.local_size << " is above the kernel limit of " 
+                      << max_local_size << ", leaving it to the driver" << std::endl;
+            kernel_tuning.local_size = 0;
+        }
+        kernel_tuning.work_per_item = std::max<uint32_t>(kernel_tuning.work_per_item, 1);
+    }
+
+    size_t EquihashGPUWorker::get_global_size(size_t work, const EquihashKernelTuning & kernel_tuning)
+    {
+        // At least one work item, and whole work groups once the local size is set
+        size_t items = std::max<size_t>((work + kernel_tuning.work_per_item - 1) / kernel_tuning.work_per_item, 1);
+        if(kernel_tuning.local_size > 0)
+        {
+            items = ((items + kernel_tuning.local_size - 1) / kernel_tuning.local_size) * kernel_tuning.local_size;
+        }
+        return items;
+    }
+
+    cl_int EquihashGPUWorker::enqueue_and_run_kernel(cl::CommandQueue & queue, cl::Kernel & kernel, size_t global_size, 
+                                                     bool wait, cl::Event * event, size_t local_size)
+    {
+        cl_int err = queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(global_size), 
+                                                local_size > 0 ? cl::NDRange(local_size) : cl::NullRange, 
+                                                NULL, event);
+        if(err == CL_SUCCESS)
+        {
+            err = wait ? queue.finish() : queue.flush();
+        }
+
+        if(err != CL_SUCCESS)
+        {
+            std::cout << EquihashGPUUtils::get_cl_errno(err) << std::endl;
+        }
+
+        return err;
+    }
+
+    void EquihashGPUWorker::enqueue_hash_kernel(size_t nonce, bool spare, cl::CommandQueue & queue, bool wait)
+    {
+        cl::Buffer & table = spare ? next_table_buffer_ : table_buffer_;
+        cl::Buffer & digest = spare ? next_digest_buffer_ : digest_buffer_;
+        Blake2bMidstate midstate;
+        create_initial_digest(nonce, midstate);
+        queue.enqueueWriteBuffer(digest, true, 0, sizeof(Blake2bMidstate), &midstate);
+        record_transfer(sizeof(Blake2bMidstate), 0);
+        
+        size_t s = (equihash_context_.init_size + equihash_context_.indices_per_hash_output - 1)
+                        / equihash_context_.indices_per_hash_output;
+        
+        cl::Kernel & hash_kernel = fused_ ? kernels_.bucketed_hash_kernel : kernels_.hash_kernel;
+
+        hash_kernel.setArg(0, context_buffer_);
+        hash_kernel.setArg(1, table);
+        hash_kernel.setArg(2, digest);
+
+        // The buckets of the first round are emptied on the queue of the hash, ahead of it
+        if(fused_)
+        {
+            cl::Buffer & bucket_sizes = spare ? next_bucket_sizes_buffer_ : bucket_sizes_buffer_;
+            cl::Buffer & dropped_rows = spare ? next_dropped_rows_buffer_ : dropped_rows_buffer_;
+            cl_int zero = 0;
+            queue.enqueueFillBuffer(bucket_sizes, zero, 0, sizeof(uint32_t) << equihash_context_.bucket_bits);
+            queue.enqueueFillBuffer(dropped_rows, zero, 0, sizeof(uint32_t));
+            hash_kernel.setArg(3, bucket_sizes);
+            hash_kernel.setArg(4, spare ? next_buckets_buffer_ : buckets_buffer_);
+            hash_kernel.setArg(5, dropped_rows);
+        }
+
+        if(enqueue_and_run_kernel(queue, hash_kernel, get_global_size(s, tuning_.hash), wait, &hash_event_,
+                                  tuning_.hash.local_size) == CL_SUCCESS)
+        {
+            hash_event_pending_ = true;
+            if(wait)
+            {
+                record_pending_hash();
+            }
+        }
+    }
+
+    bool EquihashGPUWorker::enqueue_bucket_kernel(cl::Buffer & working_table, size_t round, cl::Event & event)
+    {
+        cl::CommandQueue & queue = gpu_device_.queue;
+        cl::Kernel & bucket_kernel = kernels_.bucket_kernel;
+        cl_int zero = 0;
+
+        // Empty the buckets before sorting the rows into them, the queue is in order so nothing waits for it
+        queue.enqueueFillBuffer(bucket_sizes_buffer_, zero, 0, 
+            sizeof(uint32_t) << equihash_context_.bucket_bits);
+
+        bucket_kernel.setArg(0, context_buffer_);
+        bucket_kernel.setArg(1, working_table);
+        bucket_kernel.setArg(2, bucket_sizes_buffer_);
+        bucket_kernel.setArg(3, buckets_buffer_);
+        bucket_kernel.setArg(4, round_rows_buffer_);
+        bucket_kernel.setArg(5, dropped_rows_buffer_);
+        bucket_kernel.setArg(6, (uint8_t)round);
+
+        // The kernel reads the rows of the round on the device, so it is sized for the most there can be
+        size_t rows = round == 0 ? equihash_context_.init_size : equihash_context_.table_capacity;
+        return enqueue_and_run_kernel(queue, bucket_kernel, get_global_size(rows, tuning_.bucket), false, &event,
+                                      tuning_.bucket.local_size) == CL_SUCCESS;
+    }
+
+    bool EquihashGPUWorker::enqueue_and_run_coliision_detection_rounds_kernel(const std::atomic<bool> & cancel)
+    {
+        cl::CommandQueue & queue = gpu_device_.queue;
+        cl::Kernel & collision_detection_kernel = tiled_ ? kernels_.tiled_collision_detection_round_kernel
+                                                         : kernels_.collision_detection_round_kernel;
+        size_t bucket_amount = (size_t)1 << equihash_context_.bucket_bits;
+        size_t rounds = equihash_context_.K - 1;
+        // A work group per tile of buckets, or work items that take the buckets as tuned
+        size_t global_size = tiled_ ? 
+            ((bucket_amount + LOCAL_WORK_GROUP_SIZE - 1) / LOCAL_WORK_GROUP_SIZE) * LOCAL_WORK_GROUP_SIZE : 
+            get_global_size(bucket_amount, tuning_.collision);
+        size_t local_size = tiled_ ? LOCAL_WORK_GROUP_SIZE : tuning_.collision.local_size;
+        std::vector<cl::Event> bucket_events(rounds);
+        std::vector<cl::Event> round_events(rounds);
+        cl_int zero = 0;
+        cl_uint leaves = equihash_context_.init_size;
+
+        collision_detection_kernel.setArg(0, context_buffer_);
+        collision_detection_kernel.setArg(3, round_rows_buffer_);
+        collision_detection_kernel.setArg(4, bucket_sizes_buffer_);
+        collision_detection_kernel.setArg(5, buckets_buffer_);
+        collision_detection_kernel.setArg(6, tree_buffer_);
+
+        // The rounds count their rows on the device, the host reads all of the counts once they are done
+        queue.enqueueFillBuffer(round_rows_buffer_, zero, 0, equihash_context_.K*sizeof(uint32_t));
+        queue.enqueueFillBuffer(round_rows_buffer_, leaves, 0, sizeof(uint32_t));
+
+        // Fused hashing already counted the rows dropped from the first buckets
+        if(!fused_)
+        {
+            queue.enqueueFillBuffer(dropped_rows_buffer_, zero, 0, sizeof(uint32_t));
+        }
+
+        // Go over K-1 rounds, each time swapping the buffers
+        // The last round collides on two blocks and is done by the solutions kernel
+        for(size_t i=0;i<rounds;i++)
+        {
+            // A single round is kept queued ahead of the device, so cancelling waits for the round in flight at most
+            if(i >= 2)
+            {
+                round_events[i-2].wait();
+            }
+            if(cancel)
+            {
+                queue.finish();
+                return false;
+            }
+
+            cl::Buffer & working_table = (i % 2 == 0) ? table_buffer_ : collision_table_buffer_;
+            cl::Buffer & collision_table = (i % 2 == 0) ? collision_table_buffer_ : table_buffer_;
+
+            std::cout << "Starting Kernel Round " << i+1 << "/" << rounds << std::endl;
+
+            // Sort the rows into buckets by the current collision block, unless the hashing did it
+            if((i > 0 || !fused_) && !enqueue_bucket_kernel(working_table, i, bucket_events[i]))
+            {
+                std::cout << "Err occured on bucketing, stopping" << std::endl;
+                queue.finish();
+                return false;
+            }
+
+            // Set the arguments
+            collision_detection_kernel.setArg(1, working_table);
+            collision_detection_kernel.setArg(2, collision_table);
+            collision_detection_kernel.setArg(7, (uint8_t)i);
+
+            // Each work item pairs the rows of its buckets
+            if(enqueue_and_run_kernel(queue, collision_detection_kernel, global_size, false, &round_events[i], 
+                                      local_size) != CL_SUCCESS)
+            {
+                std::cout << "Err occured on round, stopping" << std::endl;
+                queue.finish();
+                return false;
+            }
+        }
+
+        // Mapping the counts waits for the last round, the events of every round are done after it
+        std::vector<uint32_t> round_rows(equihash_context_.K);
+        if(!read_counters(round_rows_buffer_, round_rows.data(), round_rows.size()))
+        {
+            return false;
+        }
+
+        for(size_t i=0;i<rounds;i++)
+        {
+            if(i > 0 || !fused_)
+            {
+                record_kernel(metrics_.bucket[i], bucket_events[i]);
+            }
+            record_kernel(metrics_.rounds[i], round_events[i]);
+
+            uint32_t current_table_rows = round_rows[i+1];
+            uint32_t overflow = 0;
+            if(current_table_rows > equihash_context_.table_capacity)
+            {
+                // The rows past the capacity were dropped, the rest of the round is still good
+                overflow = current_table_rows - equihash_context_.table_capacity;
+                std::cout << "Round " << i+1 << " overflowed, dropped " << overflow << " rows" << std::endl;
+                current_table_rows = equihash_context_.table_capacity;
+            }
+            {
+                std::lock_guard<std::mutex> lock(metrics_mutex_);
+                metrics_.round_rows[i] += current_table_rows;
+                metrics_.table_dropped_rows += overflow;
+            }
+            std::cout << "Round " << i+1 << " finished, collision size = " << current_table_rows << std::endl;
+        }
+
+        std::cout << "Finished Rounds" << std::endl;
+
+        // Nothing left to collide, the solutions round can be skipped
+        return round_rows[rounds] > 0;
+    }
+
+    std::vector<Proof> EquihashGPUWorker::enqueue_and_run_solutions_kernel(size_t nonce)
+    {
+        cl::CommandQueue & queue = gpu_device_.queue;
+        
+        cl::Kernel & solutions_kernel = kernels_.solutions_kernel;
+
+        cl_int zero = 0;
+        size_t bucket_amount = (size_t)1 << equihash_context_.bucket_bits;
+
+        // The rounds swap the buffers, the last round wrote into this one
+        cl::Buffer & working_table = (equihash_context_.K % 2 == 0) ? collision_table_buffer_ : table_buffer_;
+
+        uint32_t solutions_capacity = MAX_SOLUTIONS;
+
+        queue.enqueueFillBuffer(solutions_size_buffer_, zero, 0, 2*sizeof(uint32_t));
+
+        // The last round is bucketed like the others
+        cl::Event bucket_event;
+        if(!enqueue_bucket_kernel(working_table, equihash_context_.K-1, bucket_event))
+        {
+            std::cout << "Err occured on bucketing, stopping" << std::endl;
+            queue.finish();
+            return std::vector<Proof>();
+        }
+
+        // Set the arguments
+        solutions_kernel.setArg(0, context_buffer_);
+        solutions_kernel.setArg(1, working_table);
+        solutions_kernel.setArg(2, solutions_buffer_);
+        solutions_kernel.setArg(3, solutions_size_buffer_);
+        solutions_kernel.setArg(4, bucket_sizes_buffer_);
+        solutions_kernel.setArg(5, buckets_buffer_);
+        solutions_kernel.setArg(6, solutions_capacity);
+        solutions_kernel.setArg(7, tree_buffer_);
+        solutions_kernel.setArg(8, tree_candidates_buffer_);
+
+        std::cout << "Running solutions kernels" << std::endl;
+        cl::Event event;
+        if(enqueue_and_run_kernel(queue, solutions_kernel, get_global_size(bucket_amount, tuning_.solutions), true, &event,
+                                  tuning_.solutions.local_size) != CL_SUCCESS)
+        {
+            std::cout << "Err occured on round, stopping" << std::endl;
+            return std::vector<Proof>();
+        }
+        record_kernel(metrics_.bucket[equihash_context_.K-1], bucket_event);
+        record_kernel(metrics_.solutions_kernel, event);
+
+        // Collect the solutions, along with whatever did not fit on the way
+        uint32_t counters[2];
+        uint32_t bucket_dropped_rows;
+        if(!read_counters(solutions_size_buffer_, counters, 2) ||
+           !read_counters(dropped_rows_buffer_, &bucket_dropped_rows, 1))
+        {
+            return std::vector<Proof>();
+        }
+        uint32_t solutions_amount = std::min(counters[0], solutions_capacity);
+        uint32_t candidates_dropped = counters[1] > MAX_TREE_CANDIDATES ? counters[1] - MAX_TREE_CANDIDATES : 0;
+        uint32_t solutions_dropped = counters[0] - solutions_amount;
+        if(bucket_dropped_rows > 0 || candidates_dropped > 0 || solutions_dropped > 0)
+        {
+            std::cout << "Nonce " << nonce << " dropped " << bucket_dropped_rows << " bucketed rows, "
+                      << candidates_dropped << " candidates and " << solutions_dropped << " solutions" << std::endl;
+        }
+        {
+            std::lock_guard<std::mutex> lock(metrics_mutex_);
+            metrics_.bucket_dropped_rows += bucket_dropped_rows;
+            metrics_.dropped_solutions += candidates_dropped + solutions_dropped;
+        }
+
+        std::vector<Proof> solutions;
+        if(solutions_amount == 0)
+        {
+            return solutions;
+        }
+
+        // The proofs copy their solutions right out of the mapped buffer, there is no staging copy before them
+        const uint8_t * mapped = map_results(solutions_buffer_, (size_t)solutions_amount*equihash_context_.solution_size);
+        if(!mapped)
+        {
+            return solutions;
+        }
+        EquihashVerifier verifier(equihash_context_, equihash_input_, 1);
+        solutions.reserve(solutions_amount);
+        for(size_t i=0;i<solutions_amount;i++)
+        {
+            const uint8_t * solution = mapped + (size_t)equihash_context_.solution_size*i;
+            solutions.emplace_back(std::vector<uint8_t>(solution, solution + equihash_context_.solution_size), nonce);
+
+            // Rows on indices storage keep their leaves sorted, which is not the order of a solution
+            if(equihash_context_.storage_mode == STORAGE_INDICES && !verifier.order_proof(solutions.back()))
+            {
+                solutions.pop_back();
+            }
+        }
+        unmap_results(solutions_buffer_, mapped);
+
+        // The kernel stores them in whatever order the work items got to them
+        std::sort(solutions.begin(), solutions.end(), [](const Proof & a, const Proof & b)
+        {
+            return a.get_solution() < b.get_solution();
+        });
+
+        return solutions;
+    }
+
+    size_t EquihashGPUWorker::solve_nonces(std::atomic<size_t> & next_nonce, size_t last_nonce,
+                                           std::atomic<bool> & stop, const std::atomic<bool> & cancel,
+                                           bool stop_on_first, const SolutionCallback & callback)
+    {
+        size_t solved = 0;
+        size_t nonce = next_nonce.fetch_add(1);
+        if(nonce >= last_nonce)
+        {
+            return solved;
+        }
+
+        // The first nonce has nothing to overlap with
+        enqueue_hash_kernel(nonce, false, gpu_device_.queue, true);
+        while(!stop && !cancel)
+        {
+            // The next nonce is taken ahead, so it can be hashed during the rounds of this one
+            size_t next = next_nonce.fetch_add(1);
+            bool has_next = next < last_nonce;
+
+            // Start hashing the next nonce into the spare table, the hash queue runs alongside the rounds
+            if(pipelined_ && has_next)
+            {
+                enqueue_hash_kernel(next, true, gpu_device_.hash_queue, false);
+            }
+
+            // Perform the coliision detection
+            size_t nonce_solutions = 0;
+            if(enqueue_and_run_coliision_detection_rounds_kernel(cancel) && !cancel)
+            {
+                // Perform the final round and get the solutions if any
+                std::vector<Proof> && solutions = enqueue_and_run_solutions_kernel(nonce);
+                for(auto && proof : solutions)
+                {
+                    callback(proof);
+                }
+                if(stop_on_first && !solutions.empty())
+                {
+                    stop = true;
+                }
+                nonce_solutions = solutions.size();
+            }
+            if(cancel)
+            {
+                break;
+            }
+            solved++;
+            {
+                std::lock_guard<std::mutex> lock(metrics_mutex_);
+                metrics_.add_nonce(nonce_solutions);
+            }
+
+            if(!has_next)
+            {
+                break;
+            }
+
+            if(pipelined_)
+            {
+                // The rounds are done with the current leaves, the hashed ones take their place
+                gpu_device_.hash_queue.finish();
+                record_pending_hash();
+                std::swap(table_buffer_, next_table_buffer_);
+                std::swap(digest_buffer_, next_digest_buffer_);
+                if(fused_)
+                {
+                    std::swap(bucket_sizes_buffer_, next_bucket_sizes_buffer_);
+                    std::swap(buckets_buffer_, next_buckets_buffer_);
+                    std::swap(dropped_rows_buffer_, next_dropped_rows_buffer_);
+                }
+            }
+            else
+            {
+                enqueue_hash_kernel(next, false, gpu_device_.queue, true);
+            }
+            nonce = next;
+        }
+
+        // A hash of the next nonce may still be running into the spare table
+        gpu_device_.hash_queue.finish();
+        record_pending_hash();
+
+        return solved;
+    }
+}
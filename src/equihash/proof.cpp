@@ -33,6 +33,11 @@ namespace Equihash
         return solution_;
     }
 
+    const std::vector<uint8_t> & Proof::get_solution()const
+    {
+        return solution_;
+    }
+
     void Proof::set_solution(const std::vector<uint8_t> & sol)
     {
         solution_ = sol;
@@ -1,10 +1,66 @@
 #include <equihash_gpu/equihash/gpu/equihash_gpu_solver.h>
+#include <equihash_gpu/equihash/cpu/equihash_cpu_solver.h>
+#include <equihash_gpu/equihash/equihash_verifier.h>
+#include <equihash_gpu/daemon/equihash_daemon.h>
+#include <equihash_gpu/daemon/equihash_daemon_client.h>
+#include <equihash_gpu/util/Timer.h>
 #include <stdio.h>
+#include <signal.h>
+#include <ctype.h>
+#include <memory>
+
+static Equihash::EquihashDaemon * running_daemon = nullptr;
+
+static void stop_daemon(int)
+{
+    if (running_daemon)
+    {
+        running_daemon->stop();
+    }
+}
+
+// Two hex digits per byte, nothing else is accepted
+static bool parse_hex(const char * hex, std::vector<uint8_t> & bytes)
+{
+    size_t length = strlen(hex);
+    if (length % 2 != 0)
+    {
+        return false;
+    }
+    bytes.clear();
+    for (size_t i = 0; i < length; i += 2)
+    {
+        char digits[3] = {hex[i], hex[i+1], 0};
+        char * end = nullptr;
+        bytes.push_back(strtoul(digits, &end, 16));
+        if (*end != 0 || !isxdigit(hex[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
 
 int main(int argc, char ** argv)
 {
     uint32_t n = 0, k=0;
     uint32_t seed[SEED_SIZE] = {0, 0, 0, 0};
+    bool use_cpu = false;
+    Equihash::EquihashGPUStorage storage = Equihash::STORAGE_PACKED;
+    size_t threads = 0;
+    size_t cpu_threads = 0;
+    bool pipelined = true;
+    bool specialized = true;
+    bool tiled = true;
+    bool fused = true;
+    size_t nonces = 0;
+    bool streaming = false;
+    bool tuning = false;
+    const char * daemon_path = nullptr;
+    const char * job_path = nullptr;
+    const char * metrics_path = nullptr;
+    std::vector<uint8_t> header;
+    uint8_t header_nonce[EQUIHASH_NONCE_SIZE] = {0};
     if (argc < 2) 
     {
         return 1;
@@ -44,6 +100,261 @@ int main(int argc, char ** argv)
                 return 1;
             }
         }
+        else if (!strcmp(a, "-b"))
+        {
+            if (i < argc - 1)
+            {
+                i++;
+                if (!strcmp(argv[i], "cpu"))
+                {
+                    use_cpu = true;
+                }
+                else if (strcmp(argv[i], "gpu"))
+                {
+                    printf("bad -b argument, expected cpu or gpu");
+                    return 1;
+                }
+                continue;
+            }
+            else
+            {
+                printf("missing -b argument");
+                return 1;
+            }
+        }
+        else if (!strcmp(a, "-m"))
+        {
+            if (i < argc - 1)
+            {
+                i++;
+                if (!strcmp(argv[i], "indices"))
+                {
+                    storage = Equihash::STORAGE_INDICES;
+                }
+                else if (!strcmp(argv[i], "tree"))
+                {
+                    storage = Equihash::STORAGE_TREE;
+                }
+                else if (strcmp(argv[i], "packed"))
+                {
+                    printf("bad -m argument, expected packed, tree or indices");
+                    return 1;
+                }
+                continue;
+            }
+            else
+            {
+                printf("missing -m argument");
+                return 1;
+            }
+        }
+        else if (!strcmp(a, "-p"))
+        {
+            if (i < argc - 1)
+            {
+                i++;
+                if (!strcmp(argv[i], "serial"))
+                {
+                    pipelined = false;
+                }
+                else if (strcmp(argv[i], "pipelined"))
+                {
+                    printf("bad -p argument, expected pipelined or serial");
+                    return 1;
+                }
+                continue;
+            }
+            else
+            {
+                printf("missing -p argument");
+                return 1;
+            }
+        }
+        else if (!strcmp(a, "-c"))
+        {
+            if (i < argc - 1)
+            {
+                i++;
+                if (!strcmp(argv[i], "generic"))
+                {
+                    specialized = false;
+                }
+                else if (strcmp(argv[i], "specialized"))
+                {
+                    printf("bad -c argument, expected specialized or generic");
+                    return 1;
+                }
+                continue;
+            }
+            else
+            {
+                printf("missing -c argument");
+                return 1;
+            }
+        }
+        else if (!strcmp(a, "-l"))
+        {
+            if (i < argc - 1)
+            {
+                i++;
+                if (!strcmp(argv[i], "global"))
+                {
+                    tiled = false;
+                }
+                else if (strcmp(argv[i], "tiled"))
+                {
+                    printf("bad -l argument, expected tiled or global");
+                    return 1;
+                }
+                continue;
+            }
+            else
+            {
+                printf("missing -l argument");
+                return 1;
+            }
+        }
+        else if (!strcmp(a, "-f"))
+        {
+            if (i < argc - 1)
+            {
+                i++;
+                if (!strcmp(argv[i], "separate"))
+                {
+                    fused = false;
+                }
+                else if (strcmp(argv[i], "fused"))
+                {
+                    printf("bad -f argument, expected fused or separate");
+                    return 1;
+                }
+                continue;
+            }
+            else
+            {
+                printf("missing -f argument");
+                return 1;
+            }
+        }
+        else if (!strcmp(a, "-r"))
+        {
+            if (i < argc - 1)
+            {
+                i++;
+                nonces = strtoul(argv[i], NULL, 10);
+                continue;
+            }
+            else
+            {
+                printf("missing -r argument");
+                return 1;
+            }
+        }
+        else if (!strcmp(a, "-d") || !strcmp(a, "-j"))
+        {
+            if (i < argc - 1)
+            {
+                i++;
+                (!strcmp(a, "-d") ? daemon_path : job_path) = argv[i];
+                continue;
+            }
+            else
+            {
+                printf("missing socket path for %s", a);
+                return 1;
+            }
+        }
+        else if (!strcmp(a, "-P"))
+        {
+            if (i < argc - 1)
+            {
+                i++;
+                metrics_path = argv[i];
+                continue;
+            }
+            else
+            {
+                printf("missing -P argument");
+                return 1;
+            }
+        }
+        else if (!strcmp(a, "-H"))
+        {
+            if (i < argc - 1)
+            {
+                i++;
+                if (!parse_hex(argv[i], header) || header.empty())
+                {
+                    printf("bad -H argument, expected the header in hex");
+                    return 1;
+                }
+                continue;
+            }
+            else
+            {
+                printf("missing -H argument");
+                return 1;
+            }
+        }
+        else if (!strcmp(a, "-x"))
+        {
+            std::vector<uint8_t> nonce_bytes;
+            if (i < argc - 1)
+            {
+                i++;
+                if (!parse_hex(argv[i], nonce_bytes) || nonce_bytes.size() != EQUIHASH_NONCE_SIZE)
+                {
+                    printf("bad -x argument, expected a %d byte nonce in hex", EQUIHASH_NONCE_SIZE);
+                    return 1;
+                }
+                memcpy(header_nonce, nonce_bytes.data(), EQUIHASH_NONCE_SIZE);
+                continue;
+            }
+            else
+            {
+                printf("missing -x argument");
+                return 1;
+            }
+        }
+        else if (!strcmp(a, "-a"))
+        {
+            streaming = true;
+            continue;
+        }
+        else if (!strcmp(a, "-C"))
+        {
+            // Host threads that co-solve with the gpu backend, auto leaves a core per device
+            if (i < argc - 1)
+            {
+                i++;
+                cpu_threads = !strcmp(argv[i], "auto") ? CPU_THREADS_AUTO : strtoul(argv[i], NULL, 10);
+                continue;
+            }
+            else
+            {
+                printf("missing -C argument");
+                return 1;
+            }
+        }
+        else if (!strcmp(a, "-T"))
+        {
+            tuning = true;
+            continue;
+        }
+        else if (!strcmp(a, "-t"))
+        {
+            if (i < argc - 1)
+            {
+                i++;
+                threads = strtoul(argv[i], NULL, 10);
+                continue;
+            }
+            else
+            {
+                printf("missing -t argument");
+                return 1;
+            }
+        }
         if (!strcmp(a, "-s")) {
             if (i < argc - 1) {
                 i++;
@@ -74,6 +385,163 @@ int main(int argc, char ** argv)
         printf("%d  ", seed[j]);
     }
     printf("\n");
-    Equihash::EquihashGPUSolver solver(n, k, seed);
-    solver.find_proof();
+    if (!header.empty())
+    {
+        printf("Header = %zu bytes, the nonces are added to the -x nonce\n", header.size());
+    }
+    printf("Backend = %s\n", use_cpu ? "cpu" : "gpu");
+
+    std::vector<Equihash::Proof> proofs;
+
+    if (daemon_path)
+    {
+        // The solvers are built with the backend options of the daemon, the jobs only pick N and K
+        Equihash::EquihashDaemon daemon(daemon_path, [=](uint32_t job_n, uint32_t job_k, uint32_t job_seed[SEED_SIZE])
+            -> Equihash::IEquihashSolver *
+        {
+            if (use_cpu)
+            {
+                return new Equihash::EquihashCPUSolver(job_n, job_k, job_seed, threads);
+            }
+            Equihash::EquihashGPUSolver * job_solver =
+                new Equihash::EquihashGPUSolver(job_n, job_k, job_seed, storage, pipelined);
+            job_solver->set_specialized(specialized);
+            job_solver->set_tiled(tiled);
+            job_solver->set_fused(fused);
+            job_solver->set_cpu_threads(cpu_threads);
+            return job_solver;
+        });
+
+        running_daemon = &daemon;
+        signal(SIGINT, stop_daemon);
+        signal(SIGTERM, stop_daemon);
+        if (n > 0 && k > 0 && !daemon.warm_up(n, k))
+        {
+            return 1;
+        }
+        bool ok = daemon.run();
+        running_daemon = nullptr;
+        return ok ? 0 : 1;
+    }
+
+    if (job_path)
+    {
+        // Same job as a local solve would run, solved by the daemon on the socket
+        Equihash::EquihashDaemonClient client;
+        Equihash::DaemonJob job;
+        Equihash::DaemonJobResult result;
+        job.N = n;
+        job.K = k;
+        memcpy(job.seed, seed, sizeof(seed));
+        job.first_nonce = 1;
+        job.amount = nonces > 0 ? nonces : MAX_NONCE - 1;
+        job.stop_on_first = nonces == 0;
+        job.header = header;
+        memcpy(job.nonce, header_nonce, EQUIHASH_NONCE_SIZE);
+
+        Timer timer;
+        if (!client.connect(job_path) || !client.submit_job(job) ||
+            !client.wait_job([&proofs](const Equihash::Proof & proof)
+            {
+                printf("Solution for nonce %u\n", proof.get_solution_nonce());
+                proofs.push_back(proof);
+            }, result))
+        {
+            printf("Job failed: %s\n", client.get_error().c_str());
+            return 1;
+        }
+        printf("Job done in %.2f ms, %u solutions of %u nonces%s\n", timer.elapsed() / 1e6,
+               result.solutions, result.solved_nonces, result.cancelled ? " (cancelled)" : "");
+    }
+    else
+    {
+        std::unique_ptr<Equihash::IEquihashSolver> solver;
+        Equihash::EquihashGPUSolver * gpu_solver = nullptr;
+        if (use_cpu)
+        {
+            solver.reset(new Equihash::EquihashCPUSolver(n, k, seed, threads));
+        }
+        else
+        {
+            gpu_solver = new Equihash::EquihashGPUSolver(n, k, seed, storage, pipelined);
+            gpu_solver->set_specialized(specialized);
+            gpu_solver->set_tiled(tiled);
+            gpu_solver->set_fused(fused);
+            gpu_solver->set_cpu_threads(cpu_threads);
+            solver.reset(gpu_solver);
+        }
+
+        if (!header.empty() && !solver->set_header(header, header_nonce))
+        {
+            return 1;
+        }
+
+        if (tuning)
+        {
+            // Every candidate solves the same nonces, -r sets how many
+            if (!gpu_solver)
+            {
+                printf("-T tunes the gpu backend only");
+                return 1;
+            }
+            return gpu_solver->tune(nonces > 0 ? nonces : 2) ? 0 : 1;
+        }
+
+        if (streaming)
+        {
+            // Solutions are printed as they come in, the channel holds the solver back if they are not read
+            std::shared_ptr<Equihash::ProofChannel> channel(new Equihash::ProofChannel(16));
+            std::shared_ptr<Equihash::SolveHandle> handle =
+                solver->solve_async(1, nonces > 0 ? nonces : MAX_NONCE - 1, channel, nonces == 0);
+            Equihash::Proof proof;
+            while (channel->pop(proof))
+            {
+                printf("Solution for nonce %u\n", proof.get_solution_nonce());
+                proofs.push_back(proof);
+            }
+            handle->wait();
+            printf("Streamed %zu solutions of %zu nonces\n", handle->get_solutions(), handle->get_solved_nonces());
+        }
+        else if (use_cpu)
+        {
+            proofs = solver->find_proof();
+        }
+        else
+        {
+            // Either a fixed range of nonces for a sustained rate, or until the first solution
+            proofs = (nonces > 0) ? gpu_solver->solve_nonces(1, nonces) : solver->find_proof();
+        }
+
+        // Per device stage times, and the same in prometheus text format for the scrapers
+        if (gpu_solver && metrics_path)
+        {
+            std::vector<Equihash::EquihashGPUMetrics> metrics = gpu_solver->get_metrics();
+            Equihash::EquihashGPUMetricsExporter::print(metrics);
+            if (!Equihash::EquihashGPUMetricsExporter::write_prometheus(metrics_path, metrics))
+            {
+                printf("Could not write the metrics to %s\n", metrics_path);
+            }
+        }
+    }
+
+    // Check whatever was found before reporting it
+    Equihash::EquihashContext context;
+    context.N = n;
+    context.K = k;
+    memcpy(context.seed, seed, sizeof(seed));
+    Equihash::EquihashInput input;
+    if (header.empty())
+    {
+        Equihash::EquihashUtils::initialize_input(n, k, seed, input);
+    }
+    else if (!Equihash::EquihashUtils::initialize_input(n, k, header.data(), header.size(), header_nonce, input))
+    {
+        printf("Can not verify the proofs of a %zu byte header\n", header.size());
+        return 1;
+    }
+    Equihash::EquihashVerifier verifier(context, input, threads);
+    Equihash::VerificationStats stats;
+    verifier.verify_batch(proofs, &stats);
+    printf("Verified %zu/%zu proofs (%.0f proofs/sec)\n",
+           stats.verified, stats.proofs, stats.proofs_per_second);
 }
\ No newline at end of file
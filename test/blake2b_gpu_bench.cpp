@@ -8,6 +8,21 @@
 #include <chrono>
 #include <blake2.h>
 #include <equihash_gpu/util/Timer.h>
+#include <equihash_gpu/equihash/gpu/equihash_kernels.h>
+#include <equihash_gpu/equihash/equihash_blake2b.h>
+
+// Leaves of a single 200,9 nonce, 2 leaves per hash
+#define LEAF_HASHES (1 << 20)
+#define LEAF_HASH_SIZE 50
+
+// Host mirror of blake2b_state on the GPU
+struct BlakeGPUState
+{
+    uint64_t hash_state[8];
+    uint8_t  buf[2*BLAKE2B_BLOCKBYTES];
+    uint32_t buflen;
+    uint64_t t[2];
+};
 
 const char *err_code (cl_int err_in)
 {
@@ -118,6 +133,115 @@ const char *err_code (cl_int err_in)
     }
 }
 
+void print_leaf_rate(const char * name, int64_t elapsed, bool matches)
+{
+    std::cout << name << ": " << LEAF_HASHES << " leaf hashes in " << elapsed / 1000000 << "ms = "
+              << (uint64_t)(LEAF_HASHES / (elapsed / 1e9)) << " hashes/s"
+              << (matches ? "" : " (MISMATCH)") << std::endl;
+}
+
+// Hashes all of the leaves of a nonce like the solver does, once with the generic
+// update/finalize kernel, once from the midstate and once on the host with libb2
+void bench_leaf_hashes(cl::Context & context, cl::CommandQueue & queue, cl::Program & program)
+{
+    int err = 0;
+    uint32_t seed[4] = {7, 7, 7, 7};
+    uint32_t nonce = 1;
+
+    // Personalized the same way as EquihashUtils::initialize_input for 200,9
+    blake2b_param param;
+    memset(&param, 0, sizeof(param));
+    param.fanout = 1;
+    param.depth = 1;
+    param.digest_length = LEAF_HASH_SIZE;
+    memcpy(param.personal, "ZcashPoW", 8);
+    *(uint32_t *)(param.personal + 8) = 200;
+    *(uint32_t *)(param.personal + 12) = 9;
+    blake2b_state initial_state;
+    blake2b_init_param(&initial_state, &param);
+    blake2b_update(&initial_state, (const uint8_t*)seed, sizeof(seed));
+    blake2b_update(&initial_state, (const uint8_t*)&nonce, sizeof(nonce));
+
+    // Reference hashes on the host
+    std::vector<uint8_t> expected((size_t)LEAF_HASHES * LEAF_HASH_SIZE);
+    Timer libb2_timer;
+    for(uint32_t i=0;i<LEAF_HASHES;i++)
+    {
+        blake2b_state state = initial_state;
+        blake2b_update(&state, (const uint8_t*)&i, sizeof(i));
+        blake2b_final(&state, &expected[(size_t)i*LEAF_HASH_SIZE], LEAF_HASH_SIZE);
+    }
+    int64_t libb2_elapsed = libb2_timer.elapsed();
+
+    BlakeGPUState gpu_state;
+    memset(&gpu_state, 0, sizeof(gpu_state));
+    memcpy(gpu_state.hash_state, initial_state.h, sizeof(gpu_state.hash_state));
+    memcpy(gpu_state.buf, initial_state.buf, initial_state.buflen);
+    gpu_state.buflen = initial_state.buflen;
+    gpu_state.t[0] = initial_state.t[0];
+    gpu_state.t[1] = initial_state.t[1];
+
+    Equihash::Blake2bMidstate midstate;
+    Equihash::EquihashBlake2b::create_midstate(initial_state, LEAF_HASH_SIZE, midstate);
+
+    cl::Buffer state_buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(gpu_state), &gpu_state, &err);
+    cl::Buffer midstate_buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(midstate), &midstate, &err);
+    cl::Buffer out_buffer(context, CL_MEM_WRITE_ONLY, expected.size(), nullptr, &err);
+    std::vector<uint8_t> result(expected.size());
+
+    auto run_kernel = [&](const char * kernel_name, cl::Buffer & input) -> int64_t
+    {
+        cl::Kernel kernel(program, kernel_name, &err);
+        kernel.setArg(0, input);
+        kernel.setArg(1, out_buffer);
+        kernel.setArg(2, (uint32_t)LEAF_HASH_SIZE);
+
+        // Warm up once, then time a single launch over all of the leaves
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(LEAF_HASHES), cl::NullRange);
+        queue.finish();
+        Timer timer;
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(LEAF_HASHES), cl::NullRange);
+        queue.finish();
+        int64_t elapsed = timer.elapsed();
+
+        queue.enqueueReadBuffer(out_buffer, true, 0, result.size(), result.data());
+        return elapsed;
+    };
+
+    int64_t generic_elapsed = run_kernel("blake2b_gpu_leaf_hash_generic", state_buffer);
+    bool generic_matches = result == expected;
+    int64_t midstate_elapsed = run_kernel("blake2b_gpu_leaf_hash", midstate_buffer);
+    bool midstate_matches = result == expected;
+
+    print_leaf_rate("Generic kernel ", generic_elapsed, generic_matches);
+    print_leaf_rate("Midstate kernel", midstate_elapsed, midstate_matches);
+    print_leaf_rate("libb2 (host)   ", libb2_elapsed, true);
+
+    // The host lanes from the same midstate, a single thread like libb2 above
+    std::vector<uint32_t> indices(LEAF_HASHES);
+    for(uint32_t i=0;i<LEAF_HASHES;i++)
+    {
+        indices[i] = i;
+    }
+    for(int implementation=Equihash::BLAKE2B_SCALAR;implementation<=Equihash::BLAKE2B_AVX512;implementation++)
+    {
+        if(!Equihash::EquihashBlake2b::is_supported((Equihash::Blake2bImplementation)implementation))
+        {
+            continue;
+        }
+
+        std::fill(result.begin(), result.end(), 0);
+        Timer timer;
+        Equihash::EquihashBlake2b::hash_leaves(midstate, indices.data(), indices.size(), result.data(),
+                                               (Equihash::Blake2bImplementation)implementation);
+        int64_t elapsed = timer.elapsed();
+
+        std::string name = std::string("Host ") + Equihash::BLAKE2B_IMPLEMENTATION_NAMES[implementation];
+        name.resize(15, ' ');
+        print_leaf_rate(name.c_str(), elapsed, result == expected);
+    }
+}
+
 int main(int argc, char ** argv)
 {
     // Discover platforms
@@ -125,7 +249,7 @@ int main(int argc, char ** argv)
     cl::Platform * nvidiaPlatform = nullptr;
     cl::Platform::get(&platforms);
 
-    // Find the NVIDIA platform to work with
+    // Find the NVIDIA platform to work with, any other platform does as well
     std::string platformName;
     for(auto && platform : platforms) 
     {
@@ -138,6 +262,10 @@ int main(int argc, char ** argv)
             break;
         }
     }
+    if(!nvidiaPlatform && !platforms.empty())
+    {
+        nvidiaPlatform = &platforms[0];
+    }
 
     if(nvidiaPlatform)
     {
@@ -159,10 +287,8 @@ int main(int argc, char ** argv)
             cl::Buffer inMessage = cl::Buffer(context, std::begin(message), std::end(message), true, false &err);;
             cl::Buffer outHash(context, CL_MEM_WRITE_ONLY, 64, nullptr, &err);
 
-            // Read the .cl file
-            std::ifstream stream("/home/ofir/Desktop/Equihash/equihash_gpu/include/equihash_gpu/blake2b/blake2b.cl");
-            std::string program = std::string(std::istreambuf_iterator<char>(stream),
-                (std::istreambuf_iterator<char>()));            
+            // The .cl file is embedded at build time
+            std::string program = Equihash::BLAKE2B_KERNEL_SOURCE;
 
             // Create the program and load the .cl file
             cl::Program testProgram(context, program, true, &err);
@@ -231,6 +357,8 @@ int main(int argc, char ** argv)
             std::cout << "Blake Elapsed time = " << t2 << std::endl;
 
             std::cout << "Simple bench rate diff [MS] = " << (t2-t1)/1000000 << std::endl; 
+
+            bench_leaf_hashes(context, queue, testProgram);
         }
     }
 }
\ No newline at end of file
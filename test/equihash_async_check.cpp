@@ -0,0 +1,62 @@
+#include <equihash_gpu/equihash/cpu/equihash_cpu_solver.h>
+#include <equihash_gpu/util/Timer.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <memory>
+#include <thread>
+
+// A solve that nobody reads the channel of has to stop as soon as it is cancelled
+// The alarm takes the check down if a cancel blocks, so a hang fails the run instead of stalling it
+
+// Longer than any single collision round of 48,5 on the host, with room for a loaded machine
+#define MAX_CANCEL_SECONDS 5.0
+#define CHECK_TIMEOUT_SECONDS 60
+
+// Starts a solve into a channel of a single slot and waits until the solver is blocked on it
+static std::shared_ptr<Equihash::SolveHandle> fill_channel(Equihash::IEquihashSolver & solver)
+{
+    std::shared_ptr<Equihash::ProofChannel> channel(new Equihash::ProofChannel(1));
+    std::shared_ptr<Equihash::SolveHandle> handle = solver.solve_async(1, 1000, channel);
+
+    // The second solution is counted before it is pushed, from then on the push waits for room
+    while(handle->get_solutions() < 2 && !handle->is_done())
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return handle;
+}
+
+static bool check(const char * name, bool passed, double seconds)
+{
+    printf("%-40s %s (%.2fs)\n", name, passed ? "ok" : "failed", seconds);
+    return passed;
+}
+
+int main()
+{
+    alarm(CHECK_TIMEOUT_SECONDS);
+
+    uint32_t seed[SEED_SIZE] = {7, 7, 7, 7};
+    Equihash::EquihashCPUSolver solver(48, 5, seed, 1);
+    bool passed = true;
+
+    // Cancelling the handle stops the solve blocked on the channel
+    std::shared_ptr<Equihash::SolveHandle> handle = fill_channel(solver);
+    bool blocked = !handle->is_done();
+    Timer timer;
+    handle->cancel();
+    handle->wait();
+    double seconds = timer.elapsed() / 1e9;
+    passed &= check("cancel with a full channel", blocked && seconds < MAX_CANCEL_SECONDS, seconds);
+
+    // A new solve cancels the blocked one before it starts
+    handle = fill_channel(solver);
+    blocked = !handle->is_done();
+    timer.reset();
+    solver.solve_async(1, 1, Equihash::SolutionCallback())->wait();
+    seconds = timer.elapsed() / 1e9;
+    passed &= check("new solve over a full channel", blocked && handle->is_done() && seconds < MAX_CANCEL_SECONDS,
+                    seconds);
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,485 @@
+#include <equihash_gpu/equihash/gpu/equihash_gpu_solver.h>
+#include <equihash_gpu/equihash/cpu/equihash_cpu_solver.h>
+#include <equihash_gpu/equihash/equihash_verifier.h>
+#include <equihash_gpu/util/Timer.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+// Every run happens in a child process of its own, so its peak memory can be measured
+// and a run that runs out of memory does not take the rest of the runs with it
+
+struct Preset
+{
+    uint32_t N, K;
+    size_t nonces;
+};
+
+// Fewer nonces for the larger parameters, enough for a stable rate without taking all day
+static const Preset PRESETS[] = {
+    {48, 5, 64},
+    {96, 5, 8},
+    {144, 5, 2},
+    {192, 7, 2},
+    {200, 9, 2}
+};
+
+struct Options
+{
+    std::vector<Preset> presets;
+    bool run_gpu = true;
+    bool run_cpu = true;
+    size_t nonces = 0;
+    uint32_t seed = 7;
+    size_t threads = 0;
+    bool verbose = false;
+    std::string output = "equihash_bench.json";
+    std::string baseline;
+    double max_regression = 10;
+};
+
+struct ChildResult
+{
+    bool ok;
+    std::string output;
+    long peak_rss_kb;
+};
+
+static std::string json_escape(const std::string & value)
+{
+    std::string escaped;
+    for(char c : value)
+    {
+        if(c == '"' || c == '\\')
+        {
+            escaped += '\\';
+        }
+        if((unsigned char)c < 0x20)
+        {
+            escaped += ' ';
+            continue;
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+static ChildResult run_in_child(const std::function<std::string()> & body, bool verbose)
+{
+    ChildResult result = {false, "", 0};
+    int fds[2];
+    if(pipe(fds) < 0)
+    {
+        return result;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return result;
+    }
+
+    if(pid == 0)
+    {
+        close(fds[0]);
+        // The solvers are chatty, only the results go back through the pipe
+        if(!verbose)
+        {
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(null_fd, STDOUT_FILENO);
+        }
+        std::string output = body();
+        fflush(stdout);
+        const char * data = output.data();
+        size_t left = output.size();
+        while(left > 0)
+        {
+            ssize_t written = write(fds[1], data, left);
+            if(written <= 0)
+            {
+                _exit(1);
+            }
+            data += written;
+            left -= written;
+        }
+        _exit(0);
+    }
+
+    close(fds[1]);
+    char buffer[4096];
+    ssize_t got;
+    while((got = read(fds[0], buffer, sizeof(buffer))) > 0)
+    {
+        result.output.append(buffer, got);
+    }
+    close(fds[0]);
+
+    int status = 0;
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    wait4(pid, &status, 0, &usage);
+    result.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    result.peak_rss_kb = usage.ru_maxrss;
+    return result;
+}
+
+// Names of the OpenCL devices in the order the solver counts them, the child keeps the driver out of this process
+static std::vector<std::string> list_devices()
+{
+    ChildResult result = run_in_child([]()
+    {
+        std::string names;
+        std::vector<cl::Platform> platforms;
+        cl::Platform::get(&platforms);
+        for(auto && platform : platforms)
+        {
+            std::vector<cl::Device> devices;
+            platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+            for(auto && device : devices)
+            {
+                names += device.getInfo<CL_DEVICE_NAME>() + "\n";
+            }
+        }
+        return names;
+    }, false);
+
+    std::vector<std::string> devices;
+    std::istringstream lines(result.output);
+    std::string line;
+    while(std::getline(lines, line))
+    {
+        devices.push_back(line);
+    }
+    return devices;
+}
+
+static std::string stages_json(const Equihash::EquihashGPUMetrics & metrics)
+{
+    auto average_ms = [](const Equihash::EquihashKernelMetrics & kernel)
+    {
+        return kernel.launches > 0 ? kernel.execution_ns / 1e6 / kernel.launches : 0;
+    };
+
+    std::ostringstream out;
+    out << "{\"hash\": " << average_ms(metrics.hash) << ", \"bucket\": [";
+    for(size_t i=0;i<metrics.bucket.size();i++)
+    {
+        out << (i ? ", " : "") << average_ms(metrics.bucket[i]);
+    }
+    out << "], \"collision\": [";
+    for(size_t i=0;i<metrics.rounds.size();i++)
+    {
+        out << (i ? ", " : "") << average_ms(metrics.rounds[i]);
+    }
+    out << "], \"solutions\": " << average_ms(metrics.solutions_kernel) << "}";
+    return out.str();
+}
+
+// Solves the nonces of the preset once the solver is prepared, the fields of the json run
+static std::string run_preset(const Preset & preset, bool use_cpu, size_t device, const Options & options)
+{
+    uint32_t seed[SEED_SIZE];
+    for(size_t i=0;i<SEED_SIZE;i++)
+    {
+        seed[i] = options.seed;
+    }
+
+    std::unique_ptr<Equihash::IEquihashSolver> solver;
+    Equihash::EquihashGPUSolver * gpu_solver = nullptr;
+    if(use_cpu)
+    {
+        solver.reset(new Equihash::EquihashCPUSolver(preset.N, preset.K, seed, options.threads));
+    }
+    else
+    {
+        gpu_solver = new Equihash::EquihashGPUSolver(preset.N, preset.K, seed);
+        gpu_solver->set_devices(std::vector<size_t>(1, device));
+        solver.reset(gpu_solver);
+    }
+
+    // An empty range prepares the solver, the setup is not part of the rate
+    solver->solve_async(1, 0, Equihash::SolutionCallback())->wait();
+
+    std::vector<Equihash::Proof> proofs;
+    std::mutex proofs_mutex;
+    size_t nonces = options.nonces > 0 ? options.nonces : preset.nonces;
+    Timer timer;
+    std::shared_ptr<Equihash::SolveHandle> handle = solver->solve_async(1, nonces,
+        [&proofs, &proofs_mutex](const Equihash::Proof & proof)
+    {
+        std::lock_guard<std::mutex> lock(proofs_mutex);
+        proofs.push_back(proof);
+    });
+    handle->wait();
+    double elapsed = timer.elapsed() / 1e9;
+
+    Equihash::EquihashContext context;
+    context.N = preset.N;
+    context.K = preset.K;
+    memcpy(context.seed, seed, sizeof(seed));
+    Equihash::EquihashVerifier verifier(context, options.threads);
+    Equihash::VerificationStats stats;
+    verifier.verify_batch(proofs, &stats);
+
+    size_t solved = handle->get_solved_nonces();
+    std::ostringstream out;
+    out << "\"nonces\": " << solved
+        << ", \"solutions\": " << proofs.size()
+        << ", \"verified\": " << stats.verified
+        << ", \"seconds\": " << elapsed
+        << ", \"sol_per_sec\": " << (elapsed > 0 ? proofs.size() / elapsed : 0)
+        << ", \"nonces_per_sec\": " << (elapsed > 0 ? solved / elapsed : 0);
+
+    if(gpu_solver)
+    {
+        std::vector<Equihash::EquihashGPUMetrics> metrics = gpu_solver->get_metrics();
+        if(!metrics.empty())
+        {
+            out << ", \"device_buffers_bytes\": " << metrics[0].buffers_size
+                << ", \"dropped_rows\": " << metrics[0].bucket_dropped_rows + metrics[0].table_dropped_rows
+                << ", \"stages_ms\": " << stages_json(metrics[0]);
+        }
+    }
+
+    // Nothing solved means the backend could not be prepared
+    out << ", \"status\": \"" << (solved > 0 ? "ok" : "failed") << "\"";
+    return out.str();
+}
+
+// Pulls a field out of a run written by this benchmark, one run per line
+static std::string find_field(const std::string & line, const std::string & name)
+{
+    std::string key = "\"" + name + "\": ";
+    size_t start = line.find(key);
+    if(start == std::string::npos)
+    {
+        return "";
+    }
+    start += key.size();
+    if(line[start] == '"')
+    {
+        size_t end = line.find('"', start + 1);
+        return line.substr(start + 1, end - start - 1);
+    }
+    size_t end = line.find_first_of(",}", start);
+    return line.substr(start, end - start);
+}
+
+static std::string run_key(const std::string & line)
+{
+    return find_field(line, "preset") + "/" + find_field(line, "backend") + "/" + find_field(line, "device");
+}
+
+// Compares the Sol/s of the runs with those of the baseline, false if any fell more than allowed
+static bool check_regressions(const std::vector<std::string> & runs, const Options & options)
+{
+    std::ifstream file(options.baseline);
+    if(!file)
+    {
+        printf("Could not read the baseline %s\n", options.baseline.c_str());
+        return false;
+    }
+
+    std::vector<std::string> baseline;
+    std::string line;
+    while(std::getline(file, line))
+    {
+        if(line.find("\"preset\"") != std::string::npos)
+        {
+            baseline.push_back(line);
+        }
+    }
+
+    bool ok = true;
+    for(auto && run : runs)
+    {
+        for(auto && base : baseline)
+        {
+            if(run_key(run) != run_key(base))
+            {
+                continue;
+            }
+
+            double current = atof(find_field(run, "sol_per_sec").c_str());
+            double previous = atof(find_field(base, "sol_per_sec").c_str());
+            double change = previous > 0 ? 100 * (current - previous) / previous : 0;
+            bool regressed = change < -options.max_regression;
+            printf("%-28s %10.2f -> %10.2f Sol/s (%+.1f%%)%s\n", run_key(run).c_str(), previous, current, change,
+                   regressed ? " REGRESSION" : "");
+            ok = ok && !regressed;
+        }
+    }
+    return ok;
+}
+
+static bool parse_options(int argc, char ** argv, Options & options)
+{
+    for(int i=1;i<argc;i++)
+    {
+        const char * a = argv[i];
+        bool has_value = i < argc - 1;
+        if(!strcmp(a, "-p") && has_value)
+        {
+            // Either a preset or any N,K of its own
+            Preset preset = {0, 0, 1};
+            if(sscanf(argv[++i], "%u,%u", &preset.N, &preset.K) != 2)
+            {
+                printf("bad -p argument, expected N,K\n");
+                return false;
+            }
+            for(auto && known : PRESETS)
+            {
+                if(known.N == preset.N && known.K == preset.K)
+                {
+                    preset.nonces = known.nonces;
+                }
+            }
+            options.presets.push_back(preset);
+        }
+        else if(!strcmp(a, "-b") && has_value)
+        {
+            i++;
+            options.run_gpu = strcmp(argv[i], "cpu") != 0;
+            options.run_cpu = strcmp(argv[i], "gpu") != 0;
+        }
+        else if(!strcmp(a, "-r") && has_value)
+        {
+            options.nonces = strtoul(argv[++i], NULL, 10);
+        }
+        else if(!strcmp(a, "-s") && has_value)
+        {
+            options.seed = strtoul(argv[++i], NULL, 10);
+        }
+        else if(!strcmp(a, "-t") && has_value)
+        {
+            options.threads = strtoul(argv[++i], NULL, 10);
+        }
+        else if(!strcmp(a, "-o") && has_value)
+        {
+            options.output = argv[++i];
+        }
+        else if(!strcmp(a, "-c") && has_value)
+        {
+            options.baseline = argv[++i];
+        }
+        else if(!strcmp(a, "-T") && has_value)
+        {
+            options.max_regression = atof(argv[++i]);
+        }
+        else if(!strcmp(a, "-v"))
+        {
+            options.verbose = true;
+        }
+        else
+        {
+            printf("usage: %s [-p N,K]... [-b gpu|cpu|all] [-r nonces] [-s seed] [-t threads]\n"
+                   "       [-o results.json] [-c baseline.json] [-T max regression %%] [-v]\n", argv[0]);
+            return false;
+        }
+    }
+
+    if(options.presets.empty())
+    {
+        options.presets.assign(std::begin(PRESETS), std::end(PRESETS));
+    }
+    return true;
+}
+
+int main(int argc, char ** argv)
+{
+    Options options;
+    if(!parse_options(argc, argv, options))
+    {
+        return 1;
+    }
+
+    std::vector<std::string> devices;
+    if(options.run_gpu)
+    {
+        devices = list_devices();
+        if(devices.empty())
+        {
+            printf("No OpenCL devices, running the cpu backend only\n");
+        }
+    }
+
+    // A backend entry per OpenCL device and one for the cpu backend
+    struct Backend
+    {
+        bool cpu;
+        size_t device;
+        std::string name;
+    };
+    std::vector<Backend> backends;
+    for(size_t i=0;i<devices.size();i++)
+    {
+        backends.push_back({false, i, devices[i]});
+    }
+    if(options.run_cpu)
+    {
+        backends.push_back({true, 0, "host"});
+    }
+
+    std::vector<std::string> runs;
+    for(auto && preset : options.presets)
+    {
+        for(auto && backend : backends)
+        {
+            printf("%u,%u on %s %s ... ", preset.N, preset.K, backend.cpu ? "cpu" : "gpu", backend.name.c_str());
+            ChildResult result = run_in_child([&]()
+            {
+                return run_preset(preset, backend.cpu, backend.device, options);
+            }, options.verbose);
+
+            std::ostringstream run;
+            run << "{\"preset\": \"" << preset.N << "," << preset.K << "\""
+                << ", \"backend\": \"" << (backend.cpu ? "cpu" : "gpu") << "\""
+                << ", \"device\": \"" << json_escape(backend.name) << "\""
+                << ", \"peak_rss_bytes\": " << (uint64_t)result.peak_rss_kb * 1024 << ", ";
+            if(result.ok && !result.output.empty())
+            {
+                run << result.output << "}";
+            }
+            else
+            {
+                // Killed, most likely for running out of memory
+                run << "\"status\": \"crashed\"}";
+            }
+            runs.push_back(run.str());
+
+            std::string line = runs.back();
+            printf("%s, %s Sol/s, %s nonces/s, peak %.0f MB\n", find_field(line, "status").c_str(),
+                   find_field(line, "sol_per_sec").c_str(), find_field(line, "nonces_per_sec").c_str(),
+                   result.peak_rss_kb / 1024.0);
+        }
+    }
+
+    // One run per line keeps the file diffable and easy to compare against
+    std::ofstream file(options.output);
+    file << "{\n  \"seed\": " << options.seed << ",\n  \"runs\": [\n";
+    for(size_t i=0;i<runs.size();i++)
+    {
+        file << "    " << runs[i] << (i + 1 < runs.size() ? "," : "") << "\n";
+    }
+    file << "  ]\n}\n";
+    file.close();
+    printf("Results written to %s\n", options.output.c_str());
+
+    if(!options.baseline.empty() && !check_regressions(runs, options))
+    {
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include <equihash_gpu/daemon/equihash_daemon.h>
+#include <equihash_gpu/daemon/equihash_daemon_client.h>
+#include <equihash_gpu/equihash/cpu/equihash_cpu_solver.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include <thread>
+
+// Jobs come off the socket as they are, parameters the solvers can not take have to be refused
+// before any solver is made for them, and a good job on the same connection still has to go through
+
+#define CHECK_TIMEOUT_SECONDS 60
+#define CONNECT_ATTEMPTS 100
+
+struct BadJob
+{
+    uint32_t N, K;
+    const char * reason;
+};
+
+static const BadJob BAD_JOBS[] = {
+    {512, 127, "K past the index width"},
+    {48, 1, "a single round"},
+    {100, 4, "N not in whole bytes"},
+    {0, 0, "empty parameters"}
+};
+
+static bool check(const std::string & name, bool passed)
+{
+    printf("%-40s %s\n", name.c_str(), passed ? "ok" : "failed");
+    return passed;
+}
+
+static Equihash::DaemonJob make_job(uint32_t N, uint32_t K)
+{
+    Equihash::DaemonJob job = Equihash::DaemonJob();
+    job.N = N;
+    job.K = K;
+    job.first_nonce = 1;
+    job.amount = 2;
+    return job;
+}
+
+int main()
+{
+    alarm(CHECK_TIMEOUT_SECONDS);
+
+    std::string socket_path = "/tmp/equihash_daemon_check." + std::to_string(getpid()) + ".sock";
+    std::atomic<size_t> solvers_made(0);
+    Equihash::EquihashDaemon daemon(socket_path, [&solvers_made](uint32_t N, uint32_t K, uint32_t seed[SEED_SIZE])
+        -> Equihash::IEquihashSolver *
+    {
+        solvers_made++;
+        return new Equihash::EquihashCPUSolver(N, K, seed, 1);
+    });
+    std::thread daemon_thread([&daemon]()
+    {
+        daemon.run();
+    });
+
+    Equihash::EquihashDaemonClient client;
+    bool connected = false;
+    for(size_t i=0;i<CONNECT_ATTEMPTS && !connected;i++)
+    {
+        connected = client.connect(socket_path);
+        if(!connected)
+        {
+            usleep(50000);
+        }
+    }
+
+    bool passed = check("connect to the daemon", connected);
+    for(size_t i=0;connected && i<sizeof(BAD_JOBS)/sizeof(BAD_JOBS[0]);i++)
+    {
+        const BadJob & bad = BAD_JOBS[i];
+        Equihash::DaemonJobResult result;
+        bool refused = client.submit_job(make_job(bad.N, bad.K)) &&
+                       !client.wait_job(Equihash::SolutionCallback(), result) && client.get_error() == "Bad job frame";
+        passed &= check("refuse " + std::to_string(bad.N) + "," + std::to_string(bad.K) + ", " + bad.reason, refused);
+    }
+    passed &= check("no solver for refused jobs", solvers_made == 0);
+
+    if(connected)
+    {
+        Equihash::DaemonJobResult result;
+        bool solved = client.submit_job(make_job(48, 5)) &&
+                      client.wait_job(Equihash::SolutionCallback(), result) && result.solved_nonces == 2;
+        passed &= check("solve 48,5 after them", solved);
+    }
+
+    client.disconnect();
+    daemon.stop();
+    daemon_thread.join();
+    unlink(socket_path.c_str());
+    return passed ? 0 : 1;
+}